@@ -0,0 +1,130 @@
+// sqnice/backup.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_BACKUP_H
+#define SQNICE_BACKUP_H
+
+#include "sqnice/base.hh"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class pool;
+
+    /** Progress of a `backup_job`, passed to its progress callback. */
+    struct backup_progress {
+        int      remaining;     ///< Pages left to copy
+        int      page_count;    ///< Total pages in the source database
+        int      step_pages;    ///< Current number of pages copied per step
+        status   last_status;   ///< Result of the last step: ok, done, busy or locked
+    };
+
+
+    /** Parameters of a `backup_job`. */
+    struct backup_options {
+        /// Initial number of pages copied per step. It's adjusted as the backup runs: halved
+        /// whenever a step finds the source busy or locked, and grown back after clean steps.
+        int pages_per_step = 64;
+        int min_pages_per_step = 4;
+        int max_pages_per_step = 1024;
+
+        /// Time to sleep between steps, giving other connections a chance to use the database.
+        std::chrono::milliseconds sleep_interval {5};
+
+        /// I/O budget: the maximum average rate at which pages are copied. 0 means unlimited.
+        uint64_t max_bytes_per_second = 0;
+
+        /// If true, the source connection holds a read transaction for the duration, so the
+        /// backup copies one consistent snapshot instead of restarting every time another
+        /// connection writes. This only works in WAL mode, and keeps checkpoints from
+        /// completing until the backup finishes, so the WAL may grow.
+        bool hold_snapshot = true;
+
+        /// Called on the backup thread after every step.
+        std::function<void(backup_progress const&)> on_progress;
+    };
+
+
+    /** Copies a database to a file on a background thread, incrementally and with throttling,
+        so that backing up a large database doesn't hurt the latency of other connections.
+        (`database::backup`, by contrast, runs on the calling thread as fast as possible.)
+
+        The source is a read-only connection borrowed from a `pool` for the duration of the job.
+        The destination file is overwritten. If the job fails or is canceled, it's incomplete. */
+    class backup_job : noncopyable {
+    public:
+        /// Starts a backup of the pool's database to the file at `dest_path`.
+        backup_job(pool& source, std::string_view dest_path, backup_options = {});
+
+        /// Cancels the backup, if it hasn't finished, and waits for the thread to exit.
+        ~backup_job();
+
+        /// Asks the backup to stop after the current step. Thread-safe.
+        void cancel() noexcept;
+
+        /// True once the backup has finished, successfully or not. Thread-safe.
+        bool finished() const noexcept                  {return finished_;}
+
+        /// The most recent progress. Thread-safe.
+        backup_progress progress() const;
+
+        /// Blocks until the backup finishes, then returns its final status:
+        /// `ok` on success, `abort` if it was canceled, or the error that stopped it.
+        status wait();
+
+        /// A description of the error, if `wait` returned one.
+        std::string error_message() const;
+
+    private:
+        void run();
+        status step_loop(sqlite3* src, sqlite3* dst);
+        void pause(std::chrono::milliseconds);
+
+        pool&                       pool_;
+        std::string const           dest_path_;
+        backup_options const        options_;
+        std::atomic<bool>           canceled_ = false;
+        std::atomic<bool>           finished_ = false;
+        mutable std::mutex          mutex_;             // Protects the following members
+        std::condition_variable     cond_;              // Signaled by `cancel`
+        backup_progress             progress_ {};
+        status                      status_ = status::ok;
+        std::string                 error_message_;
+        std::thread                 thread_;            // Must be last, since it uses the others
+    };
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
@@ -160,6 +160,9 @@ namespace sqnice {
     
     /// Utility function that's like `sprintf` but returns a `std::string`.
     std::string format(const char* fmt, ...) sqnice_printflike(1,2);
+
+    /// Quotes a table or column name for use in SQL, doubling any embedded `"` characters.
+    std::string quote_identifier(std::string_view name);
 }
 
 ASSUME_NONNULL_END
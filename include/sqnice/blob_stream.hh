@@ -27,7 +27,9 @@
 #ifndef SQNICE_BLOB_STREAM_H
 #define SQNICE_BLOB_STREAM_H
 
-#include "sqnice/base.hh"
+#include "sqnice/query.hh"
+#include <optional>
+#include <string>
 
 ASSUME_NONNULL_BEGIN
 
@@ -54,6 +56,13 @@ namespace sqnice {
                     int64_t rowid,
                     bool writeable);
 
+        /// Opens a handle for reading a blob, given a read-only `database`, such as one borrowed
+        /// from a `pool`.
+        blob_stream(database const& db,
+                    const char* table,
+                    const char *column,
+                    int64_t rowid);
+
         /// Alternative constructor that also takes a `database_name` parameter, which is the
         /// "symbolic name" of the database:
         /// - For the main database file: "main".
@@ -73,6 +82,7 @@ namespace sqnice {
 
         /// The size in bytes of the blob.
         /// @note  SQLite's API uses `int`, so blobs are limited to 2^31 bytes (~2GB.)
+        ///     For bigger data, use `large_object`.
         uint64_t size() const noexcept                  {return size_;}
 
         /// Reads from the blob.
@@ -96,14 +106,117 @@ namespace sqnice {
         /// @throws database_error  on error if exceptions are enabled.
         [[nodiscard]] int pwrite(const void *src, size_t len, uint64_t offset);
 
+        /// Moves the stream to the blob in the same column of a different row, which is much
+        /// faster than opening a new `blob_stream`. On success, `size` is updated.
+        /// If this fails (e.g. the row doesn't exist), reads fail until a later `reopen` succeeds.
+        status reopen(int64_t rowid);
+
     private:
+        status open(int64_t rowid);
         int range_check(size_t len, uint64_t offset) const;
 
+        std::string const       database_name_, table_, column_;
+        bool const              writeable_;
         sqlite3_blob* _Nullable blob_ = nullptr;
         uint64_t                size_ = 0;
         mutable status          status_;
     };
 
+
+    /** Efficiently reads (or writes) a blob column in many rows, by reusing a single
+        `blob_stream` that's moved from row to row with `blob_stream::reopen`.
+        This avoids the table and column lookups that opening a new `blob_stream` entails. */
+    class blob_scanner : noncopyable {
+    public:
+        blob_scanner(database& db,
+                     const char* table,
+                     const char *column,
+                     bool writeable = false);
+
+        /// Returns the blob stream, opened on the row with the given rowid.
+        /// The reference remains valid until the scanner is destroyed, but it'll be moved to a
+        /// different row by the next call.
+        /// @note  Errors are handled as with `blob_stream`'s constructor.
+        blob_stream& open(int64_t rowid);
+
+        /// Calls `fn(int64_t rowid, blob_stream&)` for each row, where the rowids are the first
+        /// column of the query's results. (Rows whose column value isn't a blob or string cause
+        /// an error, so the query should exclude `NULL`s.)
+        template <class FN>
+        void scan(query& rowids, FN fn) {
+            for (auto& row : rowids) {
+                auto rowid = row.template get<int64_t>(0);
+                fn(rowid, open(rowid));
+            }
+        }
+
+    private:
+        database&                   db_;
+        std::string const           table_, column_;
+        bool const                  writeable_;
+        std::optional<blob_stream>  blob_;
+    };
+
+
+    /** Inserts a blob whose length isn't known in advance, streaming the data into the database
+        instead of binding the whole value.
+
+        The constructor inserts a row whose column value is a zero-filled placeholder, then
+        `write` copies data into it with `sqlite3_blob_write`. When the placeholder fills up it's
+        grown geometrically (doubled), and `finish` trims it to the number of bytes written.
+
+        Memory use stays at one chunk only if `size_hint` is at least the final size. Growing
+        or trimming the placeholder makes SQLite materialize the whole current value and the new
+        one, so peak memory can reach 2-3 times the data size. An exact `size_hint` also avoids
+        the trim. For data of unknown and possibly very large size, use `large_object` instead.
+        @note  All errors throw `database_error`. Use a `transaction` so that a failure doesn't
+               leave a partially-written row behind. */
+    class blob_writer : noncopyable {
+    public:
+        static constexpr size_t kDefaultChunkSize = 64 * 1024;
+
+        /// Inserts a new row into `table`; columns other than `column` get their default values.
+        blob_writer(database& db,
+                    const char* table,
+                    const char *column,
+                    uint64_t size_hint = 0,
+                    size_t chunk_size = kDefaultChunkSize);
+
+        /// Calls `finish` if it hasn't been called yet.
+        ~blob_writer() noexcept;
+
+        /// The rowid of the inserted row.
+        int64_t rowid() const noexcept                  {return rowid_;}
+
+        /// The number of bytes written so far.
+        uint64_t size() const noexcept                  {return size_ + chunk_used_;}
+
+        /// Appends data. Small writes are buffered; writes of at least a chunk go straight
+        /// through to the blob.
+        void write(const void* data, size_t len);
+        void write(std::string_view str)                {write(str.data(), str.size());}
+
+        /// Writes any buffered data and trims the stored value to its final size.
+        /// No more data can be written afterwards. Returns the rowid.
+        int64_t finish();
+
+    private:
+        void write_through(const void* data, size_t len);
+        void reserve(uint64_t size);
+        void set_value(std::string const& expr, uint64_t param);
+
+        database&                   db_;
+        std::string const           table_, column_;
+        size_t const                chunk_size_;
+        std::unique_ptr<char[]>     chunk_;             // Buffer for small writes
+        size_t                      chunk_used_ = 0;    // Bytes in `chunk_`
+        uint64_t                    size_ = 0;          // Bytes written to the blob
+        uint64_t                    capacity_ = 0;      // Current size of the stored blob
+        int64_t                     rowid_ = 0;
+        std::optional<blob_stream>  blob_;
+        bool                        finished_ = false;
+    };
+
 }
 
 ASSUME_NONNULL_END
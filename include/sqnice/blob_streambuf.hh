@@ -0,0 +1,109 @@
+// sqnice/blob_streambuf.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+#ifndef SQNICE_BLOB_STREAMBUF_H
+#define SQNICE_BLOB_STREAMBUF_H
+
+#include "sqnice/blob_stream.hh"
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <streambuf>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+
+    /** A buffered `std::streambuf` that reads and writes a `blob_stream`, so that a blob can
+        be used with `std::istream`/`std::ostream` APIs like parsers or hashers. Small reads and
+        writes are batched into large `sqlite3_blob_read`/`sqlite3_blob_write` calls.
+
+        Sequential reading is detected: each buffer refill that continues where the last left off
+        reads twice as much as the previous one, up to the buffer size. A seek resets this, so
+        random access doesn't waste time reading data that won't be used.
+
+        As with `blob_stream`, writes can't extend past the end of the blob.
+        @note  The `blob_stream` must remain valid as long as this object exists. */
+    class blob_streambuf : public std::streambuf {
+    public:
+        static constexpr size_t kDefaultBufferSize = 64 * 1024;
+
+        explicit blob_streambuf(blob_stream& blob, size_t buffer_size = kDefaultBufferSize);
+        ~blob_streambuf() override;
+
+        /// The blob offset of the current read/write position.
+        uint64_t position() const noexcept;
+
+        /// Zero-copy read: returns a span of up to `max_len` bytes pointing into the internal
+        /// buffer, starting at the current position, and advances past them. The span is only
+        /// valid until the next call on this object. It's empty at the end of the blob.
+        std::span<const std::byte> read_span(size_t max_len = SIZE_MAX);
+
+    protected:
+        int_type underflow() override;
+        int_type overflow(int_type c) override;
+        int sync() override;
+        std::streamsize showmanyc() override;
+        std::streamsize xsgetn(char_type* s, std::streamsize n) override;
+        pos_type seekoff(off_type, std::ios_base::seekdir, std::ios_base::openmode) override;
+        pos_type seekpos(pos_type, std::ios_base::openmode) override;
+
+    private:
+        bool flush();
+
+        blob_stream&            blob_;
+        std::unique_ptr<char[]> buffer_;
+        size_t const            capacity_;
+        uint64_t                buf_pos_ = 0;       // Blob offset of the start of `buffer_`
+        uint64_t                next_fill_pos_ = 0; // Where the next sequential read would start
+        size_t                  fill_size_;         // Size of the next buffer refill
+    };
+
+
+    /** A `std::iostream` that reads and writes a blob, using a `blob_streambuf`. */
+    class blob_iostream : public std::iostream {
+    public:
+        explicit blob_iostream(blob_stream& blob,
+                               size_t buffer_size = blob_streambuf::kDefaultBufferSize)
+        :std::iostream(nullptr)
+        ,buf_(blob, buffer_size)
+        {
+            rdbuf(&buf_);
+        }
+
+        blob_streambuf& buf() noexcept                  {return buf_;}
+
+    private:
+        blob_streambuf buf_;
+    };
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
@@ -0,0 +1,154 @@
+// sqnice/change_feed.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_CHANGE_FEED_H
+#define SQNICE_CHANGE_FEED_H
+
+#include "sqnice/base.hh"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class database;
+    template <class T> class ring_buffer;
+
+    /** The kind of change made to a row. (Values are the same as SQLite's.) */
+    enum class change_op : uint8_t {
+        insert = 18,    // SQLITE_INSERT
+        update = 23,    // SQLITE_UPDATE
+        remove = 9,     // SQLITE_DELETE
+    };
+
+    /** One changed row. */
+    struct change_event {
+        change_op   op;
+        std::string table;      ///< Table name; prefixed with "db." if not in the main database
+        int64_t     rowid;
+    };
+
+    /** The rows changed by one committed transaction. Each row appears at most once, with the
+        net effect of the transaction on it: for example, a row that was inserted and then
+        updated appears as an insert, and one that was inserted and deleted doesn't appear. */
+    struct change_batch {
+        uint64_t                  sequence;     ///< Increases by 1 with every batch published
+        std::vector<change_event> changes;      ///< In the order rows were first changed
+    };
+
+    using change_batch_ref = std::shared_ptr<change_batch const>;
+
+
+    /** A consumer's queue of batches from a `change_feed`. It's a fixed-size lock-free queue, so
+        the writer never waits for a consumer; if a consumer falls behind and its queue fills up,
+        batches are dropped and `take_overflow` returns true.
+        The methods for popping batches should only be called from one thread at a time. */
+    class change_subscription : noncopyable {
+    public:
+        ~change_subscription();
+
+        /// Removes and returns the oldest batch, or returns nullptr if there are none.
+        change_batch_ref try_pop();
+
+        /// Removes and returns the oldest batch, waiting until there is one.
+        /// Returns nullptr if the feed has been destroyed or the subscription canceled.
+        change_batch_ref pop();
+
+        /// Returns true if batches have been dropped since the last call, because the queue was
+        /// full. The consumer should then resynchronize, e.g. by flushing its whole cache.
+        bool take_overflow() noexcept           {return overflow_.exchange(false);}
+
+        /// True if the feed has been destroyed or the subscription canceled.
+        bool closed() const noexcept            {return closed_;}
+
+    private:
+        friend class change_feed;
+        explicit change_subscription(size_t capacity);
+        void push(change_batch_ref const&);
+        void close();
+
+        std::unique_ptr<ring_buffer<change_batch_ref>> queue_;
+        std::atomic<uint32_t>   pushed_ {0};        // Bumped on push and close, to wake `pop`
+        std::atomic<bool>       overflow_ = false;
+        std::atomic<bool>       closed_ = false;
+    };
+
+
+    /** Publishes the changes committed by a `database` connection as per-transaction batches,
+        which consumers can process on their own threads; for example to invalidate caches or
+        update indexes, without slowing down the writer.
+
+        The feed uses the database's update, commit and rollback hooks, replacing any handlers
+        set with `set_update_handler` etc. During a transaction, changed rows are buffered and
+        coalesced; on rollback they're discarded, and on commit they're published as one
+        `change_batch` to every subscription's queue.
+
+        @note  Changes undone by `ROLLBACK TO` a savepoint are still published. Changes made
+               by `WITHOUT ROWID` tables aren't reported at all (SQLite doesn't report them.)
+        @note  Batches are published by the commit hook, just before the commit completes. If
+               the commit then fails, its batch will have been published anyway, so treat the
+               events as hints (invalidations), not as a replication log. */
+    class change_feed : noncopyable {
+    public:
+        /// Attaches the feed to a database. The feed must be destroyed before the database.
+        explicit change_feed(database&);
+
+        /// Detaches from the database and closes all subscriptions.
+        ~change_feed();
+
+        /// Creates a new subscription with a queue of `capacity` batches.
+        /// It only receives batches committed after this call. Thread-safe.
+        std::shared_ptr<change_subscription> subscribe(size_t capacity = 256);
+
+        /// Stops publishing to a subscription, and closes it. Thread-safe.
+        void unsubscribe(change_subscription&);
+
+        /// The sequence number of the last batch published, or 0 if none. Thread-safe.
+        uint64_t last_sequence() const noexcept {return sequence_;}
+
+    private:
+        void changed(int op, const char* dbname, const char* table, int64_t rowid);
+        void committed();
+        void rolled_back();
+
+        database&                           db_;
+        std::vector<change_event>           pending_;       // Changes in current transaction
+        std::unordered_map<std::string, std::unordered_map<int64_t,size_t>> rows_; // -> pending_
+        std::atomic<uint64_t>               sequence_ = 0;
+        std::mutex                          mutex_;         // Protects subscribers_
+        std::vector<std::shared_ptr<change_subscription>> subscribers_;
+    };
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
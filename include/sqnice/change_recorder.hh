@@ -0,0 +1,134 @@
+// sqnice/change_recorder.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_CHANGE_RECORDER_H
+#define SQNICE_CHANGE_RECORDER_H
+
+#include "sqnice/base.hh"
+#include <cstdio>
+#include <functional>
+#include <string>
+
+ASSUME_NONNULL_BEGIN
+
+struct sqlite3_session;
+
+namespace sqnice {
+    class database;
+
+    /** Records the changes made through a `database` connection as a log of changesets, using
+        SQLite's session extension. The log can be replayed with `apply_log` onto a backup or
+        replica, to bring it up to date with work proportional to the changes made, rather than
+        to the database size.
+
+        A changeset is appended to the log each time a (top-level) `transaction` commits. Changes
+        made outside a `transaction`, with autocommit statements, are recorded by the next commit,
+        or by calling `capture` explicitly.
+
+        The log is a sequence of records, each a 4-byte little-endian length followed by a
+        changeset. It's only ever appended to, except that a partial record left at the end by a
+        crash or failed write is truncated when a recorder opens the log.
+
+        @note  Only tables with a `PRIMARY KEY` are recorded; that's a limitation of sessions.
+        @note  This requires SQLite built with `SQLITE_ENABLE_SESSION` and
+               `SQLITE_ENABLE_PREUPDATE_HOOK`. The vendored SQLite is; the CMake build detects
+               whether the system SQLite is. If not, the constructor throws. */
+    class change_recorder : noncopyable {
+    public:
+        /// Starts recording all tables of a database connection, appending to the log file at
+        /// `log_path` (which is created if necessary.) A connection can have only one recorder.
+        /// @throws database_error  if the log file can't be opened or the session can't be
+        ///     created.
+        change_recorder(database& db,
+                        std::string_view log_path,
+                        const char* db_name = "main");
+
+        /// Captures any remaining changes, then stops recording.
+        ~change_recorder();
+
+        /// Appends the changes made since the last capture to the log, if there are any.
+        /// If this fails, the changes are kept and will be included in the next capture.
+        /// Returns `misuse` if the database has been closed, or was the target of a move
+        /// assignment; either of those captures the remaining changes and stops recording.
+        status capture();
+
+        /// The number of changesets appended to the log by this recorder.
+        uint64_t changesets_written() const noexcept    {return changesets_written_;}
+
+    private:
+        friend class database;
+        void create_session();
+        void transaction_committed() noexcept;
+        void detach() noexcept;
+
+        database* _Nullable         db_;        // Updated when the database is moved
+        std::string const           db_name_, log_path_;
+        std::FILE*                  log_ = nullptr;
+        sqlite3_session* _Nullable  session_ = nullptr;
+        uint64_t                    changesets_written_ = 0;
+    };
+
+
+    /** The kinds of conflicts that can occur while applying a changeset.
+        (Values are equal to `SQLITE_CHANGESET_DATA`, etc.) */
+    enum class conflict_type : int {
+        data        = 1,    ///< The row to update or delete has different values than expected
+        not_found   = 2,    ///< The row to update or delete doesn't exist
+        conflict    = 3,    ///< A row to insert has the same primary key as an existing one
+        constraint  = 4,    ///< A change violated a constraint, like `UNIQUE` or `NOT NULL`
+        foreign_key = 5,    ///< Foreign key constraints would be violated
+    };
+
+    /** How to resolve a conflict. (Values are equal to `SQLITE_CHANGESET_OMIT`, etc.) */
+    enum class conflict_action : int {
+        omit        = 0,    ///< Skip the conflicting change
+        replace     = 1,    ///< Apply the change anyway; only valid for `data` and `conflict`
+        abort       = 2,    ///< Stop and roll back everything applied by `apply_log`
+    };
+
+    using conflict_handler = std::function<conflict_action(conflict_type, const char* table)>;
+
+    /// Replays a log written by `change_recorder` onto a database, inside a transaction.
+    /// A truncated record at the end (as left by a crash while appending) is ignored.
+    /// @param db  The backup or replica to update.
+    /// @param log_path  The path of the log file.
+    /// @param start_offset  The position in the log to start at: 0, or a value previously
+    ///     returned by this function, to apply only the changesets added since then.
+    /// @param on_conflict  Decides how to resolve conflicts. If it's empty, the incoming change
+    ///     wins (`replace`) for `data` and `conflict`, changes to missing rows are omitted, and
+    ///     constraint violations abort.
+    /// @returns  The offset just past the last changeset applied.
+    /// @throws database_error  if the log can't be read or a changeset fails to apply.
+    uint64_t apply_log(database& db,
+                       std::string_view log_path,
+                       uint64_t start_offset = 0,
+                       conflict_handler on_conflict = {});
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
@@ -0,0 +1,128 @@
+// sqnice/checkpoint.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_CHECKPOINT_H
+#define SQNICE_CHECKPOINT_H
+
+#include "sqnice/base.hh"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class pool;
+
+    /** Parameters of a `checkpoint_controller`. */
+    struct checkpoint_options {
+        /// How often the WAL is checked and checkpointed.
+        std::chrono::milliseconds interval {250};
+
+        /// When the WAL file reaches this size and has been completely checkpointed, a RESTART
+        /// checkpoint makes the writer start over at the beginning of the file, so it stops
+        /// growing.
+        uint64_t restart_wal_size = 4 << 20;
+
+        /// When the WAL file reaches this size, a TRUNCATE checkpoint shrinks it back to zero.
+        /// This happens even if readers are still using older snapshots, in which case the
+        /// checkpoint waits up to `escalation_timeout` for them to finish.
+        uint64_t truncate_wal_size = 64 << 20;
+
+        /// How long a RESTART or TRUNCATE checkpoint waits for readers and the writer.
+        std::chrono::milliseconds escalation_timeout {100};
+    };
+
+
+    /** Metrics reported by a `checkpoint_controller`. */
+    struct checkpoint_stats {
+        uint64_t wal_size = 0;              ///< Size of the WAL file, in bytes
+        int      wal_frames = 0;            ///< Number of frames (pages) in the WAL
+        int      frames_behind = 0;         ///< WAL frames not yet copied to the database
+        std::chrono::nanoseconds last_duration {0}; ///< Time taken by the last checkpoint
+        std::chrono::nanoseconds max_duration {0};  ///< Longest time taken by a checkpoint
+        unsigned passive_count = 0;         ///< Number of PASSIVE checkpoints
+        unsigned restart_count = 0;         ///< Number of successful RESTART checkpoints
+        unsigned truncate_count = 0;        ///< Number of successful TRUNCATE checkpoints
+        unsigned busy_count = 0;            ///< Escalated checkpoints that gave up on busy
+    };
+
+
+    /** Takes WAL checkpointing off the commit path of a `pool`'s database.
+
+        Normally SQLite runs a checkpoint inside whichever commit makes the WAL exceed 1000 pages,
+        giving that commit a latency spike. The controller disables that on the pool's writeable
+        database, and instead runs PASSIVE checkpoints on a background thread, using its own
+        connection. If the WAL grows too large, it escalates to RESTART or TRUNCATE checkpoints.
+
+        An escalated checkpoint holds the write lock while it waits for readers, so while the
+        controller exists, the writeable database's busy timeout is raised to at least
+        `escalation_timeout` plus 5 seconds; otherwise a concurrent commit would fail with
+        `busy` instead of waiting.
+
+        When the controller is destroyed, the pool's previous `auto_checkpoint` and
+        `writer_busy_timeout` settings are restored, or SQLite's defaults if it had none.
+        @note  The database should be in WAL mode; otherwise the controller does nothing.
+        @warning  Don't use this with `compact_database`, since the controller keeps its
+                  connection open while the file is being replaced. */
+    class checkpoint_controller : noncopyable {
+    public:
+        explicit checkpoint_controller(pool&, checkpoint_options const& = {});
+
+        /// Stops the background thread, waiting for a checkpoint in progress to finish.
+        ~checkpoint_controller();
+
+        /// Current metrics. Thread-safe.
+        checkpoint_stats stats() const;
+
+        /// Asks for a checkpoint to run right away. Thread-safe.
+        void run_now();
+
+    private:
+        void run();
+        void checkpoint(sqlite3*);
+
+        using clock = std::chrono::steady_clock;
+
+        pool&                       pool_;
+        checkpoint_options const    options_;
+        int const                   saved_auto_checkpoint_; // Pool's setting before mine
+        int const                   saved_busy_timeout_;    // Pool's setting before mine
+        int                         restarted_frames_ = -1; // WAL frames at last RESTART
+        mutable std::mutex          mutex_;             // Protects the following members
+        std::condition_variable     cond_;
+        bool                        stopped_ = false;
+        bool                        wake_ = false;
+        checkpoint_stats            stats_;
+        std::thread                 thread_;            // Must be last
+    };
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
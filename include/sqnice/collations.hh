@@ -0,0 +1,69 @@
+// sqnice/collations.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+#ifndef SQNICE_COLLATIONS_H
+#define SQNICE_COLLATIONS_H
+
+#include "sqnice/base.hh"
+#include <string_view>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class database;
+
+    /** Registers a set of collations with a database connection:
+
+        - `unicode_nocase` -- Case-insensitive comparison of UTF-8 text. Unlike SQLite's `NOCASE`,
+          which only folds ASCII, this folds Latin-1, Latin Extended-A, Greek, Cyrillic, Armenian
+          and fullwidth Latin letters. Other characters compare by code point.
+        - `natural_sort` -- Like `unicode_nocase`, but runs of digits compare by numeric value,
+          so that "file2" < "file10". If two strings differ only by leading zeroes, the one with
+          fewer zeroes sorts first.
+        - `numeric` -- Strings that begin with a decimal number (with optional leading spaces,
+          sign and fraction) compare by the number's exact value, of any length, followed by
+          the rest of the string. They sort before strings that don't begin with a number, which
+          compare like `BINARY`.
+
+        All of them have fast paths that compare ASCII text eight bytes at a time.
+        To add these to every connection in a `pool`, call this from a `pool::on_open` callback. */
+    status register_collations(database&);
+
+    /// The comparison function of the `unicode_nocase` collation.
+    int compare_unicode_nocase(std::string_view, std::string_view) noexcept;
+
+    /// The comparison function of the `natural_sort` collation.
+    int compare_natural(std::string_view, std::string_view) noexcept;
+
+    /// The comparison function of the `numeric` collation.
+    int compare_numeric(std::string_view, std::string_view) noexcept;
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
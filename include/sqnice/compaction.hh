@@ -0,0 +1,84 @@
+// sqnice/compaction.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_COMPACTION_H
+#define SQNICE_COMPACTION_H
+
+#include "sqnice/base.hh"
+#include <chrono>
+#include <string>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class pool;
+
+    /** Parameters of `compact_database`. */
+    struct compaction_options {
+        /// Where to write the compacted copy. Defaults to the database path plus "-compact".
+        /// It should be in the same directory, so the final rename is atomic.
+        std::string temp_path;
+
+        /// How many times to try copying without blocking writers, before giving up.
+        unsigned max_attempts = 3;
+
+        /// If true, the last attempt blocks all use of the pool while it copies, so it's sure
+        /// to succeed. If false, compaction gives up with status `busy` instead.
+        bool block_on_last_attempt = true;
+
+        /// How long to wait for borrowed databases to be returned before replacing the file.
+        /// If they aren't, that attempt fails, and borrowers are unblocked. This keeps a thread
+        /// that holds a reader while it borrows the writer from deadlocking with compaction.
+        std::chrono::milliseconds drain_timeout {5000};
+    };
+
+    /** The outcome of `compact_database`. */
+    struct compaction_result {
+        status   result = status::ok;   ///< `ok`, or `busy` if writes or borrowers interfered
+        unsigned attempts = 0;          ///< Number of copies made
+        uint64_t old_size = 0;          ///< Size of the database file before
+        uint64_t new_size = 0;          ///< Size of the database file after
+    };
+
+    /** Defragments a pool's database file, like `VACUUM`, without blocking the writer for the
+        duration of the copy.
+
+        A read-only connection runs `VACUUM INTO` a temporary file, while other connections
+        keep working. Then the pool's connections are all closed (see `pool::with_all_closed`);
+        if nothing was written through the pool during the copy, the copy atomically replaces
+        the database file, and connections reopen on it. Otherwise the copy is stale, or
+        borrowed databases weren't returned within `drain_timeout`, and it's tried again.
+
+        @warning  The pool must be the only user of the file, including other processes; and
+                  the caller must not be holding a database borrowed from it.
+        @throws database_error  if the copy or the file replacement fails. */
+    compaction_result compact_database(pool&, compaction_options const& = {});
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
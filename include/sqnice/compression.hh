@@ -0,0 +1,131 @@
+// sqnice/compression.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_COMPRESSION_H
+#define SQNICE_COMPRESSION_H
+
+#include "sqnice/query.hh"
+#include <string>
+#include <string_view>
+#include <utility>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class arg_value;
+    class database;
+
+    /// The zstd compression level used by default. (Levels range from 1 to 22.)
+    constexpr int kDefaultCompressionLevel = 3;
+
+    /// Values shorter than this aren't compressed.
+    constexpr size_t kMinCompressibleSize = 64;
+
+
+    /// Encodes text or blob data in the format described at `compressed`, below.
+    /// If the result is uncompressed text, it's just a copy of the input, with no header.
+    /// @param data  The data to compress.
+    /// @param is_blob  True if the data is a blob, false if text.
+    /// @param level  The zstd compression level.
+    /// @returns  The encoded value, and whether it must be stored as a blob.
+    std::pair<std::string,bool> compress_value(std::string_view data,
+                                               bool is_blob,
+                                               int level = kDefaultCompressionLevel);
+
+    /// Decodes a value in the compressed-value format. Text values, and blobs that don't start
+    /// with a valid header, are returned unchanged.
+    /// @param data  The stored value.
+    /// @param is_blob  True if the stored value is a blob.
+    /// @returns  The original value, and whether it was a blob.
+    /// @throws database_error  with status `corrupt` if the data has a valid header but can't
+    ///         be decompressed.
+    std::pair<std::string,bool> decompress_value(std::string_view data, bool is_blob);
+
+
+    /** Wraps a string or blob so that binding it to a statement parameter stores it compressed,
+        using zstd.
+
+        A compressed value is stored as a blob consisting of an 8-byte header followed by a
+        zstd frame. The header has a magic number, records whether the original value was text
+        or a blob, so it can be restored with the right type, and has a checksum. Values that
+        are too small to benefit, or that don't shrink, are stored as-is. So plain text and
+        blob values can be mixed freely with compressed ones in the same column: a blob without
+        a valid header is returned unchanged.
+
+        (The one ambiguity is a plain blob that happens to start with a valid header -- 3 magic
+        bytes, a flags byte, and a matching 32-bit checksum of the rest, which is vanishingly
+        unlikely unless the blob was deliberately constructed. `compress` never stores such a
+        blob as-is; it adds a header.)
+
+        Compression is chosen per column, by binding values wrapped in `compressed` and reading
+        them with `get<decompressed>()`:
+        ```
+        cmd(compressed(json));
+        std::string json = row[0].get<decompressed>();
+        ```
+        `register_compression` adds SQL functions that do the same, for use in queries. */
+    struct compressed {
+        explicit compressed(std::string_view text, int level = kDefaultCompressionLevel)
+                                                        :data(text), level(level) { }
+        explicit compressed(blob b, int level = kDefaultCompressionLevel)
+        :data(static_cast<const char*>(b.data), b.size), is_blob(true), level(level) { }
+
+        std::string_view data;
+        bool             is_blob = false;
+        int              level;
+    };
+
+    status bind_helper(statement&, int idx, compressed const&);
+
+
+    /** A string decompressed from a column or function argument, via `get<decompressed>()`.
+        A `NULL` value produces an empty string.
+        @note  Since `get` can't throw, a value with a valid header whose zstd data is damaged
+               logs a warning and produces the stored bytes unchanged. */
+    struct decompressed : public std::string {
+        using std::string::string;
+        explicit decompressed(std::string&& s) noexcept :std::string(std::move(s)) { }
+    };
+
+    template <> struct column_helper<decompressed> {
+        static decompressed get(column_value const&) noexcept;
+        static decompressed get(arg_value const&) noexcept;
+    };
+
+
+    /** Registers SQL functions for compressed values with a database connection:
+        - `compress(x [, level])` -- Encodes a text or blob value; other types pass through.
+        - `decompress(x)` -- Restores a value encoded by `compress` or the `compressed` binding,
+          as text or a blob according to its original type. Other values pass through.
+
+        To add these to every connection in a `pool`, call this from a `pool::on_open` callback. */
+    status register_compression(database&);
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
@@ -30,6 +30,7 @@
 #include "sqnice/base.hh"
 #include <functional>
 #include <optional>
+#include <span>
 #include <tuple>
 
 ASSUME_NONNULL_BEGIN
@@ -40,6 +41,7 @@ struct sqlite3_value;
 
 namespace sqnice {
 
+    class change_recorder;
     class command;
     class context;
     class database;
@@ -47,6 +49,7 @@ namespace sqnice {
     class function_result;
     class query;
     template <class STMT> class statement_cache;
+    class virtual_table_base;
 
 
     /** Flags used when opening a database; equivalent to `SQLITE_OPEN_...` macros in sqlite3.h. */
@@ -96,10 +99,100 @@ namespace sqnice {
         subtype         = 0x000100000,  // implementation gets or sets subtypes of values
         innocuous       = 0x000200000,  // no side effects, accesses nothing but its args
     };
-    inline function_flags operator| (function_flags a, function_flags b) {
+    inline constexpr function_flags operator| (function_flags a, function_flags b) {
         return function_flags(int(a) | int(b));}
 
 
+    /** An image of a database file, as returned by `database::serialize`. */
+    class database_image : noncopyable {
+    public:
+        database_image() = default;
+        database_image(database_image&&) noexcept;
+        database_image& operator=(database_image&&) noexcept;
+        ~database_image();
+
+        /// The bytes of the image.
+        std::span<const std::byte> bytes() const noexcept   {return {data_, size_};}
+        size_t size() const noexcept                        {return size_;}
+        bool empty() const noexcept                         {return size_ == 0;}
+
+        /// True if the image is a view of an in-memory database's own storage, rather than a copy.
+        /// A view is only valid until that database is modified or closed.
+        bool is_view() const noexcept                       {return data_ && !owned_;}
+
+    private:
+        friend class database;
+        database_image(const std::byte* _Nullable data, size_t size, bool owned) noexcept
+                                                    :data_(data), size_(size), owned_(owned) { }
+
+        const std::byte* _Nullable  data_ = nullptr;
+        size_t                      size_ = 0;
+        bool                        owned_ = false;     // If true, `data_` is freed by destructor
+    };
+
+
+    /** Flags for `database::deserialize`. */
+    enum class deserialize_flags : unsigned {
+        none        = 0,
+        readonly    = 0x04,     ///< The deserialized database is read-only
+    };
+
+
+    /** Options for `database::set_async_log_handler`. */
+    struct async_log_options {
+        /// Maximum number of messages waiting to be delivered. When the queue is full, new
+        /// messages are dropped (and counted.) Only the first call's value is used.
+        size_t   capacity = 256;
+        /// Maximum number of messages delivered per second; excess ones are counted and
+        /// summarized. 0 means unlimited.
+        unsigned max_per_second = 100;
+        /// If true, a message identical to the previous one isn't delivered; instead, the
+        /// number of repeats is reported when a different message arrives.
+        bool     dedup = true;
+    };
+
+    /** Counters of the asynchronous log handler; see `database::async_log_stats`. */
+    struct async_log_stats {
+        uint64_t delivered = 0;     ///< Messages passed to the handler
+        uint64_t dropped = 0;       ///< Messages lost because the queue was full
+        uint64_t rate_limited = 0;  ///< Messages suppressed by `max_per_second`
+        uint64_t duplicates = 0;    ///< Repeated messages collapsed by `dedup`
+    };
+
+    /** A snapshot of resource usage; returned by `database::metrics` and `pool::metrics`.
+        The per-connection values come from `sqlite3_db_status`, and are summed over all the
+        connections sampled. The process-wide ones come from `sqlite3_status64`; they're only
+        tracked if `SQLITE_CONFIG_MEMSTATUS` is on, as it is by default. */
+    struct metrics_snapshot {
+        // Per-connection:
+        int64_t connections = 0;            ///< Number of connections sampled
+        int64_t connections_busy = 0;       ///< Borrowed connections skipped by `pool::metrics`
+        int64_t cache_hits = 0;             ///< Page cache hits
+        int64_t cache_misses = 0;           ///< Page cache misses
+        int64_t cache_writes = 0;           ///< Pages written to disk
+        int64_t cache_spills = 0;           ///< Dirty pages written mid-transaction
+        int64_t cache_used = 0;             ///< Bytes of memory used by page caches
+        int64_t schema_used = 0;            ///< Bytes of memory used by schemas
+        int64_t statement_used = 0;         ///< Bytes of memory used by prepared statements
+        int64_t lookaside_used = 0;         ///< Lookaside slots in use
+        int64_t lookaside_highwater = 0;    ///< Most lookaside slots ever in use
+        int64_t lookaside_hits = 0;         ///< Allocations satisfied from lookaside
+        int64_t lookaside_misses = 0;       ///< Allocations lookaside couldn't satisfy
+        // Process-wide:
+        int64_t memory_used = 0;            ///< Bytes of memory allocated by SQLite
+        int64_t memory_highwater = 0;       ///< Most bytes ever allocated by SQLite
+        int64_t malloc_count = 0;           ///< Number of SQLite's outstanding allocations
+        int64_t malloc_count_highwater = 0; ///< Most outstanding allocations ever
+        int64_t largest_malloc = 0;         ///< Size of the largest allocation requested
+
+        /// Renders the metrics in the Prometheus text exposition format. Each name starts with
+        /// `prefix` and an underscore; `labels`, if not empty, is added to every sample, so it
+        /// should look like `db="main",role="reader"`.
+        std::string prometheus(std::string_view prefix = "sqlite",
+                               std::string_view labels = "") const;
+    };
+
+
     /** A SQLite database connection. */
     class database : public checking, noncopyable {
     public:
@@ -324,6 +417,10 @@ namespace sqnice {
         /// True if a transaction or savepoint is active.
         bool in_transaction() const noexcept;
 
+        /// Returns this connection's cache, memory and lookaside counters, plus process-wide
+        /// memory usage. Thread-safe, and cheap enough to call from a metrics endpoint.
+        metrics_snapshot metrics() const;
+
         /// The number of beginTransaction calls not balanced by endTransaction.
         int transaction_depth() const noexcept          {return txn_depth_;}
 
@@ -382,6 +479,20 @@ namespace sqnice {
             return create_function_impl<F>()(*this, name, flags, fh, destroy);
         }
 
+        /// Registers a SQL function implemented by a plain C++ function (or static method),
+        /// given as a template argument, e.g. `db.create_function<&my_fn>("my_fn")`.
+        /// This is the fastest variant: the callback SQLite invokes is specialized on `Fn`, and
+        /// the arguments are converted directly from SQLite values to `Fn`'s parameter types,
+        /// with no `std::function`, heap allocation or tuple in between.
+        /// If `Fn` returns `void`, the SQL result is `NULL`.
+        /// @note  You must include "sqnice/functions.hh" or you'll get compile errors.
+        template <auto Fn>
+        status create_function(std::string_view name,
+                               function_flags flags = {})
+        {
+            return create_function_ptr_impl<Fn>()(*this, name, flags);
+        }
+
         /// Registers a SQL aggregate function.
         /// @param name  The SQL name of the function.
         /// @param step  A function that takes `nargs` arguments.
@@ -397,6 +508,8 @@ namespace sqnice {
         /// The template argument `T` must be a class or struct with two public instance methods:
         /// - `step`, whose parameter types are the `Ps...` template args
         /// - `finish`, which takes no args and returns your aggregate's type.
+        /// A parameter of type `arg_value const&` receives the raw argument, so `step` can check
+        /// for `NULL` or look at the value's type.
         /// For examples, see the test case "SQNice aggregate functions" in testfunctions.cc.
         /// @note  You must include "sqnice/functions.hh" or you'll get compile errors.
         template <class T, class... Ps>
@@ -406,6 +519,50 @@ namespace sqnice {
                                      nullptr, stepx_impl<T, Ps...>, finishN_impl<T>, nullptr);
         }
 
+        /// Registers an aggregate window function, which can be used either as a regular
+        /// aggregate or with an `OVER` clause.
+        /// This variant takes care of marshaling the args & return values.
+        /// The template argument `T` must be a class or struct with four public instance methods:
+        /// - `step`, whose parameter types are the `Ps...` template args; adds a row.
+        /// - `inverse`, with the same parameters as `step`; removes the oldest row from the window.
+        /// - `value`, which takes no args and returns the aggregate value of the current window.
+        /// - `finish`, which takes no args and returns the final aggregate value.
+        /// Since SQLite calls `inverse` as rows leave the frame, a sliding window costs O(1) per
+        /// row instead of recomputing the whole frame.
+        /// @note  You must include "sqnice/functions.hh" or you'll get compile errors.
+        template <class T, class... Ps>
+        status create_window_function(std::string_view name,
+                                      function_flags flags = {}) {
+            return register_window_function(name, sizeof...(Ps), flags, nullptr,
+                                            stepx_impl<T, Ps...>, finishN_impl<T>,
+                                            valueN_impl<T>, inversex_impl<T, Ps...>, nullptr);
+        }
+
+        using collation_handler = std::function<int (std::string_view, std::string_view)>;
+
+        /// Registers a collating sequence (collation), for use in `COLLATE` clauses, `ORDER BY`
+        /// and indexes. The function returns a negative number, zero or a positive number if the
+        /// first string is less than, equal to or greater than the second.
+        /// @warning  The function must not throw, and must always give the same result for the
+        ///           same inputs; otherwise indexes using the collation will be corrupted.
+        status create_collation(std::string_view name, collation_handler);
+
+        /// Registers a collation implemented by a plain C++ function (or static method), given as
+        /// a template argument, e.g. `db.create_collation<&my_compare>("mine")`.
+        /// `Fn` must take two `std::string_view`s and return an `int`.
+        /// This is faster than the `std::function` variant, since SQLite directly calls a callback
+        /// specialized on `Fn`.
+        template <auto Fn>
+        status create_collation(std::string_view name) {
+            return register_collation(name, nullptr, collationN_impl<Fn>, nullptr);
+        }
+
+        /// Registers a virtual table, which can then be used in SQL like a regular table.
+        /// The table is "eponymous": it exists as soon as it's registered, without any
+        /// `CREATE VIRTUAL TABLE` statement.
+        /// @note  You must include "sqnice/virtual_table.hh" to define a table.
+        status create_virtual_table(std::string_view name,
+                                    std::shared_ptr<virtual_table_base> table);
 
 #pragma mark - MAINTENANCE
 
@@ -436,12 +593,43 @@ namespace sqnice {
                       const backup_handler& h,
                       int step_page = 5);
 
+        /// Returns an image of a database: the same bytes that would be in its file.
+        /// @param nocopy  If true, and the database is in memory (e.g. one created by
+        ///     `deserialize`), the image is a zero-copy view of its storage. Otherwise, or if
+        ///     that's not possible, the image is a copy.
+        /// @param schema  The database to serialize: "main", "temp", or an attached name.
+        /// @throws database_error  if serialization fails. (An empty database produces an empty
+        ///     image.)
+        database_image serialize(bool nocopy = false, const char* schema = "main") const;
+
+        /// Replaces a database with an in-memory copy of the given image, as returned by
+        /// `serialize` or read from a database file. If this `database` isn't open yet, it's
+        /// opened as a new in-memory database first.
+        /// @param image  The database image. It's copied, so the caller keeps ownership.
+        /// @param flags  Options; currently only `readonly`.
+        /// @param schema  The database to replace: "main", or an attached name.
+        status deserialize(std::span<const std::byte> image,
+                           deserialize_flags flags = deserialize_flags::none,
+                           const char* schema = "main");
+
 #pragma mark - LOGGING
 
         using log_handler = std::function<void (status, const char* message)>;
 
         static void set_log_handler(log_handler) noexcept;
 
+        /// Like `set_log_handler`, except the handler is called on a background thread.
+        /// SQLite's log callback just copies the message into a lock-free queue, so threads
+        /// logging at the same time (e.g. busy errors across a pool) don't contend on a lock or
+        /// wait for the handler. Messages longer than 250 bytes are truncated.
+        /// Passing an empty handler turns logging off.
+        /// @returns  `misuse` if SQLite doesn't allow the log callback to be changed after it's
+        ///     initialized (before version 3.42) and a database has already been opened.
+        static status set_async_log_handler(log_handler, async_log_options const& = {});
+
+        /// Counters of messages handled by the asynchronous log handler. Thread-safe.
+        static sqnice::async_log_stats async_log_stats() noexcept;
+
 
 #pragma mark - CALLBACKS
 
@@ -480,7 +668,29 @@ namespace sqnice {
                                  finishFn _Nullable finish,
                                  destroyFn _Nullable destroy);
 
+        /// Lowest-level API for defining a SQL aggregate window function. You probably want to use
+        /// `create_window_function` instead.
+        status register_window_function(std::string_view name,
+                                        int nArgs,
+                                        function_flags,
+                                        void* _Nullable pApp,
+                                        callFn step,
+                                        finishFn finish,
+                                        finishFn value,
+                                        callFn inverse,
+                                        destroyFn _Nullable destroy);
+
+        using collateFn = int (*)(void* _Nullable, int, const void*, int, const void*);
+
+        /// Lowest-level API for defining a collation. You probably want to use `create_collation`
+        /// instead. Unlike `register_function`, `destroy` is not called if this fails.
+        status register_collation(std::string_view name,
+                                  void* _Nullable pArg,
+                                  collateFn,
+                                  destroyFn _Nullable destroy);
+
     private:
+        friend class change_recorder;
         friend class checking;
         friend class pool;
 
@@ -496,16 +706,37 @@ namespace sqnice {
         // Implementations in functions.hh.
         using pfunction_base = std::shared_ptr<void>;
         template <class R, class... Ps> static void functionx_impl(sqlite3_context*, int, argv_t);
+        template <auto Fn, class R, class... Ps>
+            static void functionN_impl(sqlite3_context*, int, argv_t) noexcept;
         template <class T, class... Ps>static void stepx_impl(sqlite3_context*, int, argv_t);
+        template <class T, class... Ps>static void inversex_impl(sqlite3_context*, int, argv_t);
+        template <class T> static void valueN_impl(sqlite3_context*);
         template <class T> static void finishN_impl(sqlite3_context*);
         template<class R, class... Ps> struct create_function_impl;
         template<class R, class... Ps> struct create_function_impl<R (Ps...)> {
-            status operator()(database& db, std::string_view name, function_flags flags, 
+            status operator()(database& db, std::string_view name, function_flags flags,
                               void* fh, destroyFn destroy) const {
                 return db.register_function(name, sizeof...(Ps), flags, fh, functionx_impl<R, Ps...>,
                                             nullptr, nullptr, destroy);
             }
         };
+        template <auto Fn>
+        static int collationN_impl(void*, int len1, const void* str1,
+                                   int len2, const void* str2) noexcept {
+            return Fn(std::string_view(static_cast<const char*>(str1), size_t(len1)),
+                      std::string_view(static_cast<const char*>(str2), size_t(len2)));
+        }
+
+        template<auto Fn, class F = decltype(Fn)> struct create_function_ptr_impl;
+        template<auto Fn, class R, class... Ps> struct create_function_ptr_impl<Fn, R (*)(Ps...)> {
+            status operator()(database& db, std::string_view name, function_flags flags) const {
+                return db.register_function(name, sizeof...(Ps), flags, nullptr,
+                                            functionN_impl<Fn, R, Ps...>, nullptr, nullptr, nullptr);
+            }
+        };
+        template<auto Fn, class R, class... Ps>
+        struct create_function_ptr_impl<Fn, R (*)(Ps...) noexcept>
+            : create_function_ptr_impl<Fn, R (*)(Ps...)> { };
 
     private:
         db_handle           db_;                    // shared_ptr<sqlite3>
@@ -521,6 +752,7 @@ namespace sqnice {
         rollback_handler    rh_;
         update_handler      uh_;
         authorize_handler   ah_;
+        change_recorder* _Nullable recorder_ = nullptr;  // Notified when a transaction commits
     };
 
 }
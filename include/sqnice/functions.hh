@@ -33,7 +33,7 @@
 #include <cstddef>
 #include <functional>
 #include <memory>
-#include <tuple>
+#include <optional>
 #include <type_traits>
 #include <utility>
 
@@ -60,14 +60,32 @@ namespace sqnice {
     /** The array of arguments passed to a function call. */
     class function_args : noncopyable {
     public:
-        function_args(int argc, database::argv_t argv)  :argc_(argc), argv_(argv) { }
+        function_args(int argc, database::argv_t argv,
+                      sqlite3_context* _Nullable ctx = nullptr)
+                                                        :argc_(argc), argv_(argv), ctx_(ctx) { }
 
         arg_value operator[] (size_t i) const;
         size_t size() const                             {return argc_;}
 
+        /// Returns a value of type `T` derived from the `idx`th argument by calling
+        /// `factory(arg_value const&)`, and caches it for later calls.
+        /// If the argument is a constant in the SQL statement -- like the pattern in
+        /// `regexp('^a.*z$', name)` -- SQLite keeps the cached value for the rest of the statement's
+        /// execution, so `factory` is called only once instead of on every row. SQLite deletes
+        /// the value when it's no longer needed.
+        /// @note  The returned reference is only valid until the function returns.
+        template <class T, class FACTORY>
+        T& cached_arg(size_t idx, FACTORY&& factory) const;
+
     private:
-        int const               argc_;
-        database::argv_t const  argv_;
+        friend class context;
+        sqlite3_value* _Nullable value(size_t i) const noexcept  {return argv_[i];}
+        void* _Nullable get_auxdata(size_t i) const;
+        void set_auxdata(size_t i, void* data, void (*destroy)(void*)) const;
+
+        int const                           argc_;
+        database::argv_t const              argv_;
+        sqlite3_context* _Nullable const    ctx_;
     };
 
 
@@ -106,6 +124,15 @@ namespace sqnice {
         template <resultable T>
         void operator= (T const& v) noexcept                    {set_helper(*this, v);}
 
+        /// Assigning an empty `optional` sets the result to `NULL`.
+        template <typename T>
+        void operator= (std::optional<T> const& v) {
+            if (v)
+                *this = *v;
+            else
+                *this = nullptr;
+        }
+
         using pointer_destructor = void(*)(void*);
 
         /// Sets the result to an opaque pointer value.
@@ -143,6 +170,12 @@ namespace sqnice {
         /// Gets the `idx`th arg as type `T`. Equivalent to `T t = argv[idx];`
         template <class T> T get(int idx) const;
 
+        /// Caches a value derived from a (constant) argument. Same as `argv.cached_arg`.
+        template <class T, class FACTORY>
+        T& cached_arg(size_t idx, FACTORY&& factory) {
+            return argv.cached_arg<T>(idx, std::forward<FACTORY>(factory));
+        }
+
     private:
         friend class database;
 
@@ -159,19 +192,20 @@ namespace sqnice {
             return reinterpret_cast<T*>(data);
         }
 
-        template <class... Ts>
-        std::tuple<Ts...> to_tuple() {
-            return to_tuple_impl(0, *this, std::tuple<Ts...>());
-        }
+        // Converts the `i`th argument to type `T`, without range-checking `i`.
+        template <class T> std::decay_t<T> arg(size_t i) const noexcept;
 
-        template<class H, class... Ts>
-        static inline std::tuple<H, Ts...> to_tuple_impl(int index, const context& c, std::tuple<H, Ts...>&&) {
-            auto h = std::make_tuple(c.context::get<H>(index));
-            return std::tuple_cat(h, to_tuple_impl(++index, c, std::tuple<Ts...>()));
-        }
+        // Calls `fn` with the arguments converted to types `Ps...`, and assigns its return value
+        // (if any) to `result`. This is used by the templated `create_function` variants.
+        template <class R, class... Ps, class F>
+        void call(F const& fn)              {call<R, Ps...>(fn, std::index_sequence_for<Ps...>{});}
 
-        static inline std::tuple<> to_tuple_impl(int /*index*/, const context& /*c*/, std::tuple<>&&) {
-            return std::tuple<>();
+        template <class R, class... Ps, class F, size_t... I>
+        void call(F const& fn, std::index_sequence<I...>) {
+            if constexpr (std::is_void_v<R>)
+                fn(arg<Ps>(I)...);          // (SQLite's default result is NULL)
+            else
+                result = fn(arg<Ps>(I)...);
         }
     };
 
@@ -245,56 +279,66 @@ namespace sqnice {
 
     template <class T> T context::get(int idx) const    {return argv[idx];}
 
+    template <class T, class FACTORY>
+    T& function_args::cached_arg(size_t idx, FACTORY&& factory) const {
+        if (auto cached = static_cast<T*>(get_auxdata(idx)))
+            return *cached;
+        auto value = new T(factory((*this)[idx]));
+        set_auxdata(idx, value, [](void* p) {delete static_cast<T*>(p);});
+        // "The destructor ... might be called immediately, before sqlite3_set_auxdata returns";
+        // that only happens on OOM, but if so the value is gone:
+        if (get_auxdata(idx) != value) [[unlikely]]
+            throw std::bad_alloc();
+        return *value;
+    }
 
-    // implementations of `database` function-related template methods.
-
-    namespace {
-        template<size_t N>
-        struct Apply {
-            template<typename F, typename T, typename... A>
-            static inline auto apply(F&& f, T&& t, A&&... a)
-            -> decltype(Apply<N-1>::apply(std::forward<F>(f),
-                                          std::forward<T>(t),
-                                          std::get<N-1>(std::forward<T>(t)),
-                                          std::forward<A>(a)...)) {
-                return Apply<N-1>::apply(std::forward<F>(f),
-                                         std::forward<T>(t),
-                                         std::get<N-1>(std::forward<T>(t)),
-                                         std::forward<A>(a)...);
-            }
-        };
-
-        template<>
-        struct Apply<0> {
-            template<typename F, typename T, typename... A>
-            static inline auto apply(F&& f, T&&, A&&... a)
-            -> decltype(std::forward<F>(f)(std::forward<A>(a)...)) {
-                return std::forward<F>(f)(std::forward<A>(a)...);
-            }
-        };
-
-        template<typename F, typename T>
-        inline auto apply_f(F&& f, T&& t)
-        -> decltype(Apply<std::tuple_size<typename std::decay<T>::type>::value>::apply(std::forward<F>(f), std::forward<T>(t))) {
-            return Apply<std::tuple_size<typename std::decay<T>::type>::value>::apply(
-                                                                                      std::forward<F>(f), std::forward<T>(t));
-        }
+    template <class T> std::decay_t<T> context::arg(size_t i) const noexcept {
+        if constexpr (std::is_same_v<std::decay_t<T>, arg_value>)
+            return arg_value(argv.value(i));    // parameter type is `arg_value const&`
+        else
+            return arg_value(argv.value(i)).get<std::decay_t<T>>();
     }
 
 
+    // implementations of `database` function-related template methods.
+
     template <class R, class... Ps>
     void database::functionx_impl(sqlite3_context* ctx, int nargs, argv_t values) {
         context c(ctx, nargs, values);
         auto f = static_cast<std::function<R (Ps...)>*>(c.user_data());
-        c.result = apply_f(*f, c.to_tuple<Ps...>());
+        c.call<R, Ps...>(*f);
+    }
+
+    template <auto Fn, class R, class... Ps>
+    void database::functionN_impl(sqlite3_context* ctx, int nargs, argv_t values) noexcept {
+        context c(ctx, nargs, values);
+        try {
+            c.call<R, Ps...>(Fn);
+        } catch (database_error const& x) {
+            c.result = x;
+        } catch (std::exception const& x) {
+            c.result.set_error(x.what());
+        }
     }
 
     template <class T, class... Ps>
     void database::stepx_impl(sqlite3_context* ctx, int nargs, argv_t values) {
         context c(ctx, nargs, values);
         T* t = c.aggregate_state<T>();
-        apply_f([](T* tt, Ps... ps){tt->step(ps...);},
-                std::tuple_cat(std::make_tuple(t), c.to_tuple<Ps...>()));
+        c.call<void, Ps...>([t](auto&&... ps) {t->step(std::forward<decltype(ps)>(ps)...);});
+    }
+
+    template <class T, class... Ps>
+    void database::inversex_impl(sqlite3_context* ctx, int nargs, argv_t values) {
+        context c(ctx, nargs, values);
+        T* t = c.aggregate_state<T>();
+        c.call<void, Ps...>([t](auto&&... ps) {t->inverse(std::forward<decltype(ps)>(ps)...);});
+    }
+
+    template <class T>
+    void database::valueN_impl(sqlite3_context* ctx) {
+        context c(ctx);
+        c.result = c.aggregate_state<T>()->value();
     }
 
     template <class T>
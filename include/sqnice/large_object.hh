@@ -0,0 +1,155 @@
+// sqnice/large_object.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+#ifndef SQNICE_LARGE_OBJECT_H
+#define SQNICE_LARGE_OBJECT_H
+
+#include "sqnice/base.hh"
+#include <optional>
+#include <string>
+#include <string_view>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class blob_stream;
+    class database;
+    class pool;
+
+    /** A store of "large objects": byte arrays that can be bigger than SQLite's 2GB blob limit,
+        and that can be read and written incrementally without loading them into memory.
+
+        Each object is split into fixed-size chunks, stored as blobs in rows of a table
+        `<name>_chunks`; another table `<name>` records each object's size and chunk size.
+        The last chunk's blob may be longer than its data, zero-padded, so that appends can
+        write in place instead of rewriting it.
+        An object is accessed through a `large_object`.
+
+        @note  Like `transaction`, this class and `large_object` throw exceptions on errors,
+               regardless of the database's `exceptions` setting. */
+    class large_object_store : noncopyable {
+    public:
+        static constexpr size_t kDefaultChunkSize = 1024 * 1024;
+
+        /// Opens a store in the database, creating its tables if necessary.
+        /// @param db  The database.
+        /// @param name  The name of the store's table. Its chunks table is `<name>_chunks`.
+        /// @param chunk_size  The chunk size of objects created by this instance.
+        explicit large_object_store(database& db,
+                                    std::string_view name = "large_objects",
+                                    size_t chunk_size = kDefaultChunkSize);
+
+        /// The store's name.
+        std::string const& name() const                 {return name_;}
+
+        /// Creates a new, empty object and returns its ID.
+        int64_t create();
+
+        /// True if an object with this ID exists.
+        bool exists(int64_t id) const;
+
+        /// Deletes an object. Does nothing if it doesn't exist.
+        void remove(int64_t id);
+
+    private:
+        database&           db_;
+        std::string const   name_;
+        size_t const        chunk_size_;
+    };
+
+
+    /** Random access to a large object in a `large_object_store`, with 64-bit offsets.
+        Unlike a `blob_stream`, a `large_object` can be appended to and truncated.
+        @warning  Don't write to an object while another `large_object` instance is accessing it,
+                  since that instance's cached size will become wrong. */
+    class large_object : noncopyable {
+    public:
+        /// Opens an existing object for reading and writing.
+        /// @throws database_error if the object doesn't exist.
+        large_object(database& db, std::string_view store_name, int64_t id);
+
+        /// Opens an existing object for reading only.
+        /// @throws database_error if the object doesn't exist.
+        large_object(database const& db, std::string_view store_name, int64_t id);
+
+        int64_t id() const noexcept                     {return id_;}
+
+        /// The object's size in bytes.
+        uint64_t size() const noexcept                  {return size_;}
+
+        /// The size of the object's chunks; every chunk but the last has this size.
+        size_t chunk_size() const noexcept              {return chunk_size_;}
+
+        /// Reads from the object. Reading past the end is not an error, but the read will be
+        /// truncated. Starting the read past the end _is_ an error.
+        /// @returns  The number of bytes read.
+        size_t pread(void* dst, size_t len, uint64_t offset) const;
+
+        /// Reads from the object like `pread`, but reads its chunks concurrently on up to
+        /// `max_threads` threads; the extra threads use read-only databases borrowed from `pool`,
+        /// which must be on the same database file.
+        /// @note  The pool's databases won't see changes in an uncommitted transaction.
+        size_t pread_parallel(pool& pool, void* dst, size_t len, uint64_t offset,
+                              unsigned max_threads = 4) const;
+
+        /// Writes to the object. If the write extends past the end, the object grows.
+        /// If `offset` is past the end, the gap is filled with zeroes.
+        void pwrite(const void* src, size_t len, uint64_t offset);
+
+        /// Writes to the end of the object.
+        void append(const void* src, size_t len)        {pwrite(src, len, size_);}
+
+        /// Changes the object's size. If it grows, the new bytes are zeroes.
+        void truncate(uint64_t size);
+
+    private:
+        large_object(database* db, bool writeable, std::string_view store_name, int64_t id);
+        int64_t chunk_rowid(uint64_t seq) const;
+        size_t chunk_length(uint64_t seq) const noexcept;
+        void read_chunk(database const&, std::optional<blob_stream>&,
+                        uint64_t seq, void* dst, size_t len, size_t offset) const;
+        void write_chunk(uint64_t seq, const void* src, size_t len, size_t offset);
+        void reserve_chunk(int64_t rowid, size_t length);
+        void resize(uint64_t new_size);
+        void save_size();
+        database& writeable_db() const;
+
+        database*           db_;
+        bool                writeable_;
+        std::string const   table_;         // Quoted name of the objects table
+        std::string const   chunks_name_;   // Unquoted name of the chunks table
+        std::string const   chunks_table_;  // Quoted name of the chunks table
+        int64_t const       id_;
+        uint64_t            size_ = 0;
+        size_t              chunk_size_ = 0;
+    };
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
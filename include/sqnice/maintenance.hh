@@ -0,0 +1,129 @@
+// sqnice/maintenance.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_MAINTENANCE_H
+#define SQNICE_MAINTENANCE_H
+
+#include "sqnice/base.hh"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class database;
+    class pool;
+
+    /** Parameters of a `maintenance_scheduler`. */
+    struct maintenance_options {
+        /// How often the scheduler checks whether the writeable database is idle.
+        std::chrono::milliseconds check_interval {1000};
+
+        /// Incremental vacuuming starts when the freelist has at least this many pages.
+        /// (It only happens if the database is in `auto_vacuum=incremental` mode.)
+        int64_t vacuum_threshold_pages = 64;
+
+        /// Maximum number of pages freed per `PRAGMA incremental_vacuum`. Each slice is its own
+        /// transaction, and the scheduler checks for waiting writers between slices.
+        int64_t vacuum_pages_per_slice = 128;
+
+        /// `PRAGMA optimize` runs at least this often. Zero disables periodic optimizing.
+        std::chrono::seconds optimize_interval {3600};
+
+        /// `PRAGMA optimize` also runs after this many write transactions (returns of the pool's
+        /// writeable database) since the last time. Zero disables this.
+        uint64_t optimize_after_writes = 1000;
+
+        /// If true, a passive WAL checkpoint runs after vacuuming, since the freed pages are
+        /// otherwise still in the WAL.
+        bool checkpoint_after_vacuum = true;
+    };
+
+
+    /** Cumulative statistics of a `maintenance_scheduler`. */
+    struct maintenance_stats {
+        std::chrono::nanoseconds time_spent {0};    ///< Time spent holding the writeable db
+        int64_t  pages_reclaimed = 0;               ///< Pages removed by incremental vacuum
+        unsigned vacuum_slices = 0;                 ///< Number of incremental vacuum steps
+        unsigned optimize_runs = 0;                 ///< Number of `PRAGMA optimize` calls
+        unsigned preemptions = 0;                   ///< Times work stopped for a waiting writer
+        unsigned errors = 0;                        ///< Number of maintenance steps that failed
+    };
+
+
+    /** Runs routine maintenance on a `pool`'s database on a background thread, using the
+        writeable database only when no one else is using it:
+
+        - Incremental vacuuming, in small slices, when the freelist grows.
+        - `PRAGMA optimize`, periodically and after bursts of writes.
+
+        As soon as another thread asks for the writeable database, the scheduler stops and
+        returns it to the pool, so maintenance doesn't add latency to real writes.
+        Errors are logged and counted but don't stop the scheduler. */
+    class maintenance_scheduler : noncopyable {
+    public:
+        explicit maintenance_scheduler(pool&, maintenance_options const& = {});
+
+        /// Stops the scheduler, waiting for any step in progress to finish.
+        ~maintenance_scheduler();
+
+        /// Asks the scheduler to check for work right away instead of at the next interval.
+        /// Thread-safe.
+        void run_now();
+
+        /// Cumulative statistics. Thread-safe.
+        maintenance_stats stats() const;
+
+    private:
+        void run();
+        void run_pass();
+        bool preempted();
+        void vacuum(database&);
+        void optimize(database&);
+
+        using clock = std::chrono::steady_clock;
+
+        pool&                       pool_;
+        maintenance_options const   options_;
+        clock::time_point           last_optimize_;
+        uint64_t                    optimize_generation_;   // Pool write generation at optimize
+        uint64_t                    own_writes_ = 0;        // Generations caused by me
+        std::atomic<bool>           stopped_ = false;
+        mutable std::mutex          mutex_;                 // Protects the following members
+        std::condition_variable     cond_;
+        bool                        wake_ = false;
+        maintenance_stats           stats_;
+        std::thread                 thread_;                // Must be last
+    };
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
@@ -0,0 +1,127 @@
+// sqnice/memory.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_MEMORY_H
+#define SQNICE_MEMORY_H
+
+#include "sqnice/base.hh"
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class database;
+}
+
+/** Configuration of SQLite's memory allocation. */
+namespace sqnice::memory {
+
+    /** Process-wide options; see `configure`. */
+    struct options {
+        /// If true, SQLite allocates through sqnice's size-class allocator instead of directly
+        /// with `malloc`. Requests up to 1KB are rounded up to one of a few size classes, and
+        /// freed blocks are cached per thread for reuse, which avoids most `malloc` calls and
+        /// the fragmentation caused by SQLite's many small, short-lived allocations.
+        bool pooled_allocator = true;
+
+        /// SQLite's `SQLITE_CONFIG_MEMSTATUS`. If false, SQLite doesn't track memory usage,
+        /// which removes a global mutex from every allocation; but then `sqlite3_memory_used`
+        /// and soft heap limits don't work.
+        bool track_usage = true;
+
+        /// Default lookaside configuration of new connections (`SQLITE_CONFIG_LOOKASIDE`):
+        /// the size and number of slots. -1 leaves SQLite's default (1200 x 100).
+        int lookaside_slot_size = -1;
+        int lookaside_slot_count = -1;
+
+        /// If nonzero, SQLite's page caches are replaced by sqnice's (`SQLITE_CONFIG_PCACHE2`),
+        /// and all of them together hold at most this many bytes of pages. Each connection's
+        /// `cache_size` is then ignored, so memory use follows the working set of the whole
+        /// process instead of growing with the number of connections. See `prioritize_cache`.
+        size_t page_cache_budget = 0;
+    };
+
+    /// Configures SQLite's memory allocation. This must be called before any database is
+    /// opened, or any other SQLite call is made; otherwise it returns `misuse`.
+    status configure(options const& = {});
+
+    /** Counters of the pooled allocator. */
+    struct allocator_stats {
+        uint64_t cache_hits = 0;    ///< Allocations served from a thread's cache of free blocks
+        uint64_t cache_misses = 0;  ///< Small allocations that had to call `malloc`
+        uint64_t large = 0;         ///< Allocations too big for a size class
+        uint64_t cached_bytes = 0;  ///< Bytes of free blocks currently held in caches
+    };
+
+    /// The pooled allocator's counters. (They're all zero if it isn't in use.)
+    allocator_stats stats() noexcept;
+
+
+    /// Sets the lookaside configuration of a database connection: a per-connection pool of
+    /// `slot_count` blocks of `slot_size` bytes, that SQLite uses for small allocations
+    /// before falling back to the global allocator. Call this right after opening the
+    /// database, e.g. from `pool::on_open`; it fails with `busy` once lookaside memory is in use.
+    /// @note  Has no effect if SQLite was built with `SQLITE_OMIT_LOOKASIDE`, as some Linux
+    ///        distributions' system libraries are.
+    status set_lookaside(database&, int slot_size, int slot_count);
+
+    /** A connection's lookaside usage; from `SQLITE_DBSTATUS_LOOKASIDE_*`. */
+    struct lookaside_counters {
+        int used = 0;               ///< Slots currently in use
+        int highwater = 0;          ///< Maximum slots ever in use
+        int hits = 0;               ///< Allocations satisfied from lookaside
+        int misses_size = 0;        ///< Allocations too large for a lookaside slot
+        int misses_full = 0;        ///< Allocations made when all slots were in use
+    };
+
+    /// Returns a connection's lookaside counters. If `reset` is true, the hit and miss
+    /// counters and the high-water mark are reset afterwards.
+    lookaside_counters lookaside_stats(database const&, bool reset = false);
+
+
+    /** Counters of the shared page cache; see `options::page_cache_budget`. */
+    struct page_cache_stats {
+        size_t   budget = 0;        ///< The configured budget in bytes; 0 if not in use
+        size_t   used = 0;          ///< Bytes of pages currently cached
+        size_t   caches = 0;        ///< Number of caches (one per database file per connection)
+        uint64_t hits = 0;          ///< Page lookups found in a cache
+        uint64_t misses = 0;        ///< Page lookups that had to read the page
+        uint64_t evictions = 0;     ///< Pages evicted to stay within the budget
+    };
+
+    /// The shared page cache's counters.
+    page_cache_stats cache_stats() noexcept;
+
+    /// Gives a connection's page cache priority in the shared page cache: when the budget is
+    /// full, pages are evicted from other caches first, least-recently used first. Call this
+    /// on a pool's writeable connection from `pool::on_open`, so readers scanning large tables
+    /// don't push out the pages the writer is updating. (No-op if the shared cache isn't used.)
+    void prioritize_cache(database&);
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
@@ -28,9 +28,13 @@
 #define SQNICE_POOL_H
 
 #include "sqnice/database.hh"
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
 
 ASSUME_NONNULL_BEGIN
 
@@ -44,6 +48,22 @@ namespace sqnice {
     using borrowed_writeable_database = std::unique_ptr<database, pool&>;
 
 
+    /** A borrowed read-only database that's been in a read transaction a long time; returned by
+        `pool::check_readers`. */
+    struct long_reader {
+        database const*                     db;     ///< The borrowed database
+        std::chrono::steady_clock::duration age;    ///< How long the transaction has been open
+        std::string                         sql;    ///< Active statement, with bound values
+    };
+
+    /** What `pool::check_readers` should do to the long readers it finds. */
+    enum class long_reader_action {
+        report,         ///< Just return them
+        interrupt,      ///< Call `sqlite3_interrupt`, making their current statements fail
+        recycle,        ///< Interrupt them, and close them instead of reusing them when returned
+    };
+
+
     /** A thread-safe pool of databases, for multi-threaded use. */
     class pool : noncopyable {
     public:
@@ -53,8 +73,16 @@ namespace sqnice {
         ///
         /// - If you don't include the flag `readwrite`, you won't be allowed to borrow a
         ///   writeable database.
-        /// - The flags `temporary` and `memory` are not allowed, since SQLite doesn't support
-        ///   multiple connections to temporary databases.
+        /// - The flag `temporary` is not allowed, since SQLite doesn't support multiple
+        ///   connections to a temporary database.
+        /// - With the flag `memory`, the pool shares an in-memory database between its
+        ///   connections, using SQLite's `memdb` VFS; `filename` is then a `file:/name?vfs=memdb`
+        ///   URI. A plain name makes the database accessible to other connections opened with
+        ///   that URI and the `uri` flag; an empty name makes it private to the pool. The
+        ///   database is created immediately, and lasts as long as the pool. memdb doesn't
+        ///   support WAL, so a commit waits (up to a 5-second busy timeout) for readers to finish
+        ///   their transactions, and pool features involving files, like checkpoints and
+        ///   compaction, don't apply.
         /// - The flag `delete_first` is honored when the first database is opened, ignored
         ///   after that (so you don't delete your own database!)
         explicit pool(std::string_view filename,
@@ -64,6 +92,9 @@ namespace sqnice {
         /// `pool`'s destructor waits until all borrowed databases have been returned.
         ~pool();
 
+        /// The path of the database file.
+        std::string const& filename() const noexcept        {return _dbname;}
+
         /// The maximum number of databases the pool will create, including one writeable one.
         /// Defaults to 5. Minimum value is 2 (otherwise why are you using a pool at all?)
         unsigned capacity() const;
@@ -80,6 +111,22 @@ namespace sqnice {
         /// since it will be called multiple times.
         void on_open(std::function<void(database&)>);
 
+        /// Sets `PRAGMA wal_autocheckpoint` on the writeable database, which takes effect the next
+        /// time it's borrowed, and is reapplied whenever it's reopened. 0 disables automatic
+        /// checkpoints; SQLite's default is 1000 pages.
+        void set_auto_checkpoint(int pages);
+
+        /// The value last given to `set_auto_checkpoint`, or -1 if it's never been called.
+        int auto_checkpoint() const;
+
+        /// Sets the busy timeout, in milliseconds, of the writeable database, which takes effect
+        /// the next time it's borrowed, and is reapplied whenever it's reopened. This overrides
+        /// any timeout set by the `on_open` initializer; SQLite's default is 0.
+        void set_writer_busy_timeout(int ms);
+
+        /// The value last given to `set_writer_busy_timeout`, or -1 if it's never been called.
+        int writer_busy_timeout() const;
+
         /// The number of databases open, both borrowed and available.
         unsigned open_count() const;
 
@@ -116,6 +163,55 @@ namespace sqnice {
         /// (The pool can still re-open more databases on demand, up to its capacity.)
         void close_unused();
 
+        /// Waits until all borrowed databases have been returned, closes them all, and calls `fn`
+        /// while no connections to the file are open; for example, to replace the file.
+        /// Attempts to borrow a database block until `fn` returns; after that, connections are
+        /// reopened on demand.
+        ///
+        /// If the borrowed databases aren't all returned within `timeout`, it gives up without
+        /// calling `fn`, unblocks borrowers, and returns false. A timeout keeps this from
+        /// deadlocking with a thread that holds a database while it borrows another one.
+        /// @warning  Don't call this while holding a borrowed database; it'll deadlock, or time
+        ///           out.
+        bool with_all_closed(std::function<void()> const& fn,
+                             std::chrono::milliseconds timeout = std::chrono::milliseconds::max());
+
+        /// Opens a new connection to the pool's database, with the pool's flags, vfs and `on_open`
+        /// initializer, that the pool doesn't manage or count. This is for tasks that need a
+        /// connection of their own, or that run during `with_all_closed`.
+        /// @note  A writeable connection opened this way competes with the pool's writer for
+        ///        SQLite's write lock.
+        std::unique_ptr<database> open_connection(bool writeable = false) const;
+
+        /// A counter that's incremented every time the writeable database is returned to the
+        /// pool. If it hasn't changed, nothing can have been written through the pool.
+        uint64_t write_generation() const;
+
+        /// Finds borrowed read-only databases that have had a read transaction open for at least
+        /// `min_age` -- either an explicit transaction or a query that's still being stepped.
+        /// Such readers keep WAL checkpoints from completing, so the WAL grows without bound.
+        ///
+        /// Transactions are timed from the first call that sees them, so call this periodically,
+        /// at an interval well under `min_age`.
+        /// @note  A reader's SQL can't be found while a query is running in a `nomutex`
+        ///        connection, or while another thread is inside a call to step it; then the
+        ///        last SQL seen is reported.
+        std::vector<long_reader> check_readers(std::chrono::milliseconds min_age,
+                                               long_reader_action = long_reader_action::report);
+
+        /// Returns the sum of the metrics of all the pool's open connections, including idle ones.
+        /// A borrowed connection is skipped, and counted in `connections_busy`, if another thread
+        /// is in the middle of a call on it, so this never blocks on a running query.
+        ///
+        /// The counters (hits, misses, writes...) are cumulative over the pool's lifetime, so
+        /// they never decrease: they include the final values of connections the pool has
+        /// closed, and the last values sampled from busy connections.
+        metrics_snapshot metrics() const;
+
+        /// True if any thread is blocked in `borrow_writeable`, waiting for the writeable database.
+        /// Background tasks holding the writeable database can poll this, and give it back.
+        bool writeable_wanted() const;
+
 #ifndef __GNUC__
     private:
         friend borrowed_database;
@@ -132,7 +228,10 @@ namespace sqnice {
         borrowed_database borrow(bool);
         borrowed_writeable_database borrow_writeable(bool);
         std::unique_ptr<database> new_db(bool writeable);
+        std::unique_ptr<database> open_db(open_flags, bool writeable,
+                                          std::function<void(database&)> const&) const;
         void _close_unused();
+        void _retire(database const*);
 
         using db_ptr = std::unique_ptr<const database>;
 
@@ -146,6 +245,23 @@ namespace sqnice {
         unsigned                        _rw_total = 0;  // Number of read-write DBs I created (0, 1)
         std::vector<db_ptr>             _readonly;      // Stack of available RO DBs
         std::unique_ptr<database>       _readwrite;     // The available RW DB
+
+        struct reader_state {
+            std::optional<std::chrono::steady_clock::time_point> txn_start;
+            std::string sql;
+            bool        recycle = false;
+        };
+        std::unordered_map<database const*, reader_state> _borrowed_readers;  // For check_readers
+        database* _Nullable             _borrowed_writer = nullptr;  // The RW DB, if borrowed
+        uint64_t                        _write_gen = 0; // Incremented when RW DB is returned
+        bool                            _suspended = false; // True during `with_all_closed`
+        unsigned                        _rw_waiters = 0;// Threads waiting for the RW DB
+        int                             _auto_checkpoint = -1;  // wal_autocheckpoint, or -1
+        int                             _writer_busy_timeout = -1; // RW DB busy timeout, or -1
+        bool                            _writer_settings_pending = false; // Must apply to RW DB
+        std::unique_ptr<database>       _memory_anchor; // Keeps an in-memory DB alive
+        metrics_snapshot                _retired_metrics;   // Counters of closed connections
+        mutable std::unordered_map<database const*, metrics_snapshot> _last_metrics; // Samples
     };
 
 }
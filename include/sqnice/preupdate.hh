@@ -0,0 +1,185 @@
+// sqnice/preupdate.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_PREUPDATE_H
+#define SQNICE_PREUPDATE_H
+
+#include "sqnice/change_feed.hh"
+#include "sqnice/functions.hh"
+#include <functional>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+
+    /** Describes a row that's about to be changed; passed to a `preupdate_hook`'s handler.
+        Column values are accessed as `arg_value`s, like the arguments of a function. */
+    class preupdate_change : noncopyable {
+    public:
+        change_op op() const noexcept                   {return op_;}
+        std::string_view database_name() const noexcept {return dbname_;}
+        std::string_view table() const noexcept         {return table_;}
+
+        /// The rowid before the change (for `update` and `remove`.)
+        int64_t old_rowid() const noexcept              {return old_rowid_;}
+        /// The rowid after the change (for `insert` and `update`.)
+        int64_t new_rowid() const noexcept              {return new_rowid_;}
+
+        /// The number of columns in the row.
+        int column_count() const noexcept;
+
+        /// 0 for a change made directly by a statement, 1 for one made by a trigger, and so on.
+        int depth() const noexcept;
+
+        /// The value of a column before the change. Only valid for `update` and `remove`.
+        /// @throws database_error  if the column index is out of range, or the op is `insert`.
+        arg_value old_value(int column) const;
+
+        /// The value of a column after the change. Only valid for `insert` and `update`.
+        /// @throws database_error  if the column index is out of range, or the op is `remove`.
+        arg_value new_value(int column) const;
+
+    private:
+        friend class preupdate_hook;
+        preupdate_change(sqlite3*, int op, const char* dbname, const char* table,
+                         int64_t old_rowid, int64_t new_rowid) noexcept;
+
+        sqlite3*            db_;
+        change_op           op_;
+        std::string_view    dbname_, table_;
+        int64_t             old_rowid_, new_rowid_;
+    };
+
+
+    /** Calls a handler just before every row is inserted, updated or deleted by a database
+        connection, with access to the old and new column values; a wrapper around
+        `sqlite3_preupdate_hook`.
+
+        A connection can have only one preupdate hook. The session extension uses it too, so
+        this can't be used on the same connection as a `change_recorder`.
+
+        @note  This requires SQLite built with `SQLITE_ENABLE_PREUPDATE_HOOK`. The vendored
+               SQLite is; the CMake build detects whether the system SQLite is. If not, the
+               constructor throws. */
+    class preupdate_hook : noncopyable {
+    public:
+        using handler = std::function<void(preupdate_change const&)>;
+
+        /// Installs the hook. The handler is called on the thread making the change, inside
+        /// SQLite, so it should be fast; it must not use the database connection. Exceptions it
+        /// throws are logged and ignored.
+        preupdate_hook(database&, handler);
+
+        /// Removes the hook.
+        ~preupdate_hook();
+
+    private:
+        static void callback(void*, sqlite3*, int, const char*, const char*,
+                             long long, long long) noexcept;
+
+        database&   db_;
+        handler     handler_;
+    };
+
+
+#pragma mark - AUDIT RECORDER:
+
+
+    /** A column value decoded from an audit record. Text and blobs point into the record. */
+    using audit_value = std::variant<std::nullptr_t, int64_t, double, std::string_view, blob>;
+
+    /** A decoded audit record: a row change, with the row's values before and after. */
+    struct audit_record {
+        change_op                   op;
+        std::string_view            table;     ///< Prefixed with "db." if not in main database
+        int64_t                     old_rowid;  ///< Rowid before the change; 0 for `insert`
+        int64_t                     new_rowid;  ///< Rowid after the change; 0 for `remove`
+        std::vector<audit_value>    old_values; ///< All columns (empty for `insert`)
+        /// All columns (empty for `remove`.) For an `update`, unchanged columns are `nullopt`.
+        std::vector<std::optional<audit_value>> new_values;
+    };
+
+
+    /** Records every row change made by a database connection, with its old and new values, in
+        a compact binary form suitable for an audit log or for undoing the changes.
+
+        Records are appended to an in-memory arena as changes happen, without reading the rows,
+        and handed to the flush callback in one batch when the transaction commits. If the
+        transaction is rolled back, they're discarded; if a record can't be stored, the
+        transaction is rolled back. The arena's memory is reused from one
+        transaction to the next.
+
+        Record format: an op byte, the table name, the old and/or new rowid, the column count,
+        then the old values (for update and delete) and new values (for insert and update.) In
+        an update, new values equal to the old ones are written as a single "unchanged" byte.
+        Integers are zigzag varints; strings and blobs are prefixed with their varint length.
+        Use `decode_audit_records` to parse them.
+
+        The recorder installs a `preupdate_hook`, and the connection's commit and rollback
+        hooks, so it can't be combined with a `change_feed` or `change_recorder` on the same
+        connection. */
+    class audit_recorder : noncopyable {
+    public:
+        /// Called at commit with the records of the transaction. It runs inside the commit hook,
+        /// so it must not use the database connection.
+        using flush_handler = std::function<void(std::span<const std::byte> records,
+                                                 size_t count)>;
+
+        audit_recorder(database&, flush_handler);
+        ~audit_recorder();
+
+        /// Total number of records flushed.
+        uint64_t records_flushed() const noexcept       {return flushed_;}
+
+    private:
+        void record(preupdate_change const&);
+        bool committed();
+        void rolled_back() noexcept;
+
+        database&               db_;
+        flush_handler           flush_;
+        std::vector<std::byte>  arena_;         // Encoded records of the current transaction
+        size_t                  count_ = 0;     // Number of records in `arena_`
+        uint64_t                flushed_ = 0;
+        bool                    failed_ = false; // A record couldn't be written
+        std::optional<preupdate_hook> hook_;
+    };
+
+    /// Decodes the records passed to an `audit_recorder`'s flush handler, calling `fn` for each.
+    /// @throws database_error  if the data is corrupt.
+    void decode_audit_records(std::span<const std::byte> records,
+                              std::function<void(audit_record const&)> const& fn);
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
@@ -29,11 +29,26 @@
 
 // Umbrella header that includes the sqnice headers.
 
+#include "sqnice/backup.hh"
 #include "sqnice/blob_stream.hh"
+#include "sqnice/blob_streambuf.hh"
+#include "sqnice/change_feed.hh"
+#include "sqnice/change_recorder.hh"
+#include "sqnice/checkpoint.hh"
+#include "sqnice/collations.hh"
+#include "sqnice/compaction.hh"
+#include "sqnice/compression.hh"
 #include "sqnice/database.hh"
 #include "sqnice/functions.hh"
+#include "sqnice/large_object.hh"
+#include "sqnice/maintenance.hh"
+#include "sqnice/memory.hh"
 #include "sqnice/pool.hh"
+#include "sqnice/preupdate.hh"
 #include "sqnice/query.hh"
+#include "sqnice/statistics.hh"
+#include "sqnice/template_cache.hh"
 #include "sqnice/transaction.hh"
+#include "sqnice/virtual_table.hh"
 
 #endif
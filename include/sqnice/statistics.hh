@@ -0,0 +1,62 @@
+// sqnice/statistics.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_STATISTICS_H
+#define SQNICE_STATISTICS_H
+
+#include "sqnice/base.hh"
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+    class database;
+
+    /** Registers a library of statistical aggregate functions with a database connection.
+        All of them ignore `NULL` arguments. They return `NULL` if there were no non-`NULL` rows,
+        except `approx_count_distinct`, which returns 0 like `COUNT`.
+
+        - `kahan_sum(x)`, `mean(x)` -- Sum and mean using compensated (Kahan-Babuška) summation,
+          so they don't lose precision on large or badly-scaled inputs the way `sum` and `avg`
+          can. Usable as window functions.
+        - `var_samp(x)`, `var_pop(x)`, `stddev_samp(x)`, `stddev_pop(x)` -- Variance and standard
+          deviation, using Welford's numerically stable algorithm. `variance` and `stddev` are
+          aliases of the `_samp` versions. Usable as window functions.
+        - `median(x)` -- The exact median, found by selection (`std::nth_element`) rather than
+          sorting.
+        - `approx_quantile(x, q)` -- An approximate `q` quantile (0 <= q <= 1), using a KLL sketch
+          with bounded memory. The rank error is typically under 1%.
+        - `approx_count_distinct(x)` -- An approximation of `COUNT(DISTINCT x)` using HyperLogLog,
+          in 4KB of state. The typical error is about 1.6%. Like `COUNT`, it returns 0 (not
+          `NULL`) if there were no non-`NULL` rows.
+
+        To add these to every connection in a `pool`, call this from a `pool::on_open` callback. */
+    status register_statistics(database&);
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
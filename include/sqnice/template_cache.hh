@@ -0,0 +1,84 @@
+// sqnice/template_cache.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_TEMPLATE_CACHE_H
+#define SQNICE_TEMPLATE_CACHE_H
+
+#include "sqnice/database.hh"
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+
+    /** A thread-safe set of named template databases, kept as serialized images, from which
+        new in-memory databases can be cloned very cheaply -- the cost is basically a `memcpy`.
+        Useful for tests or sandboxes that each need a database with a standard schema and seed
+        data, without running the DDL and inserts every time. */
+    class template_cache : noncopyable {
+    public:
+        using initializer = std::function<void(database&)>;
+
+        /// Adds (or replaces) a template, created by calling `init` on a new in-memory database.
+        void add(std::string_view name, initializer const& init);
+
+        /// Adds (or replaces) a template that's a snapshot of an existing database.
+        void add(std::string_view name, database const& source);
+
+        /// True if there's a template with this name.
+        bool contains(std::string_view name) const;
+
+        /// Removes a template.
+        void remove(std::string_view name);
+
+        /// Returns a new in-memory database that's a copy of a template.
+        /// @throws std::invalid_argument  if there's no such template.
+        database clone(std::string_view name) const;
+
+        /// Returns a new in-memory database that's a copy of a template, first creating the
+        /// template by calling `init` if it doesn't exist yet.
+        database clone(std::string_view name, initializer const& init);
+
+    private:
+        using image_ref = std::shared_ptr<const database_image>;
+
+        static image_ref make_image(initializer const&);
+        image_ref find(std::string_view name) const;
+        static database clone(database_image const&);
+
+        std::mutex mutable                          mutex_;
+        std::map<std::string, image_ref, std::less<>> images_;
+    };
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
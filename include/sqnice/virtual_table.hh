@@ -0,0 +1,482 @@
+// sqnice/virtual_table.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_VIRTUAL_TABLE_H
+#define SQNICE_VIRTUAL_TABLE_H
+
+#include "sqnice/functions.hh"
+#include <algorithm>
+#include <cmath>
+#include <compare>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+
+    /** Abstract base class of `virtual_table`: a C++ interface to a SQLite virtual table module.
+        You can subclass this directly to implement a custom table, but `virtual_table` is a lot
+        easier to use.
+        Register an instance with `database::create_virtual_table`. */
+    class virtual_table_base {
+    public:
+        virtual ~virtual_table_base() = default;
+
+        /// A constraint operator in a `WHERE` clause. (Values are equal to
+        /// `SQLITE_INDEX_CONSTRAINT_EQ`, etc.; other values may appear too.)
+        enum class constraint_op : unsigned char {
+            eq = 2, gt = 4, le = 8, lt = 16, ge = 32,
+        };
+
+        /// A `WHERE` constraint on a column, which `best_index` may choose to use.
+        struct index_constraint {
+            int             column;         ///< Column index
+            constraint_op   op;             ///< Comparison operator
+            bool            usable;         ///< False if this constraint can't be used in this plan
+            const char*     collation;      ///< Collation used to compare text, e.g. "BINARY"
+            int             argv_index = 0; ///< Set to n > 0 to receive the value as `args[n-1]`
+        };
+
+        /// A term of the `ORDER BY` clause.
+        struct index_order {
+            int             column;
+            bool            desc;
+        };
+
+        /// The input and output of `best_index`; a C++ view of `sqlite3_index_info`.
+        struct index_info {
+            std::vector<index_constraint> constraints;      ///< Usable constraints (in/out)
+            std::vector<index_order>      order_by;         ///< Requested ordering
+            int     idx_num = 0;                            ///< Plan ID, passed to `cursor::filter`
+            double  estimated_cost = 1e6;                   ///< Relative cost of this plan
+            int64_t estimated_rows = 1e6;                   ///< Rows this plan will return
+            bool    order_by_consumed = false;              ///< True if rows will be in order
+        };
+
+        /** An iterator over a virtual table's rows. */
+        class cursor {
+        public:
+            virtual ~cursor() = default;
+            /// Starts a scan. `idx_num` and the `args` are as requested by `best_index`.
+            virtual void filter(int idx_num, function_args const& args) = 0;
+            virtual bool eof() const = 0;
+            virtual void next() = 0;
+            /// Assigns the value of column number `col` of the current row to `result`.
+            virtual void column(function_result& result, int col) const = 0;
+            virtual int64_t rowid() const = 0;
+        };
+
+    protected:
+        friend class virtual_table_module;
+
+        /// The `CREATE TABLE` statement declaring the table's columns.
+        virtual std::string declaration() const = 0;
+        /// Chooses a query plan, given the constraints and ordering of a query.
+        virtual void best_index(index_info&) const = 0;
+        /// Returns a new cursor.
+        virtual std::unique_ptr<cursor> open() = 0;
+
+        // Writes. The default implementations throw a `readonly` error.
+        /// Inserts a row, given its column values, and returns its rowid.
+        virtual int64_t insert(function_args const& values);
+        /// Replaces the column values of a row.
+        virtual void update(int64_t rowid, function_args const& values);
+        /// Deletes a row.
+        virtual void remove(int64_t rowid);
+        /// Called when the transaction containing writes to this table ends.
+        virtual void commit()               { }
+    };
+
+
+    /** A virtual table whose rows are the items of a C++ range, such as a `std::vector`.
+        This lets SQL queries read (and join against) in-memory C++ data directly, without
+        copying it into a temporary table.
+
+        The table refers to the range, it doesn't copy it; the range must stay alive, and must not
+        be modified by other code while a query is using the table.
+
+        You define the table's columns by calling `column` with a name and a "getter": a function
+        or member pointer that takes a row and returns the column value, as any type that can be
+        assigned to a `function_result`. Strings returned by reference (such as via a member
+        pointer to a `std::string`) are passed to SQLite without copying.
+
+        If the range is sorted by a column, call `sorted_by`; then equality and range constraints
+        on that column (`=`, `<`, `<=`, `>`, `>=`) are answered by binary search, and an
+        `ORDER BY` on that column requires no sorting.
+
+        The rowid of a row is its position in the range.
+
+        Example:
+        ```
+        auto table = std::make_shared<virtual_table<vector<person>>>(people);
+        table->column("id", &person::id)
+              .column("name", &person::name)
+              .sorted_by("id");
+        db.create_virtual_table("people", table);
+        ```
+        @note  Finish defining the table before registering it. */
+    template <std::ranges::forward_range RANGE>
+    class virtual_table : public virtual_table_base {
+    public:
+        using row_type = std::ranges::range_value_t<RANGE>;
+
+        explicit virtual_table(RANGE& range)       :range_(range) { }
+
+        /// Adds a column. `getter` is called with a `row_type const&` and returns the value.
+        template <class GETTER>
+        virtual_table& column(std::string name, GETTER getter) {
+            columns_.emplace_back(std::make_unique<column_impl<GETTER>>(std::move(name),
+                                                                          std::move(getter)));
+            return *this;
+        }
+
+        /// Declares that the range is sorted (ascending) by the named column, so that
+        /// constraints on it can be found by binary search.
+        /// The column's values must be numbers or strings. Strings are compared like the
+        /// default `BINARY` collation; constraints using any other collation, like
+        /// `name = ? COLLATE NOCASE`, are evaluated by scanning instead.
+        virtual_table& sorted_by(std::string_view column_name) {
+            if (make_row_)
+                throw std::logic_error("a sorted virtual_table can't be writeable");
+            for (size_t i = 0; i < columns_.size(); ++i) {
+                if (columns_[i]->name == column_name) {
+                    sorted_column_ = int(i);
+                    return *this;
+                }
+            }
+            throw std::invalid_argument("virtual_table has no such column");
+        }
+
+        /// Makes the table writeable with `INSERT`, `UPDATE` and `DELETE`.
+        /// `make_row` is called with the column values of an inserted or updated row, in
+        /// column order, and returns a `row_type`. An insert appends the row with `push_back`;
+        /// an update assigns to the existing item. Deleted rows disappear immediately, but are
+        /// erased from the range when the transaction ends, so that rowids stay stable during
+        /// a statement.
+        /// @warning  Changes are made to the range immediately; a `ROLLBACK` doesn't undo them.
+        template <class F>
+        virtual_table& writeable(F make_row)
+            requires requires (RANGE& r, row_type v) {r.push_back(std::move(v));
+                                                      r.erase(r.begin(), r.end());}
+        {
+            if (sorted_column_ >= 0)
+                throw std::logic_error("a sorted virtual_table can't be writeable");
+            make_row_ = std::move(make_row);
+            return *this;
+        }
+
+    protected:
+        using iterator = std::ranges::iterator_t<RANGE>;
+
+        std::string declaration() const override {
+            std::string sql = "CREATE TABLE x(";
+            for (auto& col : columns_) {
+                if (&col != &columns_.front())
+                    sql += ", ";
+                sql += '"';
+                for (char c : col->name) {
+                    if (c == '"') sql += '"';
+                    sql += c;
+                }
+                sql += "\" ";
+                sql += col->type;
+            }
+            return sql + ")";
+        }
+
+        void best_index(index_info& info) const override {
+            double n = std::max(double(std::ranges::distance(range_)), 1.0);
+            info.estimated_cost = n;
+            info.estimated_rows = int64_t(n);
+            if (sorted_column_ < 0)
+                return;
+            index_constraint *eq = nullptr, *lower = nullptr, *upper = nullptr;
+            for (auto& c : info.constraints) {
+                // The range is sorted by binary comparison, so a binary search with any other
+                // collation could skip matching rows:
+                if (c.usable && c.column == sorted_column_ && is_binary(c.collation)) {
+                    switch (c.op) {
+                        case constraint_op::eq: eq = &c; break;
+                        case constraint_op::gt:
+                        case constraint_op::ge: lower = &c; break;
+                        case constraint_op::lt:
+                        case constraint_op::le: upper = &c; break;
+                        default:                break;
+                    }
+                }
+            }
+            // Constraints aren't marked `omit`, so SQLite double-checks every row we return;
+            // the binary search only has to find a range that's no smaller than the real one.
+            double search = std::log2(n) + 1;
+            if (eq) {
+                eq->argv_index = 1;
+                info.idx_num = kEq;
+                info.estimated_cost = search;
+                info.estimated_rows = 1;
+            } else if (lower || upper) {
+                int argc = 0;
+                if (lower) {
+                    lower->argv_index = ++argc;
+                    info.idx_num |= (lower->op == constraint_op::gt) ? kGT : kGE;
+                }
+                if (upper) {
+                    upper->argv_index = ++argc;
+                    info.idx_num |= (upper->op == constraint_op::lt) ? kLT : kLE;
+                }
+                double rows = (argc == 2) ? n / 16 : n / 4;
+                info.estimated_cost = search + rows;
+                info.estimated_rows = int64_t(rows) + 1;
+            }
+            if (info.order_by.size() == 1 && info.order_by[0].column == sorted_column_
+                    && !info.order_by[0].desc)
+                info.order_by_consumed = true;
+        }
+
+        std::unique_ptr<cursor> open() override {
+            return std::make_unique<range_cursor>(*this);
+        }
+
+        int64_t insert(function_args const& values) override {
+            if (!make_row_)
+                return virtual_table_base::insert(values);
+            if constexpr (requires (row_type v) {range_.push_back(std::move(v));}) {
+                range_.push_back(make_row_(values));
+                return int64_t(std::ranges::distance(range_)) - 1;
+            } else {
+                return virtual_table_base::insert(values);
+            }
+        }
+
+        void update(int64_t rowid, function_args const& values) override {
+            if (!make_row_)
+                return virtual_table_base::update(rowid, values);
+            if constexpr (std::indirectly_writable<iterator, row_type>)
+                *find_row(rowid) = make_row_(values);
+            else
+                virtual_table_base::update(rowid, values);
+        }
+
+        void remove(int64_t rowid) override {
+            if (!make_row_)
+                return virtual_table_base::remove(rowid);
+            find_row(rowid);
+            deleted_.resize(std::ranges::distance(range_));
+            deleted_[size_t(rowid)] = true;
+        }
+
+        void commit() override {
+            if constexpr (requires {range_.erase(range_.begin(), range_.end());}) {
+                if (deleted_.empty())
+                    return;
+                // Compact the surviving rows toward the front, then erase the leftovers:
+                auto out = std::ranges::begin(range_);
+                size_t pos = 0;
+                for (auto in = out; in != std::ranges::end(range_); ++in, ++pos) {
+                    if (pos >= deleted_.size() || !deleted_[pos]) {
+                        if (out != in)
+                            *out = std::move(*in);
+                        ++out;
+                    }
+                }
+                range_.erase(out, range_.end());
+                deleted_.clear();
+            }
+        }
+
+    private:
+        // `idx_num` flags describing a binary-search plan:
+        enum : int {kEq = 1, kGT = 2, kGE = 4, kLT = 8, kLE = 16};
+
+        struct column_base {
+            column_base(std::string n, const char* t)   :name(std::move(n)), type(t) { }
+            virtual ~column_base() = default;
+            virtual void get(function_result&, row_type const&) const = 0;
+            // Three-way comparison of the column value with `arg`, or nullopt if their types
+            // can't be compared.
+            virtual std::optional<int> compare(row_type const&, arg_value const&) const = 0;
+
+            std::string const name;
+            const char* const type;
+        };
+
+        template <class GETTER>
+        struct column_impl final : column_base {
+            using result_type = std::invoke_result_t<GETTER const&, row_type const&>;
+            using value_type = std::decay_t<result_type>;
+
+            column_impl(std::string name, GETTER g)
+            :column_base(std::move(name), sql_type()), getter(std::move(g)) { }
+
+            void get(function_result& result, row_type const& row) const override {
+                if constexpr (std::is_lvalue_reference_v<result_type>
+                              && std::is_convertible_v<result_type, std::string_view>)
+                    result = uncopied(std::string_view(std::invoke(getter, row)));
+                else
+                    result = std::invoke(getter, row);
+            }
+
+            std::optional<int> compare(row_type const& row, arg_value const& arg) const override {
+                return compare_values(std::invoke(getter, row), arg);
+            }
+
+            static constexpr const char* sql_type() {
+                if constexpr (std::is_integral_v<value_type>)
+                    return "INTEGER";
+                else if constexpr (std::is_floating_point_v<value_type>)
+                    return "REAL";
+                else if constexpr (std::is_convertible_v<value_type, std::string_view>)
+                    return "TEXT";
+                else if constexpr (std::is_convertible_v<value_type, blob>)
+                    return "BLOB";
+                else
+                    return "";
+            }
+
+            GETTER const getter;
+        };
+
+        static bool is_binary(const char* collation) {
+            constexpr std::string_view kBinary = "BINARY";
+            std::string_view name(collation);
+            return std::ranges::equal(name, kBinary, [](char a, char b) {
+                return (a >= 'a' && a <= 'z' ? a - 32 : a) == b;
+            });
+        }
+
+        template <class V>
+        static std::optional<int> compare_values(V const& v, arg_value const& arg) {
+            auto sign = [](auto cmp) {return (cmp > 0) - (cmp < 0);};
+            if constexpr (std::is_arithmetic_v<V>) {
+                switch (arg.type()) {
+                    case data_type::integer:
+                        if constexpr (std::is_integral_v<V>)
+                            return sign(int64_t(v) <=> arg.get<int64_t>());
+                        else
+                            return sign(double(v) <=> arg.get<double>());
+                    case data_type::floating_point:
+                        return sign(double(v) <=> arg.get<double>());
+                    default:
+                        return std::nullopt;
+                }
+            } else if constexpr (std::is_convertible_v<V const&, std::string_view>) {
+                if (arg.type() != data_type::text)
+                    return std::nullopt;
+                return sign(std::string_view(v).compare(arg.get<std::string_view>()));
+            } else {
+                return std::nullopt;
+            }
+        }
+
+        iterator find_row(int64_t rowid) {
+            if (rowid < 0 || rowid >= std::ranges::distance(range_) || is_deleted(size_t(rowid)))
+                throw database_error("no such row in virtual table", status::constraint);
+            return std::ranges::next(std::ranges::begin(range_), rowid);
+        }
+
+        bool is_deleted(size_t pos) const {return pos < deleted_.size() && deleted_[pos];}
+
+        class range_cursor final : public cursor {
+        public:
+            explicit range_cursor(virtual_table& t)  :table_(t) { }
+
+            void filter(int idx_num, function_args const& args) override {
+                iterator begin = std::ranges::begin(table_.range_);
+                cur_ = begin;
+                end_ = std::ranges::end(table_.range_);
+                if (idx_num != 0) {
+                    auto& col = *table_.columns_[table_.sorted_column_];
+                    // Narrows [cur_, end_) to the rows before/after which `pred` turns false:
+                    auto lower = [&](arg_value const& arg, bool strict) {
+                        cur_ = std::partition_point(cur_, end_, [&](row_type const& row) {
+                            auto c = col.compare(row, arg);
+                            return c && (strict ? *c <= 0 : *c < 0);
+                        });
+                    };
+                    auto upper = [&](arg_value const& arg, bool inclusive) {
+                        end_ = std::partition_point(cur_, end_, [&](row_type const& row) {
+                            auto c = col.compare(row, arg);
+                            return !c || (inclusive ? *c <= 0 : *c < 0);
+                        });
+                    };
+                    size_t argi = 0;
+                    if (idx_num & kEq) {
+                        lower(args[0], false);
+                        upper(args[0], true);
+                    } else {
+                        if (idx_num & (kGT | kGE))
+                            lower(args[argi++], (idx_num & kGT) != 0);
+                        if (idx_num & (kLT | kLE))
+                            upper(args[argi++], (idx_num & kLE) != 0);
+                    }
+                }
+                pos_ = size_t(std::ranges::distance(begin, cur_));
+                skip_deleted();
+            }
+
+            bool eof() const override                   {return cur_ == end_;}
+
+            void next() override {
+                ++cur_;
+                ++pos_;
+                skip_deleted();
+            }
+
+            void column(function_result& result, int col) const override {
+                table_.columns_[col]->get(result, *cur_);
+            }
+
+            int64_t rowid() const override              {return int64_t(pos_);}
+
+        private:
+            void skip_deleted() {
+                while (cur_ != end_ && table_.is_deleted(pos_)) {
+                    ++cur_;
+                    ++pos_;
+                }
+            }
+
+            virtual_table&  table_;
+            iterator        cur_, end_;
+            size_t          pos_ = 0;
+        };
+
+        RANGE&                                      range_;
+        std::vector<std::unique_ptr<column_base>>   columns_;
+        int                                         sorted_column_ = -1;
+        std::function<row_type(function_args const&)> make_row_;
+        std::vector<bool>                           deleted_;
+    };
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
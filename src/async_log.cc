@@ -0,0 +1,246 @@
+// sqnice/async_log.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/database.hh"
+#include "ring_buffer.hh"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice {
+    using namespace std;
+
+    namespace {
+
+        // A log message as stored in the queue; fixed-size, so logging never allocates.
+        struct log_entry {
+            int      code = 0;
+            uint16_t length = 0;
+            char     text[250];
+
+            string_view message() const {return {text, length};}
+        };
+
+
+        // Owns the queue and the thread that delivers messages to the handler.
+        // There's only one, and it's never destroyed before exit, since SQLite may call the
+        // log callback on any thread at any time.
+        class async_logger {
+        public:
+            explicit async_logger(size_t capacity)
+            :queue_(capacity)
+            ,thread_([this] {run();})
+            { }
+
+            ~async_logger() {
+                sqlite3_config(SQLITE_CONFIG_LOG, nullptr, nullptr);
+                {
+                    unique_lock lock(mutex_);
+                    stopped_ = true;
+                }
+                cond_.notify_one();
+                thread_.join();
+            }
+
+            void configure(database::log_handler handler, async_log_options const& options) {
+                unique_lock lock(mutex_);
+                handler_ = std::move(handler);
+                options_ = options;
+                tokens_ = options.max_per_second;
+            }
+
+            // SQLite's log callback. Must be lock-free.
+            static void callback(void* p, int code, const char* msg) noexcept {
+                if ((code & 0xFF) == SQLITE_SCHEMA)
+                    return; // (see comment in `database::set_log_handler`)
+                auto self = static_cast<async_logger*>(p);
+                log_entry entry;
+                entry.code = code;
+                entry.length = uint16_t(strnlen(msg, sizeof(entry.text)));
+                memcpy(entry.text, msg, entry.length);
+                if (self->queue_.push(std::move(entry)))
+                    self->cond_.notify_one();   // (no lock needed to notify)
+                else
+                    self->dropped_.fetch_add(1, memory_order_relaxed);
+            }
+
+            async_log_stats stats() const noexcept {
+                async_log_stats result;
+                result.delivered = delivered_;
+                result.dropped = dropped_;
+                result.rate_limited = rate_limited_;
+                result.duplicates = duplicates_;
+                return result;
+            }
+
+        private:
+            using clock = chrono::steady_clock;
+
+            // Since the producers don't lock the mutex, a notification can be missed; so this
+            // thread wakes up periodically anyway.
+            static constexpr auto kPollInterval = 100ms;
+
+            void run() {
+                unique_lock lock(mutex_);
+                last_refill_ = clock::now();
+                while (!stopped_) {
+                    bool any = false;
+                    while (auto entry = queue_.pop()) {
+                        deliver(*entry, lock);
+                        any = true;
+                    }
+                    if (!any)
+                        flush_summaries(lock);
+                    cond_.wait_for(lock, kPollInterval);
+                }
+            }
+
+            // Calls the handler, with the mutex unlocked.
+            void call_handler(int code, const char* msg, unique_lock<mutex>& lock) {
+                auto handler = handler_;
+                if (!handler)
+                    return;
+                lock.unlock();
+                try {
+                    handler(status{code}, msg);
+                } catch (...) { }
+                lock.lock();
+                delivered_.fetch_add(1, memory_order_relaxed);
+            }
+
+            // Takes a token from the rate limiter, if there is one.
+            bool take_token() {
+                if (options_.max_per_second == 0)
+                    return true;
+                auto now = clock::now();
+                double elapsed = chrono::duration<double>(now - last_refill_).count();
+                last_refill_ = now;
+                tokens_ = min(tokens_ + elapsed * options_.max_per_second,
+                              double(options_.max_per_second));
+                if (tokens_ < 1.0)
+                    return false;
+                tokens_ -= 1.0;
+                return true;
+            }
+
+            void deliver(log_entry const& entry, unique_lock<mutex>& lock) {
+                if (options_.dedup && entry.code == last_code_ && entry.message() == last_) {
+                    ++repeats_;
+                    duplicates_.fetch_add(1, memory_order_relaxed);
+                    return;
+                }
+                flush_repeats(lock);
+                if (!take_token()) {
+                    // Nothing was delivered, so later messages can't be repeats of it:
+                    last_code_ = 0;
+                    last_.clear();
+                    ++suppressed_;
+                    rate_limited_.fetch_add(1, memory_order_relaxed);
+                    return;
+                }
+                flush_suppressed(lock);
+                last_code_ = entry.code;
+                last_ = entry.message();
+                call_handler(entry.code, last_.c_str(), lock);
+            }
+
+            void flush_repeats(unique_lock<mutex>& lock) {
+                if (repeats_ > 0) {
+                    string msg = "(last message repeated " + to_string(repeats_) + " times)";
+                    repeats_ = 0;
+                    call_handler(last_code_, msg.c_str(), lock);
+                }
+            }
+
+            void flush_suppressed(unique_lock<mutex>& lock) {
+                if (suppressed_ > 0) {
+                    string msg = "(" + to_string(suppressed_) + " log messages suppressed)";
+                    suppressed_ = 0;
+                    call_handler(SQLITE_WARNING, msg.c_str(), lock);
+                }
+            }
+
+            // When the queue is idle, reports pending repeat/suppression counts.
+            void flush_summaries(unique_lock<mutex>& lock) {
+                flush_repeats(lock);
+                if (suppressed_ > 0 && take_token())
+                    flush_suppressed(lock);
+                last_code_ = 0;
+                last_.clear();
+            }
+
+            ring_buffer<log_entry>  queue_;
+            mutex                   mutex_;             // Protects the members below
+            condition_variable      cond_;
+            database::log_handler   handler_;
+            async_log_options       options_;
+            double                  tokens_ = 0;        // Rate limiter's token bucket
+            clock::time_point       last_refill_;
+            int                     last_code_ = 0;     // Last message delivered, for dedup
+            string                  last_;
+            uint64_t                repeats_ = 0;       // Number of repeats of `last_`
+            uint64_t                suppressed_ = 0;    // Messages rate-limited since last report
+            bool                    stopped_ = false;
+            atomic<uint64_t>        delivered_ = 0, dropped_ = 0, rate_limited_ = 0,
+                                    duplicates_ = 0;
+            thread                  thread_;            // Must be last
+        };
+
+        mutex               sAsyncLogMutex;
+        async_logger*       sAsyncLogger = nullptr;
+    }
+
+
+    status database::set_async_log_handler(log_handler h, async_log_options const& options) {
+        lock_guard lock(sAsyncLogMutex);
+        if (!sAsyncLogger) {
+            static async_logger sLogger(options.capacity);
+            sAsyncLogger = &sLogger;
+        }
+        bool enable = !!h;
+        sAsyncLogger->configure(std::move(h), options);
+        if (enable)
+            return status{sqlite3_config(SQLITE_CONFIG_LOG, async_logger::callback, sAsyncLogger)};
+        else
+            return status{sqlite3_config(SQLITE_CONFIG_LOG, nullptr, nullptr)};
+    }
+
+
+    async_log_stats database::async_log_stats() noexcept {
+        lock_guard lock(sAsyncLogMutex);
+        return sAsyncLogger ? sAsyncLogger->stats() : sqnice::async_log_stats{};
+    }
+
+}
@@ -0,0 +1,219 @@
+// sqnice/backup.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/backup.hh"
+#include "sqnice/pool.hh"
+#include <algorithm>
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice {
+    using namespace std;
+
+    // Returns the value of a pragma as a string, or an empty string on error.
+    static string get_pragma(sqlite3* db, const char* name) {
+        string result;
+        string sql = string("PRAGMA ") + name;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+                if (auto text = sqlite3_column_text(stmt, 0))
+                    result = reinterpret_cast<const char*>(text);
+            sqlite3_finalize(stmt);
+        }
+        return result;
+    }
+
+
+    backup_job::backup_job(pool& source, string_view dest_path, backup_options options)
+    :pool_(source)
+    ,dest_path_(dest_path)
+    ,options_(std::move(options))
+    {
+        if (options_.min_pages_per_step < 1
+                || options_.max_pages_per_step < options_.min_pages_per_step)
+            throw invalid_argument("invalid backup_options step sizes");
+        thread_ = thread([this] {run();});
+    }
+
+
+    backup_job::~backup_job() {
+        cancel();
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+
+    void backup_job::cancel() noexcept {
+        {
+            unique_lock lock(mutex_);
+            canceled_ = true;
+        }
+        cond_.notify_all();
+    }
+
+
+    backup_progress backup_job::progress() const {
+        unique_lock lock(mutex_);
+        return progress_;
+    }
+
+
+    status backup_job::wait() {
+        if (thread_.joinable())
+            thread_.join();
+        unique_lock lock(mutex_);
+        return status_;
+    }
+
+
+    string backup_job::error_message() const {
+        unique_lock lock(mutex_);
+        return error_message_;
+    }
+
+
+    // Sleeps, returning early if the job is canceled.
+    void backup_job::pause(chrono::milliseconds interval) {
+        unique_lock lock(mutex_);
+        cond_.wait_for(lock, interval, [this] {return canceled_.load();});
+    }
+
+
+    // The body of the backup thread.
+    void backup_job::run() {
+        status rc;
+        string message;
+        try {
+            auto src = pool_.borrow();
+            database dst(dest_path_, open_flags::readwrite | open_flags::create);
+
+            // In WAL mode, a read transaction pins a snapshot, so writes by other connections
+            // don't force the backup to start over. (In other modes it would block writers.)
+            bool snapshot = options_.hold_snapshot && get_pragma(src->handle(), "journal_mode")
+                                                       == "wal";
+            if (snapshot && sqlite3_exec(src->handle(),
+                                         "BEGIN; SELECT count(*) FROM sqlite_schema",
+                                         nullptr, nullptr, nullptr) != SQLITE_OK)
+                snapshot = false;
+            try {
+                rc = step_loop(src->handle(), dst.handle());
+                if (!ok(rc))
+                    message = (rc == status::abort) ? "backup canceled"
+                                                    : sqlite3_errmsg(dst.handle());
+            } catch (...) {
+                if (snapshot)
+                    sqlite3_exec(src->handle(), "ROLLBACK", nullptr, nullptr, nullptr);
+                throw;
+            }
+            if (snapshot)
+                sqlite3_exec(src->handle(), "ROLLBACK", nullptr, nullptr, nullptr);
+        } catch (database_error const& x) {
+            rc = x.error_code;
+            message = x.what();
+        } catch (exception const& x) {
+            rc = status::error;
+            message = x.what();
+        }
+
+        {
+            unique_lock lock(mutex_);
+            status_ = rc;
+            error_message_ = std::move(message);
+        }
+        finished_ = true;
+    }
+
+
+    // Runs the backup steps, adapting the step size and throttling, until done or canceled.
+    status backup_job::step_loop(sqlite3* src, sqlite3* dst) {
+        sqlite3_backup* bkup = sqlite3_backup_init(dst, "main", src, "main");
+        if (!bkup)
+            return status{sqlite3_errcode(dst)};
+
+        uint64_t page_size = max(1, atoi(get_pragma(src, "page_size").c_str()));
+        int step = clamp(options_.pages_per_step, options_.min_pages_per_step,
+                                                  options_.max_pages_per_step);
+        int clean_steps = 0;            // Consecutive steps that weren't blocked
+        int blocked_steps = 0;          // Consecutive steps that were blocked
+        uint64_t bytes_copied = 0;
+        auto start = chrono::steady_clock::now();
+        status rc;
+        while (true) {
+            if (canceled_) {
+                rc = status::abort;
+                break;
+            }
+            rc = status{sqlite3_backup_step(bkup, step)};
+            backup_progress progress {sqlite3_backup_remaining(bkup),
+                                      sqlite3_backup_pagecount(bkup), step, rc};
+            {
+                unique_lock lock(mutex_);
+                progress_ = progress;
+            }
+            if (options_.on_progress)
+                options_.on_progress(progress);
+
+            auto interval = options_.sleep_interval;
+            if (rc == status::ok) {
+                // Grow the step size again after a run of unblocked steps:
+                blocked_steps = 0;
+                bytes_copied += uint64_t(step) * page_size;
+                if (++clean_steps >= 4) {
+                    step = min(2 * step, options_.max_pages_per_step);
+                    clean_steps = 0;
+                }
+                // Stay within the I/O budget by sleeping until it allows the bytes copied so far:
+                if (options_.max_bytes_per_second > 0) {
+                    auto due = start + chrono::duration<double>(
+                                    double(bytes_copied) / double(options_.max_bytes_per_second));
+                    auto ahead = chrono::ceil<chrono::milliseconds>(due
+                                                                    - chrono::steady_clock::now());
+                    interval = max(interval, ahead);
+                }
+            } else if (rc == status::busy || rc == status::locked) {
+                // Back off: smaller steps hold locks for less time, and wait longer between them.
+                clean_steps = 0;
+                step = max(step / 2, options_.min_pages_per_step);
+                blocked_steps = min(blocked_steps + 1, 8);
+                interval = max(interval, chrono::milliseconds(1)) * (1 << blocked_steps);
+            } else {
+                break;          // done, or an error
+            }
+            pause(interval);
+        }
+
+        status end_rc = status{sqlite3_backup_finish(bkup)};
+        if (rc == status::done)
+            rc = end_rc;
+        return rc;
+    }
+
+}
@@ -95,6 +95,17 @@ namespace sqnice {
     }
 
 
+    string quote_identifier(string_view name) {
+        string result = "\"";
+        for (char c : name) {
+            if (c == '"')
+                result += '"';
+            result += c;
+        }
+        return result + '"';
+    }
+
+
     database_error::database_error(char const* msg, status rc)
     : runtime_error(msg)
     , error_code(rc) {
@@ -26,6 +26,8 @@
 
 #include "sqnice/blob_stream.hh"
 #include "sqnice/database.hh"
+#include <algorithm>
+#include <cstring>
 
 #ifdef SQNICE_LOADABLE_EXTENSION
 #  include <sqlite3ext.h>
@@ -44,17 +46,51 @@ namespace sqnice {
     { }
 
 
+    blob_stream::blob_stream(database const& db,
+                             const char* table, const char *column, int64_t rowid)
+    :blob_stream(const_cast<database&>(db), "main", table, column, rowid, false)
+    { }
+
+
     blob_stream::blob_stream(database& db,
                              const char *database_name,
                              const char* table, const char *column, int64_t rowid,
                              bool writeable)
     : checking(db)
+    , database_name_(database_name)
+    , table_(table)
+    , column_(column)
+    , writeable_(writeable)
     {
-        status_ = status{sqlite3_blob_open(db.check_handle(), database_name, table, column, 
-                                           rowid, writeable, &blob_)};
-        check(status_);
+        open(rowid);
+    }
+
+
+    status blob_stream::open(int64_t rowid) {
+        if (blob_) {
+            sqlite3_blob_close(blob_);
+            blob_ = nullptr;
+        }
+        size_ = 0;
+        status_ = status{sqlite3_blob_open(check_get_db().get(), database_name_.c_str(),
+                                           table_.c_str(), column_.c_str(),
+                                           rowid, writeable_, &blob_)};
         if (status_ == status::ok)
             size_ = sqlite3_blob_bytes(blob_);
+        return check(status_);
+    }
+
+
+    status blob_stream::reopen(int64_t rowid) {
+        if (!blob_)
+            return open(rowid);
+        status_ = status{sqlite3_blob_reopen(blob_, rowid)};
+        if (basic_status(status_) == status::abort) {
+            // After a failed reopen, or a change to its row, the handle is unusable:
+            return open(rowid);
+        }
+        size_ = ok(status_) ? sqlite3_blob_bytes(blob_) : 0;
+        return check(status_);
     }
 
 
@@ -98,4 +134,142 @@ namespace sqnice {
         return ok(status_) ? checked_len : -1;
     }
 
+
+
+#pragma mark - BLOB SCANNER:
+
+
+    blob_scanner::blob_scanner(database& db, const char* table, const char *column,
+                               bool writeable)
+    :db_(db)
+    ,table_(table)
+    ,column_(column)
+    ,writeable_(writeable)
+    { }
+
+
+    blob_stream& blob_scanner::open(int64_t rowid) {
+        if (blob_)
+            blob_->reopen(rowid);
+        else
+            blob_.emplace(db_, table_.c_str(), column_.c_str(), rowid, writeable_);
+        return *blob_;
+    }
+
+
+
+
+#pragma mark - BLOB WRITER:
+
+
+    blob_writer::blob_writer(database& db, const char* table, const char *column,
+                             uint64_t size_hint, size_t chunk_size)
+    :db_(db)
+    ,table_(table)
+    ,column_(column)
+    ,chunk_size_(max(chunk_size, size_t(1)))
+    ,capacity_(size_hint ? size_hint : chunk_size_)
+    {
+        command ins(db_, format("INSERT INTO %s (%s) VALUES (zeroblob(?))",
+                                quote_identifier(table_).c_str(),
+                                quote_identifier(column_).c_str()));
+        ins.exceptions(true);
+        ins.execute(int64_t(capacity_));
+        rowid_ = ins.last_insert_rowid();
+        blob_.emplace(db_, table_.c_str(), column_.c_str(), rowid_, true);
+        blob_->exceptions(true);
+    }
+
+
+    blob_writer::~blob_writer() noexcept {
+        if (!finished_) {
+            try {
+                finish();
+            } catch (...) {
+                checking::log_warning("blob_writer: exception finishing blob in destructor");
+            }
+        }
+    }
+
+
+    void blob_writer::write(const void* data, size_t len) {
+        if (finished_)
+            checking::raise(status::misuse, "blob_writer is already finished");
+        auto src = static_cast<const char*>(data);
+        while (len > 0) {
+            if (chunk_used_ == 0 && len >= chunk_size_) {
+                write_through(src, len);
+                return;
+            }
+            if (!chunk_)
+                chunk_.reset(new char[chunk_size_]);
+            size_t n = min(len, chunk_size_ - chunk_used_);
+            memcpy(&chunk_[chunk_used_], src, n);
+            chunk_used_ += n;
+            src += n;
+            len -= n;
+            if (chunk_used_ == chunk_size_) {
+                chunk_used_ = 0;
+                write_through(chunk_.get(), chunk_size_);
+            }
+        }
+    }
+
+
+    // Writes directly to the blob at the end of the data, growing it if necessary.
+    void blob_writer::write_through(const void* data, size_t len) {
+        reserve(size_ + len);
+        auto src = static_cast<const char*>(data);
+        while (len > 0) {
+            size_t n = min(len, chunk_size_);
+            (void)blob_->pwrite(src, n, size_);
+            size_ += n;
+            src += n;
+            len -= n;
+        }
+    }
+
+
+    void blob_writer::reserve(uint64_t size) {
+        if (size <= capacity_)
+            return;
+        uint64_t max_size = db_.get_limit(limit::row_length);
+        if (size > max_size)
+            checking::raise(status::range, "blob_writer: blob is too large");
+        uint64_t new_capacity = min(max(2 * capacity_, size), max_size);
+        // `||` returns text, so cast the result back to a blob:
+        set_value(format("CAST(%s || zeroblob(?) AS BLOB)", quote_identifier(column_).c_str()),
+                  new_capacity - capacity_);
+        capacity_ = new_capacity;
+        blob_->reopen(rowid_);
+    }
+
+
+    // Updates the column of the row to an expression with one parameter.
+    void blob_writer::set_value(string const& expr, uint64_t param) {
+        command cmd(db_, format("UPDATE %s SET %s = %s WHERE rowid = ?",
+                                quote_identifier(table_).c_str(),
+                                quote_identifier(column_).c_str(),
+                                expr.c_str()));
+        cmd.exceptions(true);
+        cmd.execute(int64_t(param), rowid_);
+    }
+
+
+    int64_t blob_writer::finish() {
+        if (!finished_) {
+            if (chunk_used_ > 0) {
+                size_t n = chunk_used_;
+                chunk_used_ = 0;
+                write_through(chunk_.get(), n);
+            }
+            finished_ = true;
+            chunk_.reset();
+            blob_.reset();
+            if (size_ < capacity_)
+                set_value(format("substr(%s, 1, ?)", quote_identifier(column_).c_str()), size_);
+        }
+        return rowid_;
+    }
+
 }
@@ -0,0 +1,210 @@
+// sqnice/blob_streambuf.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "sqnice/blob_streambuf.hh"
+#include <algorithm>
+#include <cstring>
+
+namespace sqnice {
+    using namespace std;
+
+    // The size of the first buffer refill after a seek.
+    static constexpr size_t kMinFillSize = 4096;
+
+
+    blob_streambuf::blob_streambuf(blob_stream& blob, size_t buffer_size)
+    :blob_(blob)
+    ,capacity_(max(buffer_size, size_t(1)))
+    ,fill_size_(min(kMinFillSize, capacity_))
+    {
+        buffer_.reset(new char[capacity_]);
+        // The buffer is the get area while reading, or the put area while writing, but not both.
+        setg(nullptr, nullptr, nullptr);
+        setp(nullptr, nullptr);
+    }
+
+
+    blob_streambuf::~blob_streambuf() {
+        try {
+            flush();
+        } catch (...) {
+            checking::log_warning("blob_streambuf: exception flushing buffer in destructor");
+        }
+    }
+
+
+    uint64_t blob_streambuf::position() const noexcept {
+        if (pbase())
+            return buf_pos_ + (pptr() - pbase());
+        else if (eback())
+            return buf_pos_ + (gptr() - eback());
+        else
+            return buf_pos_;
+    }
+
+
+    // Writes the put area, if any, to the blob, and leaves writing mode.
+    bool blob_streambuf::flush() {
+        if (!pbase())
+            return true;
+        size_t n = pptr() - pbase();
+        if (n > 0 && blob_.pwrite(pbase(), n, buf_pos_) != int(n))
+            return false;
+        buf_pos_ += n;
+        setp(nullptr, nullptr);
+        return true;
+    }
+
+
+    blob_streambuf::int_type blob_streambuf::underflow() {
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        uint64_t pos = position();
+        if (!flush())
+            return traits_type::eof();
+        setg(nullptr, nullptr, nullptr);
+        buf_pos_ = pos;
+        if (pos >= blob_.size())
+            return traits_type::eof();
+
+        // Read-ahead: double the refill size as long as reads are sequential.
+        if (pos != next_fill_pos_)
+            fill_size_ = min(kMinFillSize, capacity_);
+        size_t n = size_t(min(uint64_t(fill_size_), blob_.size() - pos));
+        int nread = blob_.pread(buffer_.get(), n, pos);
+        if (nread <= 0)
+            return traits_type::eof();
+        fill_size_ = min(2 * fill_size_, capacity_);
+        next_fill_pos_ = pos + nread;
+        setg(buffer_.get(), buffer_.get(), buffer_.get() + nread);
+        return traits_type::to_int_type(*gptr());
+    }
+
+
+    blob_streambuf::int_type blob_streambuf::overflow(int_type c) {
+        if (!pbase()) {
+            // Switch from reading to writing:
+            buf_pos_ = position();
+            setg(nullptr, nullptr, nullptr);
+        } else if (!flush()) {
+            return traits_type::eof();
+        }
+        if (buf_pos_ >= blob_.size())
+            return traits_type::eof();          // Can't write past the end
+        size_t room = size_t(min(uint64_t(capacity_), blob_.size() - buf_pos_));
+        setp(buffer_.get(), buffer_.get() + room);
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+
+    int blob_streambuf::sync() {
+        return flush() ? 0 : -1;
+    }
+
+
+    streamsize blob_streambuf::showmanyc() {
+        uint64_t pos = position(), size = blob_.size();
+        return (pos < size) ? streamsize(size - pos) : -1;
+    }
+
+
+    streamsize blob_streambuf::xsgetn(char_type* dst, streamsize n) {
+        streamsize done = 0;
+        while (done < n) {
+            if (streamsize avail = egptr() - gptr(); avail > 0) {
+                streamsize k = min(avail, n - done);
+                memcpy(dst + done, gptr(), size_t(k));
+                gbump(int(k));
+                done += k;
+            } else if (size_t(n - done) >= capacity_) {
+                // Large reads bypass the buffer:
+                uint64_t pos = position();
+                if (!flush())
+                    break;
+                setg(nullptr, nullptr, nullptr);
+                buf_pos_ = pos;
+                if (pos >= blob_.size())
+                    break;
+                size_t len = size_t(min(uint64_t(n - done), blob_.size() - pos));
+                int nread = blob_.pread(dst + done, len, pos);
+                if (nread <= 0)
+                    break;
+                done += nread;
+                buf_pos_ = next_fill_pos_ = pos + nread;
+            } else if (traits_type::eq_int_type(underflow(), traits_type::eof())) {
+                break;
+            }
+        }
+        return done;
+    }
+
+
+    blob_streambuf::pos_type blob_streambuf::seekoff(off_type off, ios_base::seekdir dir,
+                                                     ios_base::openmode which)
+    {
+        off_type base;
+        if (dir == ios_base::beg)
+            base = 0;
+        else if (dir == ios_base::cur)
+            base = off_type(position());
+        else
+            base = off_type(blob_.size());
+        return seekpos(pos_type(base + off), which);
+    }
+
+
+    blob_streambuf::pos_type blob_streambuf::seekpos(pos_type pos, ios_base::openmode) {
+        off_type target = off_type(pos);
+        if (target < 0 || uint64_t(target) > blob_.size())
+            return pos_type(off_type(-1));
+        if (eback() && uint64_t(target) >= buf_pos_
+                    && uint64_t(target) <= buf_pos_ + (egptr() - eback())) {
+            // Seek within the buffer:
+            setg(eback(), eback() + (uint64_t(target) - buf_pos_), egptr());
+            return pos;
+        }
+        if (!flush())
+            return pos_type(off_type(-1));
+        setg(nullptr, nullptr, nullptr);
+        buf_pos_ = uint64_t(target);
+        return pos;
+    }
+
+
+    span<const byte> blob_streambuf::read_span(size_t max_len) {
+        if (gptr() == egptr() && traits_type::eq_int_type(underflow(), traits_type::eof()))
+            return {};
+        size_t n = min(size_t(egptr() - gptr()), max_len);
+        span<const byte> result(reinterpret_cast<const byte*>(gptr()), n);
+        gbump(int(n));
+        return result;
+    }
+
+}
@@ -0,0 +1,207 @@
+// sqnice/change_feed.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/change_feed.hh"
+#include "sqnice/database.hh"
+#include "ring_buffer.hh"
+#include <algorithm>
+#include <cstring>
+
+namespace sqnice {
+    using namespace std;
+
+
+#pragma mark - SUBSCRIPTION:
+
+
+    change_subscription::change_subscription(size_t capacity)
+    :queue_(make_unique<ring_buffer<change_batch_ref>>(capacity))
+    { }
+
+    change_subscription::~change_subscription() = default;
+
+
+    void change_subscription::push(change_batch_ref const& batch) {
+        if (closed_)
+            return;
+        if (!queue_->push(change_batch_ref(batch)))
+            overflow_ = true;
+        pushed_.fetch_add(1, memory_order_release);
+        pushed_.notify_one();
+    }
+
+
+    void change_subscription::close() {
+        closed_ = true;
+        pushed_.fetch_add(1, memory_order_release);
+        pushed_.notify_all();
+    }
+
+
+    change_batch_ref change_subscription::try_pop() {
+        return queue_->pop().value_or(nullptr);
+    }
+
+
+    change_batch_ref change_subscription::pop() {
+        while (true) {
+            // Read the counter before checking the queue, so a push in between isn't missed:
+            uint32_t pushed = pushed_.load(memory_order_acquire);
+            if (auto batch = queue_->pop())
+                return std::move(*batch);
+            if (closed_)
+                return nullptr;
+            pushed_.wait(pushed, memory_order_acquire);
+        }
+    }
+
+
+#pragma mark - FEED:
+
+
+    change_feed::change_feed(database& db)
+    :db_(db)
+    {
+        db_.set_update_handler([this](int op, const char* dbname, const char* table,
+                                      int64_t rowid) {
+            changed(op, dbname, table, rowid);
+        });
+        db_.set_commit_handler([this] {
+            committed();
+            return false;   // don't veto the commit
+        });
+        db_.set_rollback_handler([this] {
+            rolled_back();
+        });
+    }
+
+
+    change_feed::~change_feed() {
+        db_.set_update_handler(nullptr);
+        db_.set_commit_handler(nullptr);
+        db_.set_rollback_handler(nullptr);
+        unique_lock lock(mutex_);
+        for (auto& sub : subscribers_)
+            sub->close();
+        subscribers_.clear();
+    }
+
+
+    shared_ptr<change_subscription> change_feed::subscribe(size_t capacity) {
+        shared_ptr<change_subscription> sub(new change_subscription(capacity));
+        unique_lock lock(mutex_);
+        subscribers_.push_back(sub);
+        return sub;
+    }
+
+
+    void change_feed::unsubscribe(change_subscription& sub) {
+        unique_lock lock(mutex_);
+        auto i = find_if(subscribers_.begin(), subscribers_.end(),
+                         [&](auto const& s) {return s.get() == &sub;});
+        if (i != subscribers_.end())
+            subscribers_.erase(i);
+        sub.close();
+    }
+
+
+    // Update hook: adds a row change to the pending transaction, coalescing it with any earlier
+    // change to the same row.
+    void change_feed::changed(int opcode, const char* dbname, const char* table, int64_t rowid) {
+        try {
+            string name;
+            if (strcmp(dbname, "main") != 0) {
+                name = dbname;
+                name += '.';
+            }
+            name += table;
+            auto& rows = rows_[name];
+            auto op = change_op(opcode);
+            auto [i, added] = rows.try_emplace(rowid, pending_.size());
+            if (added) {
+                pending_.push_back({op, std::move(name), rowid});
+                return;
+            }
+            change_event& event = pending_[i->second];
+            switch (event.op) {
+                case change_op::insert:
+                    if (op == change_op::remove) {
+                        // Inserted then deleted: net effect is nothing. Mark the event as dead
+                        // by clearing its table name; a later insert of the same rowid is new.
+                        event.table.clear();
+                        rows.erase(i);
+                    }
+                    break;
+                case change_op::remove:
+                    if (op == change_op::insert)
+                        event.op = change_op::update;   // Deleted then re-inserted
+                    break;
+                case change_op::update:
+                    event.op = op;
+                    break;
+            }
+        } catch (...) {
+            // Out of memory: can't record the change, so flag every consumer to resync.
+            unique_lock lock(mutex_);
+            for (auto& sub : subscribers_)
+                sub->overflow_ = true;
+        }
+    }
+
+
+    // Commit hook: publishes the pending changes as a batch.
+    void change_feed::committed() {
+        if (!pending_.empty()) {
+            try {
+                auto batch = make_shared<change_batch>();
+                batch->changes.reserve(pending_.size());
+                for (auto& event : pending_) {
+                    if (!event.table.empty())
+                        batch->changes.push_back(std::move(event));
+                }
+                if (!batch->changes.empty()) {
+                    batch->sequence = ++sequence_;
+                    change_batch_ref ref = std::move(batch);
+                    unique_lock lock(mutex_);
+                    for (auto& sub : subscribers_)
+                        sub->push(ref);
+                }
+            } catch (...) {
+                unique_lock lock(mutex_);
+                for (auto& sub : subscribers_)
+                    sub->overflow_ = true;
+            }
+        }
+        rolled_back();  // i.e. clear the pending state
+    }
+
+
+    // Rollback hook: discards the pending changes.
+    void change_feed::rolled_back() {
+        pending_.clear();
+        rows_.clear();
+    }
+
+}
@@ -0,0 +1,285 @@
+// sqnice/change_recorder.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/change_recorder.hh"
+#include "sqnice/database.hh"
+#include "sqnice/transaction.hh"
+#include <climits>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice {
+    using namespace std;
+
+#ifdef SQLITE_ENABLE_SESSION
+
+    static_assert(int(conflict_type::data)        == SQLITE_CHANGESET_DATA);
+    static_assert(int(conflict_type::not_found)   == SQLITE_CHANGESET_NOTFOUND);
+    static_assert(int(conflict_type::conflict)    == SQLITE_CHANGESET_CONFLICT);
+    static_assert(int(conflict_type::constraint)  == SQLITE_CHANGESET_CONSTRAINT);
+    static_assert(int(conflict_type::foreign_key) == SQLITE_CHANGESET_FOREIGN_KEY);
+    static_assert(int(conflict_action::omit)      == SQLITE_CHANGESET_OMIT);
+    static_assert(int(conflict_action::replace)   == SQLITE_CHANGESET_REPLACE);
+    static_assert(int(conflict_action::abort)     == SQLITE_CHANGESET_ABORT);
+
+    // Size of the length prefix of a log record.
+    static constexpr size_t kRecordHeaderSize = 4;
+
+
+    // Returns the length of the log up to the end of its last complete record.
+    static uint64_t complete_log_length(string const& log_path) {
+        unique_ptr<FILE, decltype(&fclose)> log(fopen(log_path.c_str(), "rb"), fclose);
+        if (!log)
+            return 0;
+        uint64_t length = 0;
+        uint8_t header[kRecordHeaderSize];
+        while (fread(header, sizeof(header), 1, log.get()) == 1) {
+            uint32_t size = 0;
+            for (size_t i = 0; i < kRecordHeaderSize; ++i)
+                size |= uint32_t(header[i]) << (8 * i);
+            // Check that the whole record is present by reading its last byte:
+            if (size == 0 || size > INT_MAX || fseek(log.get(), long(size) - 1, SEEK_CUR) != 0
+                          || fgetc(log.get()) == EOF)
+                break;
+            length += kRecordHeaderSize + size;
+        }
+        return length;
+    }
+
+
+    change_recorder::change_recorder(database& db, string_view log_path, const char* db_name)
+    :db_(&db)
+    ,db_name_(db_name)
+    ,log_path_(log_path)
+    {
+        if (db_->recorder_)
+            throw logic_error("database already has a change_recorder");
+        // Discard a partial record left by a crash, or records appended after it would never
+        // be reached by `apply_log`:
+        error_code ec;
+        if (uint64_t length = complete_log_length(log_path_);
+                length < filesystem::file_size(log_path_, ec) && !ec) {
+            checking::log_warning("change_recorder: truncating partial record at end of log");
+            filesystem::resize_file(log_path_, length, ec);
+            if (ec)
+                throw database_error("couldn't truncate change log file", status::ioerr);
+        }
+        log_ = fopen(log_path_.c_str(), "ab");
+        if (!log_)
+            throw database_error("couldn't open change log file", status::cantopen);
+        try {
+            create_session();
+        } catch (...) {
+            fclose(log_);
+            throw;
+        }
+        db_->recorder_ = this;
+    }
+
+
+    change_recorder::~change_recorder() {
+        detach();
+        fclose(log_);
+    }
+
+
+    // Captures remaining changes and stops recording. Called by the destructor, or by a
+    // `database` about to close its connection.
+    void change_recorder::detach() noexcept {
+        if (!db_)
+            return;
+        db_->recorder_ = nullptr;
+        if (!ok(capture()))
+            checking::log_warning("change_recorder: failed to capture final changes");
+        sqlite3session_delete(session_);
+        session_ = nullptr;
+        db_ = nullptr;
+    }
+
+
+    void change_recorder::create_session() {
+        sqlite3_session* session;
+        int rc = sqlite3session_create(db_->check_handle(), db_name_.c_str(), &session);
+        if (rc == SQLITE_OK) {
+            rc = sqlite3session_attach(session, nullptr);     // attach all tables
+            if (rc != SQLITE_OK)
+                sqlite3session_delete(session);
+        }
+        if (rc != SQLITE_OK)
+            checking::raise(status{rc}, "couldn't create change_recorder session");
+        session_ = session;
+    }
+
+
+    status change_recorder::capture() {
+        if (!session_)
+            return status::misuse;
+        if (sqlite3session_isempty(session_))
+            return status::ok;
+        int size;
+        void* data;
+        if (int rc = sqlite3session_changeset(session_, &size, &data); rc != SQLITE_OK)
+            return status{rc};
+        unique_ptr<void, decltype(&sqlite3_free)> changeset(data, sqlite3_free);
+        if (size == 0)
+            return status::ok;      // all changes were undone
+
+        // Append a record. If that fails, truncate any partial record:
+        long pos = ftell(log_);
+        uint8_t header[kRecordHeaderSize];
+        for (size_t i = 0; i < kRecordHeaderSize; ++i)
+            header[i] = uint8_t(uint32_t(size) >> (8 * i));
+        if (fwrite(header, sizeof(header), 1, log_) != 1
+                || fwrite(data, size, 1, log_) != 1
+                || fflush(log_) != 0) {
+            error_code ec;
+            if (pos >= 0)
+                filesystem::resize_file(log_path_, uint64_t(pos), ec);
+            clearerr(log_);
+            return status::ioerr;
+        }
+        ++changesets_written_;
+
+        // There's no way to clear a session, so replace it with a new one:
+        auto old_session = session_;
+        try {
+            create_session();
+        } catch (database_error const& x) {
+            // The old session would re-record the same changes, so stop recording:
+            checking::log_warning("change_recorder: %s", x.what());
+            sqlite3session_enable(old_session, 0);
+            return x.error_code;
+        }
+        sqlite3session_delete(old_session);
+        return status::ok;
+    }
+
+
+    void change_recorder::transaction_committed() noexcept {
+        if (status rc = capture(); !ok(rc))
+            checking::log_warning("change_recorder: failed to append changeset (error %d)",
+                                  int(rc));
+    }
+
+
+#pragma mark - APPLYING:
+
+
+    namespace {
+        struct apply_context {
+            conflict_handler const& handler;
+            exception_ptr           exception;
+        };
+
+        int apply_conflict(void* ctx, int conflict, sqlite3_changeset_iter* iter) noexcept {
+            auto& context = *static_cast<apply_context*>(ctx);
+            auto type = conflict_type{conflict};
+            try {
+                if (context.handler) {
+                    const char* table = "";
+                    int ncol, op, indirect;
+                    sqlite3changeset_op(iter, &table, &ncol, &op, &indirect);
+                    return int(context.handler(type, table));
+                }
+            } catch (...) {
+                context.exception = current_exception();
+                return SQLITE_CHANGESET_ABORT;
+            }
+            switch (type) {
+                case conflict_type::data:
+                case conflict_type::conflict:   return SQLITE_CHANGESET_REPLACE;
+                case conflict_type::not_found:  return SQLITE_CHANGESET_OMIT;
+                default:                        return SQLITE_CHANGESET_ABORT;
+            }
+        }
+    }
+
+
+    uint64_t apply_log(database& db, string_view log_path, uint64_t start_offset,
+                       conflict_handler on_conflict)
+    {
+        unique_ptr<FILE, decltype(&fclose)> log(fopen(string(log_path).c_str(), "rb"), fclose);
+        if (!log)
+            throw database_error("couldn't open change log file", status::cantopen);
+        if (fseek(log.get(), long(start_offset), SEEK_SET) != 0)
+            throw database_error("invalid change log offset", status::range);
+
+        transaction txn(db);
+        uint64_t offset = start_offset;
+        vector<uint8_t> changeset;
+        while (true) {
+            uint8_t header[kRecordHeaderSize];
+            if (fread(header, sizeof(header), 1, log.get()) != 1)
+                break;
+            uint32_t size = 0;
+            for (size_t i = 0; i < kRecordHeaderSize; ++i)
+                size |= uint32_t(header[i]) << (8 * i);
+            changeset.resize(size);
+            if (size > INT_MAX || fread(changeset.data(), size, 1, log.get()) != 1)
+                break;                  // truncated record at end of log
+
+            apply_context context {on_conflict, nullptr};
+            int rc = sqlite3changeset_apply(db.check_handle(), int(size), changeset.data(),
+                                            nullptr, apply_conflict, &context);
+            if (context.exception)
+                rethrow_exception(context.exception);
+            if (rc != SQLITE_OK)
+                checking::raise(status{rc}, "failed to apply changeset from log");
+            offset += kRecordHeaderSize + size;
+        }
+        txn.commit();
+        return offset;
+    }
+
+#else // SQLITE_ENABLE_SESSION
+
+    static constexpr const char* kNoSessions = "SQLite was built without the session extension";
+
+    change_recorder::change_recorder(database& db, string_view, const char*)
+    :db_(&db)
+    {
+        throw database_error(kNoSessions);
+    }
+
+    change_recorder::~change_recorder() = default;
+    status change_recorder::capture()                   {return status::error;}
+    void change_recorder::create_session()              { }
+    void change_recorder::detach() noexcept             { }
+    void change_recorder::transaction_committed() noexcept { }
+
+    uint64_t apply_log(database&, string_view, uint64_t, conflict_handler) {
+        throw database_error(kNoSessions);
+    }
+
+#endif // SQLITE_ENABLE_SESSION
+}
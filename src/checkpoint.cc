@@ -0,0 +1,169 @@
+// sqnice/checkpoint.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/checkpoint.hh"
+#include "sqnice/pool.hh"
+#include <filesystem>
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice {
+    using namespace std;
+
+
+    checkpoint_controller::checkpoint_controller(pool& pool, checkpoint_options const& options)
+    :pool_(pool)
+    ,options_(options)
+    ,saved_auto_checkpoint_(pool.auto_checkpoint())
+    ,saved_busy_timeout_(pool.writer_busy_timeout())
+    {
+        if (options_.interval.count() <= 0
+                || options_.truncate_wal_size < options_.restart_wal_size)
+            throw invalid_argument("invalid checkpoint_options");
+        pool_.set_auto_checkpoint(0);
+        // A commit may have to wait for an escalated checkpoint, which holds the write lock
+        // for up to `escalation_timeout` plus the time to copy the WAL:
+        pool_.set_writer_busy_timeout(max(saved_busy_timeout_,
+                                          int(options_.escalation_timeout.count()) + 5000));
+        thread_ = thread([this] {run();});
+    }
+
+
+    checkpoint_controller::~checkpoint_controller() {
+        {
+            unique_lock lock(mutex_);
+            stopped_ = true;
+        }
+        cond_.notify_all();
+        thread_.join();
+        pool_.set_auto_checkpoint(saved_auto_checkpoint_ >= 0 ? saved_auto_checkpoint_ : 1000);
+        pool_.set_writer_busy_timeout(max(saved_busy_timeout_, 0));
+    }
+
+
+    checkpoint_stats checkpoint_controller::stats() const {
+        unique_lock lock(mutex_);
+        return stats_;
+    }
+
+
+    void checkpoint_controller::run_now() {
+        {
+            unique_lock lock(mutex_);
+            wake_ = true;
+        }
+        cond_.notify_all();
+    }
+
+
+    // The body of the background thread.
+    void checkpoint_controller::run() {
+        try {
+            // The checkpointing connection. It isn't borrowed from the pool, since a checkpoint
+            // needs a writeable connection and that would block the pool's writer.
+            auto db = pool_.open_connection(true);
+            while (true) {
+                {
+                    unique_lock lock(mutex_);
+                    cond_.wait_for(lock, options_.interval, [this] {return stopped_ || wake_;});
+                    if (stopped_)
+                        break;
+                    wake_ = false;
+                }
+                checkpoint(db->handle());
+            }
+        } catch (std::exception const& x) {
+            checking::log_warning("checkpoint_controller stopped: %s", x.what());
+        }
+    }
+
+
+    void checkpoint_controller::checkpoint(sqlite3* db) {
+        auto wal_size = [&] {
+            error_code ec;
+            auto size = filesystem::file_size(pool_.filename() + "-wal", ec);
+            return ec ? uint64_t(0) : uint64_t(size);
+        };
+
+        // Runs a checkpoint and records its results. Returns true if all frames were copied.
+        int log = 0, ckpt = 0;
+        auto run_checkpoint = [&](int mode) -> bool {
+            auto start = clock::now();
+            int rc = sqlite3_wal_checkpoint_v2(db, nullptr, mode, &log, &ckpt);
+            auto duration = clock::now() - start;
+            unique_lock lock(mutex_);
+            stats_.last_duration = duration;
+            stats_.max_duration = max(stats_.max_duration, stats_.last_duration);
+            if (rc == SQLITE_OK && log >= 0) {
+                stats_.wal_frames = log;
+                stats_.frames_behind = log - ckpt;
+            }
+            switch (mode) {
+                case SQLITE_CHECKPOINT_PASSIVE:  ++stats_.passive_count; break;
+                case SQLITE_CHECKPOINT_RESTART:  stats_.restart_count += (rc == SQLITE_OK); break;
+                case SQLITE_CHECKPOINT_TRUNCATE: stats_.truncate_count += (rc == SQLITE_OK); break;
+            }
+            if (rc == SQLITE_BUSY)
+                stats_.busy_count += (mode != SQLITE_CHECKPOINT_PASSIVE);
+            else if (rc != SQLITE_OK)
+                checking::log_warning("checkpoint failed: %s", sqlite3_errmsg(db));
+            return rc == SQLITE_OK && log >= 0 && log == ckpt;
+        };
+
+        // A connection only finds out it's in WAL mode when it reads the database, so read
+        // something first; otherwise the checkpoint is a no-op.
+        sqlite3_busy_timeout(db, 0);
+        sqlite3_exec(db, "PRAGMA schema_version", nullptr, nullptr, nullptr);
+
+        // A PASSIVE checkpoint never waits, so it's always safe:
+        bool complete = run_checkpoint(SQLITE_CHECKPOINT_PASSIVE);
+        if (log < 0)
+            return;     // not in WAL mode
+
+        // Escalate if the WAL is getting big. RESTART is cheap once all frames have been copied
+        // (i.e. no reader is holding back the checkpoint); TRUNCATE is forced past a hard limit.
+        uint64_t size = wal_size();
+        int mode = 0;
+        if (size >= options_.truncate_wal_size)
+            mode = SQLITE_CHECKPOINT_TRUNCATE;
+        else if (complete && size >= options_.restart_wal_size && log != restarted_frames_)
+            mode = SQLITE_CHECKPOINT_RESTART;   // (unless there've been no writes since the last)
+        if (mode) {
+            sqlite3_busy_timeout(db, int(options_.escalation_timeout.count()));
+            if (run_checkpoint(mode) && mode == SQLITE_CHECKPOINT_RESTART)
+                restarted_frames_ = log;
+            size = wal_size();
+        }
+
+        unique_lock lock(mutex_);
+        stats_.wal_size = size;
+    }
+
+}
@@ -0,0 +1,346 @@
+// sqnice/collations.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "sqnice/collations.hh"
+#include "sqnice/database.hh"
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+namespace sqnice {
+    using namespace std;
+
+    namespace {
+
+#pragma mark - WORD-AT-A-TIME HELPERS:
+
+
+        // These process eight bytes at once in a `uint64_t` ("SIMD within a register"), which
+        // works on any platform without intrinsics.
+
+        constexpr uint64_t kOnes     = 0x0101010101010101;
+        constexpr uint64_t kHighBits = 0x8080808080808080;
+
+        constexpr bool is_digit(char c) noexcept        {return c >= '0' && c <= '9';}
+        constexpr bool is_continuation(char c) noexcept {return (uint8_t(c) & 0xC0) == 0x80;}
+        constexpr int sign(int i) noexcept              {return (i > 0) - (i < 0);}
+
+        inline uint64_t load_word(const char* p) noexcept {
+            uint64_t w;
+            memcpy(&w, p, sizeof(w));
+            return w;
+        }
+
+        // Sets the high bit of each byte of `w` whose value is in [lo, hi]. `w` must be ASCII.
+        constexpr uint64_t bytes_in_range(uint64_t w, uint8_t lo, uint8_t hi) noexcept {
+            return (w + kOnes * (0x80 - lo)) & ~(w + kOnes * (0x7F - hi)) & kHighBits;
+        }
+
+        // Converts the uppercase ASCII letters in `w` to lowercase. `w` must be ASCII.
+        constexpr uint64_t lowercase_word(uint64_t w) noexcept {
+            return w | (bytes_in_range(w, 'A', 'Z') >> 2);      // 0x80 >> 2 == 0x20
+        }
+
+        // Sets the high bit of each nonzero byte of `w`.
+        constexpr uint64_t nonzero_bytes(uint64_t w) noexcept {
+            return (((w & ~kHighBits) + ~kHighBits) | w) & kHighBits;
+        }
+
+        // The index, in memory order, of the first byte whose high bit is set in `mask`.
+        inline size_t first_flagged_byte(uint64_t mask) noexcept {
+            if constexpr (endian::native == endian::little)
+                return size_t(countr_zero(mask)) / 8;
+            else
+                return size_t(countl_zero(mask)) / 8;
+        }
+
+        // Returns the length of a prefix that `a` and `b` share, ignoring ASCII case, comparing
+        // eight bytes at a time. It stops early at non-ASCII differences and in the last few
+        // bytes, so the caller has to compare the rest itself.
+        size_t common_prefix_nocase(string_view a, string_view b) noexcept {
+            size_t n = min(a.size(), b.size()), i = 0;
+            for (; i + 8 <= n; i += 8) {
+                uint64_t wa = load_word(a.data() + i), wb = load_word(b.data() + i);
+                if (wa == wb)
+                    continue;
+                if ((wa | wb) & kHighBits)
+                    break;
+                if (uint64_t diff = nonzero_bytes(lowercase_word(wa) ^ lowercase_word(wb)))
+                    return i + first_flagged_byte(diff);
+            }
+            return i;
+        }
+
+        // Returns the number of ASCII digits at the start of `s`.
+        size_t digit_run(string_view s) noexcept {
+            size_t i = 0;
+            for (; i + 8 <= s.size(); i += 8) {
+                uint64_t w = load_word(s.data() + i);
+                uint64_t digits = bytes_in_range(w & ~kHighBits, '0', '9') & ~w;
+                if (uint64_t others = ~digits & kHighBits)
+                    return i + first_flagged_byte(others);
+            }
+            while (i < s.size() && is_digit(s[i]))
+                ++i;
+            return i;
+        }
+
+        // Backs up `i` to the start of the UTF-8 character it's in, in either string.
+        size_t char_boundary(string_view a, string_view b, size_t i) noexcept {
+            while (i > 0 && ((i < a.size() && is_continuation(a[i]))
+                             || (i < b.size() && is_continuation(b[i]))))
+                --i;
+            return i;
+        }
+
+
+#pragma mark - UNICODE:
+
+
+        // Decodes the UTF-8 character at `s[i]` and advances `i` past it. An invalid byte is
+        // returned by itself as a code point in 0xDC80-0xDCFF (like Python's "surrogateescape")
+        // so that any byte string still has a consistent order.
+        char32_t decode_utf8(string_view s, size_t& i) noexcept {
+            auto b0 = uint8_t(s[i]);
+            if (b0 < 0x80) {
+                ++i;
+                return b0;
+            }
+            size_t len;
+            char32_t c;
+            if (b0 >= 0xC2 && b0 <= 0xDF)       {len = 2; c = b0 & 0x1F;}
+            else if (b0 >= 0xE0 && b0 <= 0xEF)  {len = 3; c = b0 & 0x0F;}
+            else if (b0 >= 0xF0 && b0 <= 0xF4)  {len = 4; c = b0 & 0x07;}
+            else                                {len = 0; c = 0;}
+            if (len == 0 || i + len > s.size()) {
+                ++i;
+                return 0xDC00 + b0;
+            }
+            for (size_t k = 1; k < len; ++k) {
+                auto b = uint8_t(s[i + k]);
+                if (!is_continuation(char(b))) {
+                    ++i;
+                    return 0xDC00 + b0;
+                }
+                c = (c << 6) | (b & 0x3F);
+            }
+            i += len;
+            return c;
+        }
+
+        // Simple (one-to-one) case folding, from Unicode's CaseFolding.txt, for the alphabets
+        // below U+0530 plus Armenian and fullwidth Latin.
+        constexpr char32_t fold_case(char32_t c) noexcept {
+            if (c < 0x80)
+                return (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+            if (c < 0x100) {                                            // Latin-1
+                if (c == 0xB5)
+                    return 0x3BC;                                       // micro sign -> mu
+                return (c >= 0xC0 && c <= 0xDE && c != 0xD7) ? c + 0x20 : c;
+            }
+            if (c < 0x180) {                                            // Latin Extended-A
+                if ((c <= 0x12F) || (c >= 0x132 && c <= 0x137) || (c >= 0x14A && c <= 0x177))
+                    return c | 1;
+                if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+                    return c + (c & 1);
+                if (c == 0x178)
+                    return 0xFF;
+                if (c == 0x17F)
+                    return 's';                                         // long s
+                return c;
+            }
+            if (c >= 0x370 && c < 0x400) {                              // Greek
+                if (c >= 0x391 && c <= 0x3AB && c != 0x3A2)
+                    return c + 0x20;
+                switch (c) {
+                    case 0x386: return 0x3AC;
+                    case 0x388: case 0x389: case 0x38A: return c + 0x25;
+                    case 0x38C: return 0x3CC;
+                    case 0x38E: case 0x38F: return c + 0x3F;
+                    case 0x3C2: return 0x3C3;                           // final sigma
+                    default:    return c;
+                }
+            }
+            if (c >= 0x400 && c < 0x530) {                              // Cyrillic
+                if (c < 0x410)
+                    return c + 0x50;
+                if (c < 0x430)
+                    return c + 0x20;
+                if ((c >= 0x460 && c <= 0x481) || (c >= 0x48A && c <= 0x4BF)
+                        || (c >= 0x4D0 && c <= 0x52F))
+                    return c | 1;
+                if (c >= 0x4C1 && c <= 0x4CE)
+                    return c + (c & 1);
+                if (c == 0x4C0)
+                    return 0x4CF;
+                return c;
+            }
+            if (c >= 0x531 && c <= 0x556)                               // Armenian
+                return c + 0x30;
+            if (c >= 0xFF21 && c <= 0xFF3A)                             // Fullwidth Latin
+                return c + 0x20;
+            return c;
+        }
+
+        // Compares the case-folded code points of the characters at `a[i]` and `b[j]`, and
+        // advances `i` and `j` past them.
+        inline int compare_folded_char(string_view a, size_t& i, string_view b, size_t& j) {
+            char32_t ca = fold_case(decode_utf8(a, i)), cb = fold_case(decode_utf8(b, j));
+            return (ca > cb) - (ca < cb);
+        }
+
+
+#pragma mark - NUMBERS:
+
+
+        // A decimal number parsed from the start of a string.
+        struct decimal {
+            string_view integer;        // Integer digits, without leading zeroes
+            string_view fraction;       // Fraction digits, without trailing zeroes
+            size_t      end = 0;        // Length of the number in the string
+            bool        negative = false;
+            bool        valid = false;  // False if the string doesn't start with a number
+
+            explicit decimal(string_view s) noexcept {
+                size_t i = 0;
+                while (i < s.size() && s[i] == ' ')
+                    ++i;
+                if (i < s.size() && (s[i] == '-' || s[i] == '+'))
+                    negative = (s[i++] == '-');
+                size_t n = digit_run(s.substr(i));
+                integer = s.substr(i, n);
+                i += n;
+                if (i < s.size() && s[i] == '.') {
+                    size_t f = digit_run(s.substr(i + 1));
+                    if (f > 0 || n > 0) {
+                        fraction = s.substr(i + 1, f);
+                        i += 1 + f;
+                    }
+                }
+                valid = !integer.empty() || !fraction.empty();
+                if (!valid)
+                    return;
+                end = i;
+                while (!integer.empty() && integer.front() == '0')
+                    integer.remove_prefix(1);
+                while (!fraction.empty() && fraction.back() == '0')
+                    fraction.remove_suffix(1);
+                if (integer.empty() && fraction.empty())
+                    negative = false;                                   // -0 == 0
+            }
+
+            // Compares absolute values. Since the digit strings are normalized, this is just
+            // a matter of comparing integer lengths, then the digits.
+            int compare_magnitude(decimal const& other) const noexcept {
+                if (integer.size() != other.integer.size())
+                    return integer.size() < other.integer.size() ? -1 : 1;
+                if (int c = integer.compare(other.integer))
+                    return sign(c);
+                return sign(fraction.compare(other.fraction));
+            }
+        };
+
+    }
+
+
+#pragma mark - COLLATIONS:
+
+
+    int compare_unicode_nocase(string_view a, string_view b) noexcept {
+        size_t i = char_boundary(a, b, common_prefix_nocase(a, b));
+        size_t j = i;
+        while (i < a.size() && j < b.size()) {
+            if (int c = compare_folded_char(a, i, b, j))
+                return c;
+        }
+        return int(i < a.size()) - int(j < b.size());
+    }
+
+
+    int compare_natural(string_view a, string_view b) noexcept {
+        size_t i = common_prefix_nocase(a, b);
+        // Back up to the start of any digit run the prefix ended in, since digits compare as
+        // a whole number:
+        while (i > 0 && is_digit(a[i - 1]))
+            --i;
+        i = char_boundary(a, b, i);
+        size_t j = i;
+        int tiebreak = 0;
+        while (i < a.size() && j < b.size()) {
+            if (is_digit(a[i]) && is_digit(b[j])) {
+                // Compare digit runs numerically: skip leading zeroes, then the longer one is
+                // greater, else compare the digits.
+                size_t za = i, zb = j;
+                while (za < a.size() && a[za] == '0')
+                    ++za;
+                while (zb < b.size() && b[zb] == '0')
+                    ++zb;
+                size_t la = digit_run(a.substr(za)), lb = digit_run(b.substr(zb));
+                if (la != lb)
+                    return la < lb ? -1 : 1;
+                if (int c = a.substr(za, la).compare(b.substr(zb, lb)))
+                    return sign(c);
+                if (tiebreak == 0 && za - i != zb - j)
+                    tiebreak = (za - i < zb - j) ? -1 : 1;
+                i = za + la;
+                j = zb + lb;
+            } else if (int c = compare_folded_char(a, i, b, j)) {
+                return c;
+            }
+        }
+        if (int c = int(i < a.size()) - int(j < b.size()))
+            return c;
+        return tiebreak;
+    }
+
+
+    int compare_numeric(string_view a, string_view b) noexcept {
+        decimal da(a), db(b);
+        if (!da.valid || !db.valid) {
+            if (da.valid != db.valid)
+                return da.valid ? -1 : 1;
+            return sign(a.compare(b));
+        }
+        if (da.negative != db.negative)
+            return da.negative ? -1 : 1;
+        if (int c = da.compare_magnitude(db))
+            return da.negative ? -c : c;
+        if (int c = a.substr(da.end).compare(b.substr(db.end)))
+            return sign(c);
+        return sign(a.compare(b));
+    }
+
+
+    status register_collations(database& db) {
+        status rc = db.create_collation<&compare_unicode_nocase>("unicode_nocase");
+        if (ok(rc))
+            rc = db.create_collation<&compare_natural>("natural_sort");
+        if (ok(rc))
+            rc = db.create_collation<&compare_numeric>("numeric");
+        return rc;
+    }
+
+}
@@ -0,0 +1,112 @@
+// sqnice/compaction.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/compaction.hh"
+#include "sqnice/pool.hh"
+#include <filesystem>
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice {
+    using namespace std;
+    namespace fs = std::filesystem;
+
+
+    // Runs `VACUUM INTO` on a (possibly read-only) connection.
+    static void vacuum_into(database const& db, string const& path) {
+        sqlite3* handle = db.check_handle();
+        sqlite3_stmt* stmt;
+        int rc = sqlite3_prepare_v2(handle, "VACUUM INTO ?", -1, &stmt, nullptr);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_STATIC);
+            rc = sqlite3_step(stmt);
+            sqlite3_finalize(stmt);
+        }
+        if (rc != SQLITE_DONE && rc != SQLITE_OK)
+            checking::raise(status{rc}, sqlite3_errmsg(handle));
+    }
+
+
+    // Replaces the database file with the compacted copy. No connections may be open.
+    static void replace_file(string const& temp_path, string const& db_path) {
+        // The WAL and shared-memory files belong to the old file; its contents were already in
+        // the snapshot that was copied, and a leftover WAL would be replayed into the new file.
+        fs::remove(db_path + "-wal");
+        fs::remove(db_path + "-shm");
+        fs::rename(temp_path, db_path);
+    }
+
+
+    compaction_result compact_database(pool& pool, compaction_options const& options) {
+        string const& db_path = pool.filename();
+        string temp_path = options.temp_path.empty() ? db_path + "-compact" : options.temp_path;
+        compaction_result result;
+        result.old_size = fs::file_size(db_path);
+
+        unsigned max_attempts = max(options.max_attempts, 1u);
+        bool replaced = false;
+        try {
+            while (!replaced && result.attempts < max_attempts) {
+                ++result.attempts;
+                fs::remove(temp_path);
+                if (result.attempts == max_attempts && options.block_on_last_attempt) {
+                    // Last resort: copy while no one can use the pool.
+                    replaced = pool.with_all_closed([&] {
+                        vacuum_into(*pool.open_connection(), temp_path);
+                        replace_file(temp_path, db_path);
+                    }, options.drain_timeout);
+                } else {
+                    uint64_t generation = pool.write_generation();
+                    vacuum_into(*pool.borrow(), temp_path);
+                    pool.with_all_closed([&] {
+                        if (pool.write_generation() == generation) {
+                            replace_file(temp_path, db_path);
+                            replaced = true;
+                        }
+                    }, options.drain_timeout);
+                }
+            }
+        } catch (...) {
+            error_code ec;
+            fs::remove(temp_path, ec);
+            throw;
+        }
+
+        if (replaced) {
+            result.new_size = fs::file_size(db_path);
+        } else {
+            fs::remove(temp_path);
+            result.result = status::busy;
+            result.new_size = result.old_size;
+        }
+        return result;
+    }
+
+}
@@ -0,0 +1,243 @@
+// sqnice/compression.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/compression.hh"
+#include "sqnice/functions.hh"
+#include <zstd.h>
+#include <memory>
+
+namespace sqnice {
+    using namespace std;
+
+    // An encoded blob starts with an 8-byte header: 3 magic bytes, a flags byte, and a 32-bit
+    // little-endian checksum of the flags and the payload that follows. The checksum makes it
+    // very unlikely that a plain blob is mistaken for an encoded one.
+    static constexpr char     kHeaderMagic[3] = {char(0xC0), 'Z', 'Q'};
+    static constexpr size_t   kHeaderSize     = 8;
+    static constexpr uint8_t  kFlagCompressed = 0x01;
+    static constexpr uint8_t  kFlagBlob       = 0x02;
+    static constexpr uint8_t  kFlagsMask      = 0x03;
+
+    // Refuse to decompress anything claiming to be bigger than SQLite's maximum value size.
+    static constexpr unsigned long long kMaxDecompressedSize = 0x7FFFFFFF;
+
+
+    // zstd contexts are expensive to create, so each thread keeps one of each.
+    static ZSTD_CCtx* compression_context() {
+        thread_local unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> ctx(ZSTD_createCCtx(),
+                                                                         ZSTD_freeCCtx);
+        if (!ctx)
+            throw bad_alloc();
+        return ctx.get();
+    }
+
+    static ZSTD_DCtx* decompression_context() {
+        thread_local unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> ctx(ZSTD_createDCtx(),
+                                                                         ZSTD_freeDCtx);
+        if (!ctx)
+            throw bad_alloc();
+        return ctx.get();
+    }
+
+
+    // 32-bit FNV-1a hash of the flags byte and the payload.
+    static uint32_t checksum(uint8_t flags, string_view payload) {
+        uint32_t h = (2166136261u ^ flags) * 16777619u;
+        for (char c : payload)
+            h = (h ^ uint8_t(c)) * 16777619u;
+        return h;
+    }
+
+    static string make_header(uint8_t flags, string_view payload) {
+        string header(kHeaderMagic, sizeof(kHeaderMagic));
+        header += char(flags);
+        uint32_t sum = checksum(flags, payload);
+        for (int i = 0; i < 4; ++i)
+            header += char(sum >> (8 * i));
+        return header;
+    }
+
+    // Returns the flags byte if `data` starts with a valid header, else -1.
+    static int parse_header(string_view data) {
+        if (data.size() < kHeaderSize || data.substr(0, 3) != string_view(kHeaderMagic, 3))
+            return -1;
+        uint8_t flags = uint8_t(data[3]);
+        if (flags & ~kFlagsMask)
+            return -1;
+        uint32_t sum = 0;
+        for (int i = 0; i < 4; ++i)
+            sum |= uint32_t(uint8_t(data[4 + i])) << (8 * i);
+        if (sum != checksum(flags, data.substr(kHeaderSize)))
+            return -1;
+        return flags;
+    }
+
+
+    pair<string,bool> compress_value(string_view data, bool is_blob, int level) {
+        uint8_t flags = is_blob ? kFlagBlob : 0;
+        if (data.size() >= kMinCompressibleSize) {
+            string compressed(ZSTD_compressBound(data.size()), '\0');
+            size_t len = ZSTD_compressCCtx(compression_context(), compressed.data(),
+                                           compressed.size(), data.data(), data.size(), level);
+            if (ZSTD_isError(len))
+                checking::raise(status::error, ZSTD_getErrorName(len));
+            if (kHeaderSize + len < data.size()) {
+                compressed.resize(len);
+                flags |= kFlagCompressed;
+                return {make_header(flags, compressed) + compressed, true};
+            }
+        }
+        // Not worth compressing. Store the data as-is, unless it's a blob that could be
+        // mistaken for an encoded one:
+        if (!is_blob || parse_header(data) < 0)
+            return {string(data), is_blob};
+        return {make_header(flags, data) + string(data), true};
+    }
+
+
+    pair<string,bool> decompress_value(string_view data, bool is_blob) {
+        int flags = is_blob ? parse_header(data) : -1;
+        if (flags < 0)
+            return {string(data), is_blob};         // Not encoded
+        bool was_blob = (flags & kFlagBlob) != 0;
+        data.remove_prefix(kHeaderSize);
+        if (!(flags & kFlagCompressed))
+            return {string(data), was_blob};
+
+        unsigned long long size = ZSTD_getFrameContentSize(data.data(), data.size());
+        if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN
+                                          || size > kMaxDecompressedSize)
+            checking::raise(status::corrupt, "invalid compressed value");
+        string result(size_t(size), '\0');
+        size_t len = ZSTD_decompressDCtx(decompression_context(), result.data(), result.size(),
+                                         data.data(), data.size());
+        if (ZSTD_isError(len) || len != size)
+            checking::raise(status::corrupt, "invalid compressed value");
+        return {std::move(result), was_blob};
+    }
+
+
+    status bind_helper(statement& stmt, int idx, compressed const& value) {
+        auto [encoded, is_blob] = compress_value(value.data, value.is_blob, value.level);
+        if (is_blob)
+            return stmt.bind(idx, blob(encoded.data(), encoded.size()));
+        else
+            return stmt.bind(idx, string_view(encoded));
+    }
+
+
+    // Common implementation of the `column_helper<decompressed>::get` methods.
+    template <class VALUE>
+    static decompressed get_decompressed(VALUE const& value) noexcept {
+        switch (value.type()) {
+            case data_type::null:
+                return {};
+            case data_type::blob: {
+                auto b = value.template get<blob>();
+                string_view data(static_cast<const char*>(b.data), b.size);
+                try {
+                    return decompressed(decompress_value(data, true).first);
+                } catch (exception const& x) {
+                    // `get` can't throw, and an empty string would hide the data:
+                    checking::log_warning("Couldn't decompress value: %s", x.what());
+                    return decompressed(string(data));
+                }
+            }
+            default:
+                return decompressed(value.template get<string>());
+        }
+    }
+
+    decompressed column_helper<decompressed>::get(column_value const& value) noexcept {
+        return get_decompressed(value);
+    }
+
+    decompressed column_helper<decompressed>::get(arg_value const& value) noexcept {
+        return get_decompressed(value);
+    }
+
+
+#pragma mark - SQL FUNCTIONS:
+
+
+    // Sets a function result to an encoded or decoded value.
+    static void set_result(function_result& result, pair<string,bool> const& value) {
+        if (value.second)
+            result = blob(value.first.data(), value.first.size());
+        else
+            result = string_view(value.first);
+    }
+
+    static string_view arg_bytes(arg_value const& arg) {
+        auto b = arg.get<blob>();
+        return {static_cast<const char*>(b.data), b.size};
+    }
+
+
+    // `compress(x [, level])`
+    static void compress_fn(function_args args, function_result result) {
+        try {
+            auto arg = args[0];
+            auto type = arg.type();
+            if (type != data_type::text && type != data_type::blob) {
+                result = arg;
+                return;
+            }
+            int level = (args.size() > 1) ? args[1].get<int>() : kDefaultCompressionLevel;
+            set_result(result, compress_value(arg_bytes(arg), type == data_type::blob, level));
+        } catch (database_error const& x) {
+            result = x;
+        } catch (exception const& x) {
+            result.set_error(x.what());
+        }
+    }
+
+    // `decompress(x)`
+    static void decompress_fn(function_args args, function_result result) {
+        try {
+            auto arg = args[0];
+            if (arg.type() != data_type::blob)
+                result = arg;
+            else
+                set_result(result, decompress_value(arg_bytes(arg), true));
+        } catch (database_error const& x) {
+            result = x;
+        } catch (exception const& x) {
+            result.set_error(x.what());
+        }
+    }
+
+
+    status register_compression(database& db) {
+        constexpr auto flags = function_flags::deterministic | function_flags::innocuous;
+        status rc = db.create_function("compress", compress_fn, 1, flags);
+        if (ok(rc))
+            rc = db.create_function("compress", compress_fn, 2, flags);
+        if (ok(rc))
+            rc = db.create_function("decompress", decompress_fn, 1, flags);
+        return rc;
+    }
+
+}
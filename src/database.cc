@@ -26,6 +26,7 @@
 #define SQNICE_LENIENT_FORMATTING   // so I can use %q
 
 #include "sqnice/database.hh"
+#include "sqnice/change_recorder.hh"
 #include "sqnice/query.hh"
 #include "statement_cache.hh"
 #include <cstdio>
@@ -74,12 +75,17 @@ namespace sqnice {
     , rh_(std::move(db.rh_))
     , uh_(std::move(db.uh_))
     , ah_(std::move(db.ah_))
+    , recorder_(std::exchange(db.recorder_, nullptr))
     {
         weak_db_ = db_;
         db.weak_db_ = {};
+        if (recorder_)
+            recorder_->db_ = this;
     }
 
     database& database::operator=(database&& db) noexcept {
+        if (recorder_)
+            recorder_->detach();        // my connection is about to be closed
         static_cast<checking&>(*this) = static_cast<checking&&>(db);
         set_db(db.db_);
         set_db(std::move(db.db_));
@@ -89,7 +95,9 @@ namespace sqnice {
         rh_ = std::move(db.rh_);
         uh_ = std::move(db.uh_);
         ah_ = std::move(db.ah_);
-
+        recorder_ = std::exchange(db.recorder_, nullptr);
+        if (recorder_)
+            recorder_->db_ = this;
         return *this;
     }
 
@@ -199,6 +207,8 @@ namespace sqnice {
     }
 
     void database::tear_down() noexcept {
+        if (recorder_)
+            recorder_->detach();        // captures its last changes while it still can
         commands_.reset();
         queries_.reset();
         set_busy_handler(nullptr);
@@ -483,6 +493,8 @@ namespace sqnice {
                     return rc;
                 }
             }
+            if (commit && recorder_)
+                recorder_->transaction_committed();
         }
         return status::ok;
     }
@@ -578,6 +590,76 @@ namespace sqnice {
 
 
 
+#pragma mark - SERIALIZATION:
+
+
+    database_image::database_image(database_image&& other) noexcept
+    :data_(other.data_)
+    ,size_(other.size_)
+    ,owned_(other.owned_)
+    {
+        other.data_ = nullptr;
+        other.size_ = 0;
+        other.owned_ = false;
+    }
+
+    database_image& database_image::operator=(database_image&& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(owned_, other.owned_);
+        return *this;
+    }
+
+    database_image::~database_image() {
+        if (owned_)
+            sqlite3_free(const_cast<byte*>(data_));
+    }
+
+
+    database_image database::serialize(bool nocopy, const char* schema) const {
+        sqlite3* db = check_handle();
+        sqlite3_int64 size = 0;
+        if (nocopy) {
+            if (auto data = sqlite3_serialize(db, schema, &size, SQLITE_SERIALIZE_NOCOPY))
+                return database_image(reinterpret_cast<const byte*>(data), size_t(size), false);
+        }
+        auto data = sqlite3_serialize(db, schema, &size, 0);
+        if (!data) {
+            if (!sqlite3_db_filename(db, schema))
+                raise(status::error, "no such database schema");
+            if (size > 0)
+                raise(status{SQLITE_NOMEM}, "out of memory serializing database");
+        }
+        return database_image(reinterpret_cast<const byte*>(data), size_t(size), true);
+    }
+
+
+    status database::deserialize(span<const byte> image, deserialize_flags flags,
+                                 const char* schema)
+    {
+        if (!db_) {
+            if (auto rc = open_temporary(); !ok(rc))
+                return rc;
+        }
+        auto size = image.size();
+        auto buffer = static_cast<uint8_t*>(sqlite3_malloc64(max(size, size_t(1))));
+        if (!buffer)
+            return check(status{SQLITE_NOMEM});
+        if (size > 0)
+            memcpy(buffer, image.data(), size);
+        // An in-memory database can't use a WAL, so change a WAL-mode header to rollback mode:
+        if (size >= 20 && buffer[18] == 2 && buffer[19] == 2)
+            buffer[18] = buffer[19] = 1;
+        unsigned sqlflags = SQLITE_DESERIALIZE_FREEONCLOSE;    // (frees buffer even on failure)
+        if ((unsigned(flags) & unsigned(deserialize_flags::readonly)) != 0)
+            sqlflags |= SQLITE_DESERIALIZE_READONLY;
+        else
+            sqlflags |= SQLITE_DESERIALIZE_RESIZEABLE;
+        return check(sqlite3_deserialize(db_.get(), schema, buffer, sqlite3_int64(size),
+                                         sqlite3_int64(size), sqlflags));
+    }
+
+
 #pragma mark - HOOKS:
 
     
@@ -618,7 +700,7 @@ namespace sqnice {
 
         lock_guard lock(sLogMutex);
         sLogHandler = std::move(h);
-        if (h) {
+        if (sLogHandler) {
             auto callback = [](void* p, int errCode, const char* msg) noexcept {
                 if ( (errCode & 0xFF) == SQLITE_SCHEMA ) {
                     // ignore noisy and harmless "statement aborts ...database schema has changed"
@@ -678,4 +760,53 @@ namespace sqnice {
                                                  call, step, finish, destroy) );
     }
 
+    status database::register_window_function(string_view name,
+                                              int nArgs,
+                                              function_flags flags,
+                                              void* _Nullable pApp,
+                                              callFn step,
+                                              finishFn finish,
+                                              finishFn value,
+                                              callFn inverse,
+                                              destroyFn _Nullable destroy)
+    {
+        return check( sqlite3_create_window_function(check_handle(),
+                                                     string(name).c_str(),
+                                                     nArgs,
+                                                     SQLITE_UTF8 | int(flags),
+                                                     pApp,
+                                                     step, finish, value, inverse, destroy) );
+    }
+
+
+    status database::register_collation(string_view name,
+                                        void* _Nullable pArg,
+                                        collateFn fn,
+                                        destroyFn _Nullable destroy)
+    {
+        return check( sqlite3_create_collation_v2(check_handle(),
+                                                  string(name).c_str(),
+                                                  SQLITE_UTF8,
+                                                  pArg, fn, destroy) );
+    }
+
+
+    status database::create_collation(string_view name, collation_handler h) {
+        auto ch = make_unique<collation_handler>(std::move(h));
+        auto collate_impl = [](void* pArg, int len1, const void* str1,
+                               int len2, const void* str2) noexcept -> int {
+            auto& handler = *static_cast<collation_handler*>(pArg);
+            return handler(string_view(static_cast<const char*>(str1), size_t(len1)),
+                           string_view(static_cast<const char*>(str2), size_t(len2)));
+        };
+        auto destroy_impl = [](void* pArg) noexcept {
+            delete static_cast<collation_handler*>(pArg);
+        };
+        // SQLite doesn't call the destructor if registration fails, so don't release `ch` first:
+        status rc = register_collation(name, ch.get(), collate_impl, destroy_impl);
+        if (ok(rc))
+            ch.release();
+        return rc;
+    }
+
 }
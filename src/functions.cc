@@ -33,7 +33,7 @@ namespace sqnice {
 
     context::context(sqlite3_context* ctx, int nargs, database::argv_t values) noexcept
     : argc(nargs)
-    , argv(nargs, values)
+    , argv(nargs, values, ctx)
     , result(ctx)
     { }
 
@@ -105,6 +105,18 @@ namespace sqnice {
         return arg_value(argv_[arg]);
     }
 
+    void* function_args::get_auxdata(size_t arg) const {
+        if (!ctx_ || arg >= argc_) [[unlikely]]
+            throw invalid_argument("invalid context or arg index for auxdata");
+        return sqlite3_get_auxdata(ctx_, int(arg));
+    }
+
+    void function_args::set_auxdata(size_t arg, void* data, void (*destroy)(void*)) const {
+        if (!ctx_ || arg >= argc_) [[unlikely]]
+            throw invalid_argument("invalid context or arg index for auxdata");
+        sqlite3_set_auxdata(ctx_, int(arg), data, destroy);
+    }
+
 
     data_type arg_value::type() const noexcept {
         return data_type{sqlite3_value_type(value_)};
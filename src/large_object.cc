@@ -0,0 +1,375 @@
+// sqnice/large_object.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "sqnice/large_object.hh"
+#include "sqnice/blob_stream.hh"
+#include "sqnice/pool.hh"
+#include "sqnice/query.hh"
+#include "sqnice/transaction.hh"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace sqnice {
+    using namespace std;
+
+    // A chunk's rowid is its object's ID in the high 32 bits and its sequence number in the low
+    // 32, so a chunk can be opened as a blob without any index lookup, and an object's chunks
+    // are a contiguous range of rowids.
+    static constexpr int     kSeqBits = 32;
+    static constexpr int64_t kMaxObjectID = INT32_MAX;
+    static constexpr uint64_t kMaxChunks = uint64_t(1) << kSeqBits;
+
+    // Creates a command that throws on error regardless of the database's `exceptions` setting.
+    static command must_command(database& db, string const& sql) {
+        command cmd(db, sql);
+        cmd.exceptions(true);
+        return cmd;
+    }
+
+    static query must_query(database const& db, string const& sql) {
+        query q(db, sql);
+        q.exceptions(true);
+        return q;
+    }
+
+
+#pragma mark - STORE:
+
+
+    large_object_store::large_object_store(database& db, string_view name, size_t chunk_size)
+    :db_(db)
+    ,name_(name)
+    ,chunk_size_(chunk_size)
+    {
+        if (chunk_size == 0 || chunk_size > INT_MAX)
+            throw invalid_argument("invalid large_object chunk size");
+        must_command(db_, format("CREATE TABLE IF NOT EXISTS %s (id INTEGER PRIMARY KEY,"
+                                 " size INTEGER NOT NULL DEFAULT 0,"
+                                 " chunk_size INTEGER NOT NULL)",
+                                 quote_identifier(name_).c_str())).execute();
+        must_command(db_, format("CREATE TABLE IF NOT EXISTS %s (id INTEGER PRIMARY KEY,"
+                                 " data BLOB NOT NULL)",
+                                 quote_identifier(name_ + "_chunks").c_str())).execute();
+    }
+
+
+    int64_t large_object_store::create() {
+        auto ins = must_command(db_, format("INSERT INTO %s (chunk_size) VALUES (?)",
+                                            quote_identifier(name_).c_str()));
+        ins.execute(int64_t(chunk_size_));
+        int64_t id = ins.last_insert_rowid();
+        if (id > kMaxObjectID) {
+            remove(id);
+            throw database_error("too many large objects", status::range);
+        }
+        return id;
+    }
+
+
+    bool large_object_store::exists(int64_t id) const {
+        auto q = must_query(db_, format("SELECT 1 FROM %s WHERE id = ?",
+                                        quote_identifier(name_).c_str()));
+        return q(id).single_value<int>().has_value();
+    }
+
+
+    void large_object_store::remove(int64_t id) {
+        transaction txn(db_);
+        must_command(db_, format("DELETE FROM %s WHERE id BETWEEN ? AND ?",
+                                 quote_identifier(name_ + "_chunks").c_str()))
+            .execute(id << kSeqBits, (id << kSeqBits) + int64_t(kMaxChunks - 1));
+        must_command(db_, format("DELETE FROM %s WHERE id = ?", quote_identifier(name_).c_str()))
+            .execute(id);
+        txn.commit();
+    }
+
+
+#pragma mark - OBJECT:
+
+
+    large_object::large_object(database& db, string_view store_name, int64_t id)
+    :large_object(&db, true, store_name, id)
+    { }
+
+    large_object::large_object(database const& db, string_view store_name, int64_t id)
+    :large_object(const_cast<database*>(&db), false, store_name, id)
+    { }
+
+    large_object::large_object(database* db, bool writeable, string_view store_name, int64_t id)
+    :db_(db)
+    ,writeable_(writeable)
+    ,table_(quote_identifier(store_name))
+    ,chunks_name_(string(store_name) + "_chunks")
+    ,chunks_table_(quote_identifier(chunks_name_))
+    ,id_(id)
+    {
+        auto q = must_query(*db_, format("SELECT size, chunk_size FROM %s WHERE id = ?",
+                                         table_.c_str()));
+        auto i = q(id).begin();
+        if (!i)
+            throw database_error("no such large object", status::error);
+        size_ = i->get<uint64_t>(0);
+        chunk_size_ = i->get<size_t>(1);
+        if (chunk_size_ == 0 || chunk_size_ > INT_MAX)
+            throw database_error("invalid large object chunk size", status::corrupt);
+    }
+
+
+    database& large_object::writeable_db() const {
+        if (!writeable_)
+            throw logic_error("large_object was opened read-only");
+        return *db_;
+    }
+
+
+    int64_t large_object::chunk_rowid(uint64_t seq) const {
+        if (seq >= kMaxChunks)
+            throw database_error("large object is too big", status::range);
+        return (id_ << kSeqBits) | int64_t(seq);
+    }
+
+
+    // The current length of a chunk, based on the object size.
+    size_t large_object::chunk_length(uint64_t seq) const noexcept {
+        uint64_t start = seq * chunk_size_;
+        if (start >= size_)
+            return 0;
+        return size_t(min(uint64_t(chunk_size_), size_ - start));
+    }
+
+
+    // Reads from a chunk. `blob` is reused, so successive calls needn't open new blob handles.
+    void large_object::read_chunk(database const& db, optional<blob_stream>& blob, uint64_t seq,
+                                  void* dst, size_t len, size_t offset) const
+    {
+        if (blob)
+            blob->reopen(chunk_rowid(seq));
+        else
+            blob.emplace(db, chunks_name_.c_str(), "data", chunk_rowid(seq));
+        if (!ok(blob->last_status()))
+            checking::raise(blob->last_status(), "missing large object chunk");
+        int n = blob->pread(dst, len, offset);
+        if (n < 0)
+            checking::raise(blob->last_status(), "error reading large object chunk");
+        else if (size_t(n) < len)
+            throw database_error("large object chunk is too short", status::corrupt);
+    }
+
+
+    size_t large_object::pread(void* dst, size_t len, uint64_t offset) const {
+        if (offset > size_)
+            throw invalid_argument("read starts past end of large object");
+        len = size_t(min(uint64_t(len), size_ - offset));
+        auto out = static_cast<uint8_t*>(dst);
+        optional<blob_stream> blob;
+        for (uint64_t pos = offset, end = offset + len; pos < end; ) {
+            uint64_t seq = pos / chunk_size_;
+            size_t within = size_t(pos % chunk_size_);
+            size_t n = size_t(min(uint64_t(chunk_size_ - within), end - pos));
+            read_chunk(*db_, blob, seq, out, n, within);
+            out += n;
+            pos += n;
+        }
+        return len;
+    }
+
+
+    size_t large_object::pread_parallel(pool& pool, void* dst, size_t len, uint64_t offset,
+                                        unsigned max_threads) const
+    {
+        if (offset > size_)
+            throw invalid_argument("read starts past end of large object");
+        len = size_t(min(uint64_t(len), size_ - offset));
+        if (len == 0)
+            return 0;
+        uint64_t const end = offset + len;
+        uint64_t const first_seq = offset / chunk_size_, last_seq = (end - 1) / chunk_size_;
+        unsigned nthreads = unsigned(min(uint64_t(max_threads), last_seq - first_seq + 1));
+        if (nthreads <= 1)
+            return pread(dst, len, offset);
+
+        // Each thread, including this one, repeatedly claims the next unread chunk:
+        atomic<uint64_t> next_seq = first_seq;
+        mutex error_mutex;
+        exception_ptr error;
+
+        auto read_chunks = [&](database const& db) {
+            try {
+                optional<blob_stream> blob;
+                for (uint64_t seq; (seq = next_seq++) <= last_seq; ) {
+                    uint64_t start = max(offset, seq * chunk_size_);
+                    uint64_t stop = min(end, (seq + 1) * chunk_size_);
+                    read_chunk(db, blob, seq, static_cast<uint8_t*>(dst) + (start - offset),
+                               size_t(stop - start), size_t(start - seq * chunk_size_));
+                }
+            } catch (...) {
+                next_seq = last_seq + 1;        // stop the other threads
+                unique_lock lock(error_mutex);
+                if (!error)
+                    error = current_exception();
+            }
+        };
+
+        vector<thread> threads;
+        for (unsigned i = 1; i < nthreads; ++i) {
+            threads.emplace_back([&] {
+                // Don't wait for a database; if none is free, the other threads do the work.
+                try {
+                    if (auto db = pool.try_borrow())
+                        read_chunks(*db);
+                } catch (...) { }
+            });
+        }
+        read_chunks(*db_);
+        for (auto& t : threads)
+            t.join();
+        if (error)
+            rethrow_exception(error);
+        return len;
+    }
+
+
+    // Writes within a single chunk, growing it if necessary. `offset` must be no greater than
+    // the chunk's current length.
+    void large_object::write_chunk(uint64_t seq, const void* src, size_t len, size_t offset) {
+        database& db = writeable_db();
+        int64_t rowid = chunk_rowid(seq);
+        size_t existing = chunk_length(seq);
+        if (existing == 0) {
+            // New chunk:
+            must_command(db, format("INSERT INTO %s (id, data) VALUES (?, ?)",
+                                    chunks_table_.c_str()))
+                .execute(rowid, uncopied(static_cast<const uint8_t*>(src), len));
+            return;
+        }
+        if (offset + len > existing)
+            reserve_chunk(rowid, offset + len);
+        blob_stream blob(db, chunks_name_.c_str(), "data", rowid, true);
+        if (!ok(blob.last_status()) || blob.pwrite(src, len, offset) != int(len))
+            checking::raise(blob.last_status(), "error writing large object chunk");
+    }
+
+
+    // Makes a chunk's stored blob at least `length` bytes long. Appending to a blob rewrites
+    // all of it, so it's grown geometrically (up to the chunk size), and then written in place;
+    // that way a series of small appends rewrites each chunk only a few times. The stored blob
+    // of the last chunk can thus be longer than its data; the excess is always zeroes.
+    void large_object::reserve_chunk(int64_t rowid, size_t length) {
+        must_command(writeable_db(),
+                     format("UPDATE %s SET data = CAST(data || zeroblob("
+                                "min(max(?1, 2 * length(data)), ?2) - length(data)) AS BLOB)"
+                            " WHERE id = ?3 AND length(data) < ?1", chunks_table_.c_str()))
+            .execute(int64_t(length), int64_t(chunk_size_), rowid);
+    }
+
+
+    void large_object::pwrite(const void* src, size_t len, uint64_t offset) {
+        database& db = writeable_db();
+        if (len == 0)
+            return;
+        uint64_t const old_size = size_;
+        try {
+            transaction txn(db);
+            if (offset > size_)
+                resize(offset);
+            auto in = static_cast<const uint8_t*>(src);
+            for (uint64_t pos = offset, end = offset + len; pos < end; ) {
+                uint64_t seq = pos / chunk_size_;
+                size_t within = size_t(pos % chunk_size_);
+                size_t n = size_t(min(uint64_t(chunk_size_ - within), end - pos));
+                write_chunk(seq, in, n, within);
+                size_ = max(size_, pos + n);
+                in += n;
+                pos += n;
+            }
+            save_size();
+            txn.commit();
+        } catch (...) {
+            size_ = old_size;
+            throw;
+        }
+    }
+
+
+    void large_object::truncate(uint64_t new_size) {
+        database& db = writeable_db();
+        uint64_t const old_size = size_;
+        try {
+            transaction txn(db);
+            resize(new_size);
+            save_size();
+            txn.commit();
+        } catch (...) {
+            size_ = old_size;
+            throw;
+        }
+    }
+
+
+    // Changes the size, adding zeroed chunks or removing chunks. Doesn't save the size.
+    void large_object::resize(uint64_t new_size) {
+        database& db = writeable_db();
+        if (new_size < size_) {
+            // Delete chunks past the new end, then shorten the new last chunk, so that the
+            // bytes past the end are zeroes if it grows again:
+            uint64_t keep = (new_size + chunk_size_ - 1) / chunk_size_;     // # chunks to keep
+            must_command(db, format("DELETE FROM %s WHERE id BETWEEN ? AND ?",
+                                    chunks_table_.c_str()))
+                .execute(chunk_rowid(keep), chunk_rowid(kMaxChunks - 1));
+            if (size_t tail = size_t(new_size % chunk_size_); tail > 0) {
+                must_command(db, format("UPDATE %s SET data = substr(data, 1, ?) WHERE id = ?",
+                                        chunks_table_.c_str()))
+                    .execute(int64_t(tail), chunk_rowid(keep - 1));
+            }
+            size_ = new_size;
+        } else {
+            // Zero-fill the current last chunk, then add zeroed chunks:
+            auto insert = must_command(db, format("INSERT INTO %s (id, data)"
+                                                  " VALUES (?, zeroblob(?))",
+                                                  chunks_table_.c_str()));
+            while (size_ < new_size) {
+                uint64_t seq = size_ / chunk_size_;
+                size_t existing = chunk_length(seq);
+                size_t n = size_t(min(uint64_t(chunk_size_ - existing), new_size - size_));
+                if (existing > 0)
+                    reserve_chunk(chunk_rowid(seq), existing + n);
+                else
+                    insert.execute(chunk_rowid(seq), int64_t(n));
+                size_ += n;
+            }
+        }
+    }
+
+
+    void large_object::save_size() {
+        must_command(writeable_db(), format("UPDATE %s SET size = ? WHERE id = ?", table_.c_str()))
+            .execute(size_, id_);
+    }
+
+}
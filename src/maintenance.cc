@@ -0,0 +1,158 @@
+// sqnice/maintenance.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/maintenance.hh"
+#include "sqnice/pool.hh"
+
+namespace sqnice {
+    using namespace std;
+
+
+    maintenance_scheduler::maintenance_scheduler(pool& pool, maintenance_options const& options)
+    :pool_(pool)
+    ,options_(options)
+    ,last_optimize_(clock::now())
+    ,optimize_generation_(pool.write_generation())
+    {
+        if (options_.vacuum_pages_per_slice < 1 || options_.check_interval.count() <= 0)
+            throw invalid_argument("invalid maintenance_options");
+        thread_ = thread([this] {run();});
+    }
+
+
+    maintenance_scheduler::~maintenance_scheduler() {
+        {
+            unique_lock lock(mutex_);
+            stopped_ = true;
+        }
+        cond_.notify_all();
+        thread_.join();
+    }
+
+
+    void maintenance_scheduler::run_now() {
+        {
+            unique_lock lock(mutex_);
+            wake_ = true;
+        }
+        cond_.notify_all();
+    }
+
+
+    maintenance_stats maintenance_scheduler::stats() const {
+        unique_lock lock(mutex_);
+        return stats_;
+    }
+
+
+    // The body of the background thread.
+    void maintenance_scheduler::run() {
+        while (true) {
+            {
+                unique_lock lock(mutex_);
+                cond_.wait_for(lock, options_.check_interval,
+                               [this] {return stopped_ || wake_;});
+                if (stopped_)
+                    break;
+                wake_ = false;
+            }
+            run_pass();
+        }
+    }
+
+
+    // True if I should give up the writeable database.
+    bool maintenance_scheduler::preempted() {
+        if (stopped_)
+            return true;
+        if (!pool_.writeable_wanted())
+            return false;
+        unique_lock lock(mutex_);
+        ++stats_.preemptions;
+        return true;
+    }
+
+
+    void maintenance_scheduler::run_pass() {
+        auto start = clock::now();
+        try {
+            // Only proceed if the writeable database is idle:
+            auto db = pool_.try_borrow_writeable();
+            if (!db)
+                return;
+            ++own_writes_;
+            vacuum(*db);
+            if (!preempted())
+                optimize(*db);
+        } catch (std::exception const& x) {
+            checking::log_warning("maintenance_scheduler: %s", x.what());
+            unique_lock lock(mutex_);
+            ++stats_.errors;
+        }
+        unique_lock lock(mutex_);
+        stats_.time_spent += clock::now() - start;
+    }
+
+
+    void maintenance_scheduler::vacuum(database& db) {
+        if (db.pragma("auto_vacuum") != 2)      // 2 is INCREMENTAL
+            return;
+        int64_t free_pages = db.pragma("freelist_count");
+        if (free_pages < max(options_.vacuum_threshold_pages, int64_t(1)))
+            return;
+        bool vacuumed = false;
+        while (free_pages > 0 && !preempted()) {
+            db.pragma("incremental_vacuum", options_.vacuum_pages_per_slice);
+            int64_t now_free = db.pragma("freelist_count");
+            vacuumed = true;
+            unique_lock lock(mutex_);
+            ++stats_.vacuum_slices;
+            stats_.pages_reclaimed += free_pages - now_free;
+            if (now_free >= free_pages)
+                break;      // no progress
+            free_pages = now_free;
+        }
+        if (vacuumed && options_.checkpoint_after_vacuum && !preempted())
+            (void)db.execute("PRAGMA wal_checkpoint(PASSIVE)");
+    }
+
+
+    void maintenance_scheduler::optimize(database& db) {
+        // Write generations caused by my own borrowing don't count as writes:
+        uint64_t writes = pool_.write_generation() - optimize_generation_ - (own_writes_ - 1);
+        bool due = (options_.optimize_interval.count() > 0
+                        && clock::now() - last_optimize_ >= options_.optimize_interval)
+                || (options_.optimize_after_writes > 0 && writes >= options_.optimize_after_writes);
+        if (!due)
+            return;
+        db.optimize();
+        last_optimize_ = clock::now();
+        optimize_generation_ = pool_.write_generation();
+        own_writes_ = 1;            // the current borrow hasn't been counted yet
+        unique_lock lock(mutex_);
+        ++stats_.optimize_runs;
+    }
+
+}
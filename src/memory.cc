@@ -0,0 +1,278 @@
+// sqnice/memory.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/memory.hh"
+#include "sqnice/database.hh"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice::memory {
+    using namespace std;
+
+
+#pragma mark - SIZE CLASSES:
+
+
+    // Size classes are multiples of 16 up to 256, then multiples of 128 from 384 to 1024.
+    static constexpr size_t kMaxClassSize = 1024;
+    static constexpr unsigned kNumClasses = 16 + 6;
+
+    // Every block starts with a header holding its usable size. SQLite requires 8-byte
+    // alignment; a 16-byte header keeps blocks 16-byte aligned, like `malloc`.
+    static constexpr size_t kHeaderSize = 16;
+
+    static unsigned class_index(size_t size) {
+        if (size <= 256)
+            return unsigned((max(size, size_t(1)) + 15) / 16 - 1);
+        else
+            return unsigned(16 + (size + 127) / 128 - 3);
+    }
+
+    static size_t class_size(unsigned index) {
+        return (index < 16) ? (index + 1) * 16 : (index - 16 + 3) * 128;
+    }
+
+    static size_t& header(void* p)     {return *(size_t*)((char*)p - kHeaderSize);}
+
+
+#pragma mark - THREAD CACHES:
+
+
+    // Max number of bytes of free blocks a thread caches, per size class.
+    static constexpr size_t kMaxCachedBytesPerClass = 16384;
+
+    namespace {
+        struct thread_cache;
+
+        // Registry of live thread caches, so `stats` can add up their counters.
+        mutex                   sCachesMutex;
+        vector<thread_cache*>   sCaches;
+        allocator_stats         sExitedStats;   // Counters of caches of exited threads
+        bool                    sPooled = false;
+
+        // Counter that's written only by its own thread, but may be read by others.
+        struct counter {
+            atomic<uint64_t> n = 0;
+            void operator+= (uint64_t d) {n.store(n.load(memory_order_relaxed) + d,
+                                                  memory_order_relaxed);}
+            void operator-= (uint64_t d) {n.store(n.load(memory_order_relaxed) - d,
+                                                  memory_order_relaxed);}
+            uint64_t get() const         {return n.load(memory_order_relaxed);}
+        };
+
+        struct thread_cache {
+            void* _Nullable free_list[kNumClasses] = {};   // Next pointers are stored in blocks
+            size_t          count[kNumClasses] = {};
+            counter         hits, misses, large, cached_bytes;
+
+            thread_cache() {
+                lock_guard lock(sCachesMutex);
+                sCaches.push_back(this);
+            }
+
+            ~thread_cache() {
+                for (unsigned i = 0; i < kNumClasses; ++i) {
+                    while (void* block = free_list[i]) {
+                        free_list[i] = *(void**)block;
+                        ::free((char*)block - kHeaderSize);
+                    }
+                }
+                lock_guard lock(sCachesMutex);
+                sExitedStats.cache_hits += hits.get();
+                sExitedStats.cache_misses += misses.get();
+                sExitedStats.large += large.get();
+                sCaches.erase(std::find(sCaches.begin(), sCaches.end(), this));
+                sCacheDestroyed = true;
+            }
+
+            static inline thread_local bool sCacheDestroyed = false;
+        };
+
+        thread_local thread_cache tCache;
+    }
+
+
+#pragma mark - ALLOCATOR:
+
+
+    static void* _Nullable pooled_malloc(int n) {
+        size_t size = size_t(max(n, 1));
+        if (size > kMaxClassSize || thread_cache::sCacheDestroyed) {
+            // A small block must still be a full size class, since another thread may free it
+            // into its cache, which will reuse it for anything up to the class size:
+            if (size <= kMaxClassSize)
+                size = class_size(class_index(size));
+            void* p = ::malloc(kHeaderSize + size);
+            if (!p)
+                return nullptr;
+            p = (char*)p + kHeaderSize;
+            header(p) = size;
+            if (!thread_cache::sCacheDestroyed)
+                tCache.large += 1;
+            return p;
+        }
+        unsigned index = class_index(size);
+        thread_cache& cache = tCache;
+        if (void* block = cache.free_list[index]) {
+            cache.free_list[index] = *(void**)block;
+            --cache.count[index];
+            cache.hits += 1;
+            cache.cached_bytes -= class_size(index);
+            return block;
+        }
+        size = class_size(index);
+        void* p = ::malloc(kHeaderSize + size);
+        if (!p)
+            return nullptr;
+        p = (char*)p + kHeaderSize;
+        header(p) = size;
+        cache.misses += 1;
+        return p;
+    }
+
+    static void pooled_free(void* _Nullable p) {
+        if (!p)
+            return;
+        size_t size = header(p);
+        if (size <= kMaxClassSize && !thread_cache::sCacheDestroyed) {
+            // (A block allocated by another thread goes into this thread's cache. That's fine,
+            // since all blocks come from `malloc` and are interchangeable.)
+            unsigned index = class_index(size);
+            thread_cache& cache = tCache;
+            if (cache.count[index] * size < kMaxCachedBytesPerClass) {
+                *(void**)p = cache.free_list[index];
+                cache.free_list[index] = p;
+                ++cache.count[index];
+                cache.cached_bytes += size;
+                return;
+            }
+        }
+        ::free((char*)p - kHeaderSize);
+    }
+
+    static int pooled_size(void* _Nullable p) {
+        return p ? int(header(p)) : 0;
+    }
+
+    static void* _Nullable pooled_realloc(void* _Nullable p, int n) {
+        if (!p)
+            return pooled_malloc(n);
+        size_t old_size = header(p);
+        if (size_t(n) <= old_size && (old_size <= kMaxClassSize || size_t(n) > kMaxClassSize))
+            return p;       // Still fits (and isn't a big block shrinking into a size class)
+        void* new_p = pooled_malloc(n);
+        if (new_p) {
+            memcpy(new_p, p, min(old_size, size_t(n)));
+            pooled_free(p);
+        }
+        return new_p;
+    }
+
+    static int pooled_roundup(int n) {
+        if (size_t(n) <= kMaxClassSize)
+            return int(class_size(class_index(size_t(n))));
+        return (n + 7) & ~7;
+    }
+
+    static int pooled_init(void*)   {return SQLITE_OK;}
+    static void pooled_shutdown(void*) { }
+
+
+#pragma mark - API:
+
+
+    status install_page_cache(size_t budget);     // in page_cache.cc
+
+
+    status configure(options const& opts) {
+        int rc = sqlite3_config(SQLITE_CONFIG_MEMSTATUS, int(opts.track_usage));
+        if (rc == SQLITE_OK && opts.pooled_allocator) {
+            static const sqlite3_mem_methods kMethods = {
+                pooled_malloc, pooled_free, pooled_realloc, pooled_size, pooled_roundup,
+                pooled_init, pooled_shutdown, nullptr
+            };
+            rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &kMethods);
+            if (rc == SQLITE_OK)
+                sPooled = true;
+        }
+        if (rc == SQLITE_OK && (opts.lookaside_slot_size >= 0 || opts.lookaside_slot_count >= 0)) {
+            rc = sqlite3_config(SQLITE_CONFIG_LOOKASIDE,
+                                opts.lookaside_slot_size >= 0 ? opts.lookaside_slot_size : 1200,
+                                opts.lookaside_slot_count >= 0 ? opts.lookaside_slot_count : 100);
+        }
+        if (rc == SQLITE_OK && opts.page_cache_budget > 0)
+            rc = int(install_page_cache(opts.page_cache_budget));
+        return status{rc};
+    }
+
+
+    allocator_stats stats() noexcept {
+        if (!sPooled)
+            return {};
+        lock_guard lock(sCachesMutex);
+        allocator_stats result = sExitedStats;
+        for (thread_cache* cache : sCaches) {
+            result.cache_hits += cache->hits.get();
+            result.cache_misses += cache->misses.get();
+            result.large += cache->large.get();
+            result.cached_bytes += cache->cached_bytes.get();
+        }
+        return result;
+    }
+
+
+    status set_lookaside(database& db, int slot_size, int slot_count) {
+        return db.check(status{sqlite3_db_config(db.check_handle(), SQLITE_DBCONFIG_LOOKASIDE,
+                                                 nullptr, slot_size, slot_count)});
+    }
+
+
+    lookaside_counters lookaside_stats(database const& db, bool reset) {
+        sqlite3* handle = db.check_handle();
+        lookaside_counters result;
+        int cur, hi;
+        sqlite3_db_status(handle, SQLITE_DBSTATUS_LOOKASIDE_USED, &cur, &hi, reset);
+        result.used = cur;
+        result.highwater = hi;
+        sqlite3_db_status(handle, SQLITE_DBSTATUS_LOOKASIDE_HIT, &cur, &result.hits, reset);
+        sqlite3_db_status(handle, SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, &cur,
+                          &result.misses_size, reset);
+        sqlite3_db_status(handle, SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, &cur,
+                          &result.misses_full, reset);
+        return result;
+    }
+
+}
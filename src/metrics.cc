@@ -0,0 +1,162 @@
+// sqnice/metrics.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/database.hh"
+#include <cinttypes>
+#include <cstdio>
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice {
+    using namespace std;
+
+
+    // Adds a connection's `sqlite3_db_status` values to `m`. (Also called by `pool::metrics`.)
+    void add_connection_metrics(metrics_snapshot& m, sqlite3* db) {
+        auto db_status = [db](int op) {
+            int cur = 0, hi = 0;
+            sqlite3_db_status(db, op, &cur, &hi, false);
+            return pair<int64_t,int64_t>(cur, hi);
+        };
+        // (The lookaside hit & miss counters are reported as the high-water value.)
+        ++m.connections;
+        m.cache_hits            += db_status(SQLITE_DBSTATUS_CACHE_HIT).first;
+        m.cache_misses          += db_status(SQLITE_DBSTATUS_CACHE_MISS).first;
+        m.cache_writes          += db_status(SQLITE_DBSTATUS_CACHE_WRITE).first;
+        m.cache_spills          += db_status(SQLITE_DBSTATUS_CACHE_SPILL).first;
+        m.cache_used            += db_status(SQLITE_DBSTATUS_CACHE_USED).first;
+        m.schema_used           += db_status(SQLITE_DBSTATUS_SCHEMA_USED).first;
+        m.statement_used        += db_status(SQLITE_DBSTATUS_STMT_USED).first;
+        auto [used, highwater]   = db_status(SQLITE_DBSTATUS_LOOKASIDE_USED);
+        m.lookaside_used        += used;
+        m.lookaside_highwater   += highwater;
+        m.lookaside_hits        += db_status(SQLITE_DBSTATUS_LOOKASIDE_HIT).second;
+        m.lookaside_misses      += db_status(SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE).second
+                                 + db_status(SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL).second;
+    }
+
+
+    // Sets the `sqlite3_status64` values of `m`. (Also called by `pool::metrics`.)
+    void set_process_metrics(metrics_snapshot& m) {
+        sqlite3_int64 cur, hi;
+        if (sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &cur, &hi, false) == SQLITE_OK) {
+            m.memory_used = cur;
+            m.memory_highwater = hi;
+        }
+        if (sqlite3_status64(SQLITE_STATUS_MALLOC_COUNT, &cur, &hi, false) == SQLITE_OK) {
+            m.malloc_count = cur;
+            m.malloc_count_highwater = hi;
+        }
+        if (sqlite3_status64(SQLITE_STATUS_MALLOC_SIZE, &cur, &hi, false) == SQLITE_OK)
+            m.largest_malloc = hi;
+    }
+
+
+    metrics_snapshot database::metrics() const {
+        metrics_snapshot m;
+        add_connection_metrics(m, check_handle());
+        set_process_metrics(m);
+        return m;
+    }
+
+
+#pragma mark - PROMETHEUS:
+
+
+    namespace {
+        struct metric_info {
+            const char*                 name;
+            bool                        counter;    // else gauge
+            const char*                 help;
+            int64_t metrics_snapshot::* field;
+        };
+
+        using M = metrics_snapshot;
+        constexpr metric_info kMetrics[] = {
+            {"connections", false, "Connections sampled", &M::connections},
+            {"connections_busy", false, "Busy connections not sampled", &M::connections_busy},
+            {"cache_hits_total", true, "Page cache hits", &M::cache_hits},
+            {"cache_misses_total", true, "Page cache misses", &M::cache_misses},
+            {"cache_writes_total", true, "Pages written to disk", &M::cache_writes},
+            {"cache_spills_total", true, "Dirty pages written mid-transaction", &M::cache_spills},
+            {"cache_used_bytes", false, "Memory used by page caches", &M::cache_used},
+            {"schema_used_bytes", false, "Memory used by schemas", &M::schema_used},
+            {"statement_used_bytes", false, "Memory used by prepared statements",
+                                                                        &M::statement_used},
+            {"lookaside_used", false, "Lookaside slots in use", &M::lookaside_used},
+            {"lookaside_highwater", false, "Most lookaside slots in use",
+                                                                        &M::lookaside_highwater},
+            {"lookaside_hits_total", true, "Allocations from lookaside", &M::lookaside_hits},
+            {"lookaside_misses_total", true, "Allocations not from lookaside",
+                                                                        &M::lookaside_misses},
+            {"memory_used_bytes", false, "Memory allocated by SQLite", &M::memory_used},
+            {"memory_highwater_bytes", false, "Most memory allocated by SQLite",
+                                                                        &M::memory_highwater},
+            {"mallocs", false, "Outstanding allocations", &M::malloc_count},
+            {"mallocs_highwater", false, "Most outstanding allocations",
+                                                                        &M::malloc_count_highwater},
+            {"largest_malloc_bytes", false, "Largest allocation requested", &M::largest_malloc},
+        };
+    }
+
+
+    // Adds the values of `src` to `dst`, or only its counters. (Called by `pool`.)
+    void add_metrics(metrics_snapshot& dst, metrics_snapshot const& src, bool counters_only) {
+        for (auto& info : kMetrics) {
+            if (info.counter || !counters_only)
+                dst.*info.field += src.*info.field;
+        }
+    }
+
+
+    string metrics_snapshot::prometheus(string_view prefix, string_view labels) const {
+        string out;
+        out.reserve(std::size(kMetrics) * 128);
+        string name;
+        for (auto& info : kMetrics) {
+            name = prefix;
+            name += '_';
+            name += info.name;
+            out += "# HELP " + name + ' ' + info.help + '\n';
+            out += "# TYPE " + name + (info.counter ? " counter\n" : " gauge\n");
+            out += name;
+            if (!labels.empty()) {
+                out += '{';
+                out += labels;
+                out += '}';
+            }
+            char value[24];
+            snprintf(value, sizeof(value), " %" PRId64 "\n", this->*info.field);
+            out += value;
+        }
+        return out;
+    }
+
+}
@@ -0,0 +1,356 @@
+// sqnice/page_cache.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/memory.hh"
+#include "sqnice/database.hh"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice::memory {
+    using namespace std;
+
+    // This implements SQLite's `sqlite3_pcache_methods2` interface. SQLite creates one cache per
+    // pager, i.e. per database file opened by a connection. A cache can't hand its pages to
+    // another connection -- the pager keeps its own state in each page's "extra" bytes, and
+    // modifies pages in place -- so instead of sharing pages, the caches share one byte budget.
+    // A cache that needs a page when the budget is used up takes the least-recently-used
+    // unpinned page of some cache, preferring caches that haven't been prioritized.
+
+    namespace {
+        struct page {
+            sqlite3_pcache_page base;                   // What SQLite sees; must come first
+            unsigned            key = 0;
+            bool                pinned = true;
+            page* _Nullable     lru_prev = nullptr;     // Toward more recently used
+            page* _Nullable     lru_next = nullptr;     // Toward less recently used
+            uint64_t            last_used = 0;
+        };
+
+        // The page buffer follows the `page` struct, and the extra bytes follow the buffer.
+        static_assert(sizeof(page) % 8 == 0);
+
+        struct cache {
+            cache(int page_size, int extra_size, bool purgeable)
+            :page_bytes(sizeof(page) + size_t(page_size) + size_t(extra_size))
+            ,page_size(page_size), extra_size(extra_size), purgeable(purgeable) { }
+
+            std::mutex                      mutex;      // Guards all the mutable members below
+            size_t const                    page_bytes;
+            int const                       page_size, extra_size;
+            bool const                      purgeable;
+            bool                            priority = false;
+            unordered_map<unsigned,page*>   pages;
+            page* _Nullable                 lru_head = nullptr;     // Most recently used
+            page* _Nullable                 lru_tail = nullptr;     // Least recently used
+        };
+
+        size_t              sBudget = 0;        // 0 if this cache isn't installed
+        atomic<size_t>      sUsed = 0;          // Bytes of pages of purgeable caches
+        atomic<uint64_t>    sHits = 0, sMisses = 0, sEvictions = 0, sClock = 0;
+        mutex               sMutex;             // Serializes eviction; guards `sCaches`
+        vector<cache*>      sCaches;
+
+        thread_local bool   tPrioritize = false;    // Set by `prioritize_cache`
+    }
+
+
+#pragma mark - PAGES:
+
+
+    // Callers of these functions must lock the cache's mutex.
+
+    static void lru_remove(cache* c, page* pg) {
+        (pg->lru_prev ? pg->lru_prev->lru_next : c->lru_head) = pg->lru_next;
+        (pg->lru_next ? pg->lru_next->lru_prev : c->lru_tail) = pg->lru_prev;
+        pg->lru_prev = pg->lru_next = nullptr;
+    }
+
+    static void lru_push(cache* c, page* pg) {
+        pg->last_used = sClock.fetch_add(1, memory_order_relaxed);
+        pg->lru_prev = nullptr;
+        pg->lru_next = c->lru_head;
+        (c->lru_head ? c->lru_head->lru_prev : c->lru_tail) = pg;
+        c->lru_head = pg;
+    }
+
+    static void free_page(cache* c, page* pg) {
+        if (c->purgeable)
+            sUsed -= c->page_bytes;
+        ::free(pg);
+    }
+
+    // Removes a page from its cache and frees it.
+    static void discard_page(cache* c, page* pg) {
+        if (!pg->pinned)
+            lru_remove(c, pg);
+        c->pages.erase(pg->key);
+        free_page(c, pg);
+    }
+
+    // Removes the least-recently-used unpinned page of the purgeable cache that most deserves
+    // to lose one, and returns it and its cache's page size. `sMutex` must be locked.
+    static page* _Nullable take_victim(size_t& victim_bytes) {
+        cache* victim = nullptr;
+        pair<bool,uint64_t> victim_rank;
+        for (cache* c : sCaches) {
+            if (!c->purgeable)
+                continue;
+            lock_guard lock(c->mutex);
+            if (page* tail = c->lru_tail) {
+                pair rank(c->priority, tail->last_used);
+                if (!victim || rank < victim_rank) {
+                    victim = c;
+                    victim_rank = rank;
+                }
+            }
+        }
+        if (!victim)
+            return nullptr;
+        lock_guard lock(victim->mutex);
+        page* pg = victim->lru_tail;
+        if (!pg)
+            return nullptr;     // (Its owner just pinned it again)
+        lru_remove(victim, pg);
+        victim->pages.erase(pg->key);
+        victim_bytes = victim->page_bytes;
+        sEvictions.fetch_add(1, memory_order_relaxed);
+        return pg;
+    }
+
+
+#pragma mark - PCACHE METHODS:
+
+
+    static int pc_init(void*)       {return SQLITE_OK;}
+    static void pc_shutdown(void*)  { }
+
+    static sqlite3_pcache* _Nullable pc_create(int page_size, int extra_size, int purgeable) {
+        auto c = new (nothrow) cache(page_size, extra_size, purgeable != 0);
+        if (c) {
+            try {
+                lock_guard lock(sMutex);
+                sCaches.push_back(c);
+            } catch (...) {
+                delete c;
+                return nullptr;
+            }
+        }
+        return (sqlite3_pcache*)c;
+    }
+
+    static void pc_cachesize(sqlite3_pcache* pcache, int) {
+        // Individual cache sizes are ignored; only the global budget matters. But
+        // `prioritize_cache` sets `cache_size`, which calls this on its thread.
+        if (tPrioritize) {
+            auto c = (cache*)pcache;
+            lock_guard lock(c->mutex);      // `take_victim` reads this on other threads
+            c->priority = true;
+        }
+    }
+
+    static int pc_pagecount(sqlite3_pcache* pcache) {
+        auto c = (cache*)pcache;
+        lock_guard lock(c->mutex);
+        return int(c->pages.size());
+    }
+
+    static sqlite3_pcache_page* _Nullable pc_fetch(sqlite3_pcache* pcache, unsigned key,
+                                                   int create_flag)
+    {
+        auto c = (cache*)pcache;
+        {
+            lock_guard lock(c->mutex);
+            if (auto i = c->pages.find(key); i != c->pages.end()) {
+                page* pg = i->second;
+                if (!pg->pinned) {
+                    lru_remove(c, pg);
+                    pg->pinned = true;
+                }
+                sHits.fetch_add(1, memory_order_relaxed);
+                return &pg->base;
+            }
+        }
+        if (create_flag == 0)
+            return nullptr;
+
+        // Allocating may evict a page from any cache, so it's serialized by `sMutex`. This
+        // cache's mutex isn't held, since `take_victim` locks every cache's.
+        page* pg = nullptr;
+        {
+            lock_guard lock(sMutex);
+            if (c->purgeable && sUsed + c->page_bytes > sBudget) {
+                size_t victim_bytes;
+                if (page* victim = take_victim(victim_bytes)) {
+                    if (victim_bytes == c->page_bytes) {
+                        pg = victim;            // Reuse its memory; `sUsed` is unchanged
+                    } else {
+                        sUsed -= victim_bytes;
+                        ::free(victim);
+                    }
+                } else if (create_flag == 1) {
+                    // SQLite will spill a dirty page to make room, then ask again with 2.
+                    return nullptr;
+                }
+            }
+            if (!pg) {
+                void* mem = ::malloc(c->page_bytes);
+                if (!mem)
+                    return nullptr;
+                if (c->purgeable)
+                    sUsed += c->page_bytes;
+                pg = (page*)mem;
+            }
+        }
+
+        new (pg) page;
+        pg->base.pBuf = (char*)pg + sizeof(page);
+        pg->base.pExtra = (char*)pg->base.pBuf + c->page_size;
+        memset(pg->base.pExtra, 0, size_t(c->extra_size));
+        pg->key = key;
+        sMisses.fetch_add(1, memory_order_relaxed);
+
+        lock_guard lock(c->mutex);
+        try {
+            c->pages.emplace(key, pg);
+        } catch (...) {
+            free_page(c, pg);
+            return nullptr;
+        }
+        return &pg->base;
+    }
+
+    static void pc_unpin(sqlite3_pcache* pcache, sqlite3_pcache_page* ppage, int discard) {
+        auto c = (cache*)pcache;
+        auto pg = (page*)ppage;
+        lock_guard lock(c->mutex);
+        if (discard || (c->purgeable && sUsed > sBudget)) {
+            discard_page(c, pg);
+        } else {
+            pg->pinned = false;
+            lru_push(c, pg);
+        }
+    }
+
+    static void pc_rekey(sqlite3_pcache* pcache, sqlite3_pcache_page* ppage,
+                         unsigned old_key, unsigned new_key)
+    {
+        auto c = (cache*)pcache;
+        lock_guard lock(c->mutex);
+        if (auto i = c->pages.find(new_key); i != c->pages.end())
+            discard_page(c, i->second);
+        auto node = c->pages.extract(old_key);      // (Reusing the node can't throw)
+        node.key() = new_key;
+        c->pages.insert(std::move(node));
+        ((page*)ppage)->key = new_key;
+    }
+
+    static void pc_truncate(sqlite3_pcache* pcache, unsigned limit) {
+        auto c = (cache*)pcache;
+        lock_guard lock(c->mutex);
+        for (auto i = c->pages.begin(); i != c->pages.end();) {
+            page* pg = i->second;
+            ++i;
+            if (pg->key >= limit)
+                discard_page(c, pg);
+        }
+    }
+
+    static void pc_shrink(sqlite3_pcache* pcache) {
+        auto c = (cache*)pcache;
+        lock_guard lock(c->mutex);
+        while (page* pg = c->lru_tail)
+            discard_page(c, pg);
+    }
+
+    static void pc_destroy(sqlite3_pcache* pcache) {
+        auto c = (cache*)pcache;
+        {
+            lock_guard lock(sMutex);
+            erase(sCaches, c);
+        }
+        for (auto& [key, pg] : c->pages)
+            free_page(c, pg);
+        delete c;
+    }
+
+
+#pragma mark - API:
+
+
+    // Called by `configure`.
+    status install_page_cache(size_t budget) {
+        static const sqlite3_pcache_methods2 kMethods = {
+            1, nullptr, pc_init, pc_shutdown, pc_create, pc_cachesize, pc_pagecount,
+            pc_fetch, pc_unpin, pc_rekey, pc_truncate, pc_destroy, pc_shrink
+        };
+        int rc = sqlite3_config(SQLITE_CONFIG_PCACHE2, &kMethods);
+        if (rc == SQLITE_OK)
+            sBudget = budget;
+        return status{rc};
+    }
+
+
+    page_cache_stats cache_stats() noexcept {
+        page_cache_stats result;
+        if (sBudget == 0)
+            return result;
+        result.budget = sBudget;
+        result.used = sUsed;
+        {
+            lock_guard lock(sMutex);
+            result.caches = sCaches.size();
+        }
+        result.hits = sHits.load(memory_order_relaxed);
+        result.misses = sMisses.load(memory_order_relaxed);
+        result.evictions = sEvictions.load(memory_order_relaxed);
+        return result;
+    }
+
+
+    void prioritize_cache(database& db) {
+        if (sBudget == 0)
+            return;
+        // Setting `cache_size` makes SQLite call `pc_cachesize` on this thread, for the main
+        // database's cache, which then sees `tPrioritize`.
+        struct flag_setter {
+            flag_setter()  {tPrioritize = true;}
+            ~flag_setter() {tPrioritize = false;}
+        } setter;
+        db.pragma("cache_size", db.pragma("cache_size"));
+    }
+
+}
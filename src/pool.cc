@@ -25,19 +25,51 @@
 
 
 #include "sqnice/pool.hh"
+#include <atomic>
 #include <cassert>
 
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
 namespace sqnice {
     using namespace std;
 
 
+    // Returns the filename a pool opens: for an in-memory pool, a `memdb` URI. A name starting
+    // with "/" makes memdb share the database between connections.
+    static string pool_filename(string_view dbname, open_flags flags) {
+        if (!(flags & open_flags::memory))
+            return string(dbname);
+        string name(dbname);
+        if (name.empty()) {
+            static atomic<unsigned> sCounter = 0;
+            name = "sqnice-pool-" + to_string(++sCounter);
+        }
+        if (!name.starts_with('/'))
+            name = "/" + name;
+        return "file:" + name + "?vfs=memdb";
+    }
+
+
     pool::pool(std::string_view dbname, open_flags flags, const char* vfs)
-    :_dbname(dbname)
+    :_dbname(pool_filename(dbname, flags))
     ,_vfs(vfs ? vfs : "")
     ,_flags(normalize(flags))
     {
-        if (!!(_flags & open_flags::temporary))
-            throw invalid_argument("pool does not support in-memory or temporary databases");
+        using enum open_flags;
+        if (!!(_flags & memory)) {
+            if (vfs)
+                throw invalid_argument("in-memory pool can't use a custom vfs");
+            _flags = (_flags - memory - temporary) | uri;
+            // memdb frees the database when its last connection closes, so keep one open:
+            _memory_anchor = make_unique<database>(_dbname, _flags);
+        } else if (!!(_flags & temporary)) {
+            throw invalid_argument("pool does not support temporary databases");
+        }
     }
 
 
@@ -60,8 +92,10 @@ namespace sqnice {
         _ro_capacity = newCapacity - 1;
         // Toss out any excess RO databases:
         int keep = std::max(0, int(_ro_capacity) - int(_ro_total - _readonly.size()));
-        while (_readonly.size() > keep)
+        while (_readonly.size() > keep) {
+            _retire(_readonly.back().get());
             _readonly.pop_back();
+        }
     }
 
 
@@ -71,6 +105,32 @@ namespace sqnice {
     }
 
 
+    void pool::set_auto_checkpoint(int pages) {
+        unique_lock lock(_mutex);
+        _auto_checkpoint = pages;
+        _writer_settings_pending = true;
+    }
+
+
+    int pool::auto_checkpoint() const {
+        unique_lock lock(_mutex);
+        return _auto_checkpoint;
+    }
+
+
+    void pool::set_writer_busy_timeout(int ms) {
+        unique_lock lock(_mutex);
+        _writer_busy_timeout = ms;
+        _writer_settings_pending = true;
+    }
+
+
+    int pool::writer_busy_timeout() const {
+        unique_lock lock(_mutex);
+        return _writer_busy_timeout;
+    }
+
+
     unsigned pool::open_count() const {
         unique_lock lock(_mutex);
         return _ro_total + _rw_total;
@@ -103,10 +163,181 @@ namespace sqnice {
     }
 
 
+    bool pool::with_all_closed(std::function<void()> const& fn, chrono::milliseconds timeout) {
+        unique_lock lock(_mutex);
+        // Waits for `pred`, until the deadline if there is one; returns false on timeout.
+        optional<chrono::steady_clock::time_point> deadline;
+        if (timeout != chrono::milliseconds::max())
+            deadline = chrono::steady_clock::now() + timeout;
+        auto wait = [&](auto pred) {
+            if (!deadline) {
+                _cond.wait(lock, pred);
+                return true;
+            }
+            return _cond.wait_until(lock, *deadline, pred);
+        };
+
+        if (!wait([&] { return !_suspended; }))
+            return false;
+        _suspended = true;
+        _close_unused();
+        if (!wait([&] { return _borrowed_count() == 0; })) {
+            _suspended = false;
+            _cond.notify_all();
+            return false;
+        }
+        _close_unused();
+        assert(_open_count() == 0);
+
+        // Call `fn` without holding the mutex; `_suspended` keeps databases from being borrowed.
+        lock.unlock();
+        try {
+            fn();
+        } catch (...) {
+            lock.lock();
+            _suspended = false;
+            _cond.notify_all();
+            throw;
+        }
+        lock.lock();
+        _suspended = false;
+        _cond.notify_all();
+        return true;
+    }
+
+
+    uint64_t pool::write_generation() const {
+        unique_lock lock(_mutex);
+        return _write_gen;
+    }
+
+
+    // Determines whether a connection is in a read transaction, and if possible the SQL of its
+    // active statement. This may be running on a different thread than the one using `db`.
+    static bool in_read_transaction(sqlite3* db, string& sql) {
+        bool active = !sqlite3_get_autocommit(db);
+        sqlite3_mutex* mutex = sqlite3_db_mutex(db);
+        if (!mutex)
+            return active;      // `nomutex` mode; not safe to look at its statements
+        if (sqlite3_mutex_try(mutex) != SQLITE_OK)
+            return true;        // Another thread is in a call, most likely stepping a statement
+        for (auto stmt = sqlite3_next_stmt(db, nullptr); stmt; stmt = sqlite3_next_stmt(db, stmt)) {
+            if (sqlite3_stmt_busy(stmt)) {
+                active = true;
+                if (char* expanded = sqlite3_expanded_sql(stmt)) {
+                    sql = expanded;
+                    sqlite3_free(expanded);
+                }
+                break;
+            }
+        }
+        sqlite3_mutex_leave(mutex);
+        return active;
+    }
+
+
+    vector<long_reader> pool::check_readers(chrono::milliseconds min_age,
+                                            long_reader_action action)
+    {
+        unique_lock lock(_mutex);
+        auto now = chrono::steady_clock::now();
+        vector<long_reader> result;
+        for (auto& [db, state] : _borrowed_readers) {
+            sqlite3* handle = db->handle();
+            if (!handle)
+                continue;
+            string sql;
+            if (!in_read_transaction(handle, sql)) {
+                state.txn_start = nullopt;
+                state.sql.clear();
+                continue;
+            }
+            if (!state.txn_start)
+                state.txn_start = now;
+            if (!sql.empty())
+                state.sql = std::move(sql);
+            if (auto age = now - *state.txn_start; age >= min_age) {
+                result.push_back({db, age, state.sql});
+                if (action != long_reader_action::report)
+                    sqlite3_interrupt(handle);
+                if (action == long_reader_action::recycle)
+                    state.recycle = true;
+            }
+        }
+        return result;
+    }
+
+
+    void add_connection_metrics(metrics_snapshot&, sqlite3*);  // in metrics.cc
+    void set_process_metrics(metrics_snapshot&);
+    void add_metrics(metrics_snapshot& dst, metrics_snapshot const& src, bool counters_only);
+
+
+    // Called just before the pool closes a connection: adds its counters to the running total,
+    // so they don't go backwards in `metrics`.
+    void pool::_retire(database const* db) {
+        metrics_snapshot m;
+        if (sqlite3* handle = db->handle())
+            add_connection_metrics(m, handle);
+        add_metrics(_retired_metrics, m, true);
+        _last_metrics.erase(db);
+    }
+
+
+    metrics_snapshot pool::metrics() const {
+        metrics_snapshot result;
+        unique_lock lock(_mutex);
+        add_metrics(result, _retired_metrics, true);
+        auto add = [&](database const* db, sqlite3* handle) {
+            metrics_snapshot m;
+            add_connection_metrics(m, handle);
+            add_metrics(result, m, false);
+            _last_metrics[db] = m;
+        };
+        for (auto& db : _readonly)
+            add(db.get(), db->handle());
+        if (_readwrite)
+            add(_readwrite.get(), _readwrite->handle());
+
+        // Borrowed databases are in use by other threads. `sqlite3_db_status` would block
+        // while one is running a query, so skip any whose mutex is held, reusing the counters
+        // last sampled from it.
+        auto add_borrowed = [&](database const* db) {
+            sqlite3* handle = db->handle();
+            sqlite3_mutex* mutex = handle ? sqlite3_db_mutex(handle) : nullptr;
+            if (mutex && sqlite3_mutex_try(mutex) == SQLITE_OK) {
+                add(db, handle);
+                sqlite3_mutex_leave(mutex);
+            } else {
+                ++result.connections_busy;
+                if (auto i = _last_metrics.find(db); i != _last_metrics.end())
+                    add_metrics(result, i->second, true);
+            }
+        };
+        for (auto& [db, state] : _borrowed_readers)
+            add_borrowed(db);
+        if (_borrowed_writer)
+            add_borrowed(_borrowed_writer);
+        lock.unlock();
+
+        set_process_metrics(result);
+        return result;
+    }
+
+
+    bool pool::writeable_wanted() const {
+        unique_lock lock(_mutex);
+        return _rw_waiters > 0;
+    }
+
+
     void pool::_close_unused() {
         _ro_total -= _readonly.size();
+        for (auto& db : _readonly)
+            _retire(db.get());
         _readonly.clear();
         if (_readwrite) {
+            _retire(_readwrite.get());
             _readwrite = nullptr;
             _rw_total = 0;
         }
@@ -115,23 +346,49 @@ namespace sqnice {
 
     // Allocates a new database.
     unique_ptr<database> pool::new_db(bool writeable) {
+        auto db = open_db(_flags, writeable, _initializer);
+        _flags = _flags - open_flags::delete_first; // definitely don't want to do that twice!
+        if (writeable)
+            _writer_settings_pending = true;
+        return db;
+    }
+
+
+    // Opens a database with the pool's path and vfs, and calls the initializer.
+    // Doesn't access any mutable state, so the mutex needn't be locked.
+    unique_ptr<database> pool::open_db(open_flags flags, bool writeable,
+                                       function<void(database&)> const& initializer) const
+    {
         using enum open_flags;
-        auto flags = _flags;
         if (!writeable)
             flags = flags - readwrite - create;
         auto db = make_unique<database>(_dbname, flags, (_vfs.empty() ? nullptr : _vfs.c_str()));
-        _flags = _flags - delete_first; // definitely don't want to do that twice!
-        if (_initializer)
-            _initializer(*db);
+        if (_memory_anchor) {
+            // memdb has no WAL, so a commit has to wait for readers to finish:
+            db->set_busy_timeout(5000);
+        }
+        if (initializer)
+            initializer(*db);
         return db;
     }
 
 
+    unique_ptr<database> pool::open_connection(bool writeable) const {
+        unique_lock lock(_mutex);
+        auto flags = _flags - open_flags::delete_first;
+        auto initializer = _initializer;
+        lock.unlock();
+        return open_db(flags, writeable, initializer);
+    }
+
+
     borrowed_database pool::borrow(bool or_wait) {
         unique_lock lock(_mutex);
         while(true) {
             unique_ptr<const database> dbp;
-            if (!_readonly.empty()) {
+            if (_suspended) {
+                // `with_all_closed` is running; fall through to wait
+            } else if (!_readonly.empty()) {
                 dbp = std::move(_readonly.back());
                 _readonly.pop_back();
             } else if (_ro_total < _ro_capacity) {
@@ -140,6 +397,7 @@ namespace sqnice {
             }
             if (dbp) {
                 dbp->set_borrowed(true);
+                _borrowed_readers.emplace(dbp.get(), reader_state{});
                 return borrowed_database(dbp.release(), *this);
             } else if (!or_wait) {
                 return {nullptr, *this};
@@ -155,22 +413,38 @@ namespace sqnice {
             throw logic_error("no writeable database available");
         unique_lock lock(_mutex);
         unique_ptr<database> dbp;
-        if (_rw_total == 0) {
-            // First-time creation of the writeable db:
-            dbp = new_db(true);
-            if (!dbp->is_writeable()) {
-                throw database_error("database file is not writeable", status::locked);
+        while (true) {
+            if (_suspended) {
+                // `with_all_closed` is running; wait below
+            } else if (_rw_total == 0) {
+                // First-time creation of the writeable db:
+                dbp = new_db(true);
+                if (!dbp->is_writeable()) {
+                    throw database_error("database file is not writeable", status::locked);
+                }
+                ++_rw_total;
+                break;
+            } else if (_readwrite) {
+                dbp = std::move(_readwrite);
+                break;
+            }
+            if (!or_wait) {
+                // db isn't available and `or_wait` is false, so return null:
+                return borrowed_writeable_database{nullptr, *this};
             }
-            ++_rw_total;
-        } else if (_readwrite || or_wait) {
-            // Get the db, waiting if necessary:
-            _cond.wait(lock, [&] {return _readwrite != nullptr;});
-            dbp = std::move(_readwrite);
-        } else {
-            // db isn't available and `or_wait` is false, so return null:
-            return borrowed_writeable_database{nullptr, *this};
+            ++_rw_waiters;
+            _cond.wait(lock);
+            --_rw_waiters;
+        }
+        if (_writer_settings_pending) {
+            if (_auto_checkpoint >= 0)
+                dbp->pragma("wal_autocheckpoint", _auto_checkpoint);
+            if (_writer_busy_timeout >= 0)
+                dbp->set_busy_timeout(_writer_busy_timeout);
+            _writer_settings_pending = false;
         }
         dbp->set_borrowed(true);
+        _borrowed_writer = dbp.get();
         return borrowed_writeable_database(dbp.release(), *this);
     }
 
@@ -182,14 +456,20 @@ namespace sqnice {
             unique_lock lock(_mutex);
             assert(!dbp->is_writeable());
             assert(_readonly.size() < _ro_total);
-            if (_ro_total <= _ro_capacity) {
+            auto i = _borrowed_readers.find(dbp);
+            bool recycle = (i != _borrowed_readers.end() && i->second.recycle);
+            if (i != _borrowed_readers.end())
+                _borrowed_readers.erase(i);
+            if (_ro_total <= _ro_capacity && !recycle) {
                 _readonly.emplace_back(dbp);
-                _cond.notify_all();
             } else {
-                // Toss out a DB if capacity was lowered after it was checked out:
+                // Toss out a DB if capacity was lowered after it was checked out,
+                // or if `check_readers` marked it to be recycled:
+                _retire(dbp);
                 delete dbp;
                 --_ro_total;
             }
+            _cond.notify_all();
         }
     }
 
@@ -204,6 +484,8 @@ namespace sqnice {
             assert(_rw_total == 1);
             assert(!_readwrite);
             _readwrite.reset(const_cast<database*>(dbp));
+            _borrowed_writer = nullptr;
+            ++_write_gen;
             _cond.notify_all();
         }
     }
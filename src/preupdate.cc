@@ -0,0 +1,396 @@
+// sqnice/preupdate.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/preupdate.hh"
+#include <cstring>
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice {
+    using namespace std;
+
+#ifdef SQLITE_ENABLE_PREUPDATE_HOOK
+
+#pragma mark - PREUPDATE HOOK:
+
+
+    preupdate_change::preupdate_change(sqlite3* db, int op, const char* dbname,
+                                       const char* table, int64_t old_rowid,
+                                       int64_t new_rowid) noexcept
+    :db_(db)
+    ,op_(change_op(op))
+    ,dbname_(dbname)
+    ,table_(table)
+    ,old_rowid_(old_rowid)
+    ,new_rowid_(new_rowid)
+    { }
+
+    int preupdate_change::column_count() const noexcept {return sqlite3_preupdate_count(db_);}
+    int preupdate_change::depth() const noexcept        {return sqlite3_preupdate_depth(db_);}
+
+    arg_value preupdate_change::old_value(int column) const {
+        sqlite3_value* value = nullptr;
+        if (int rc = sqlite3_preupdate_old(db_, column, &value); rc != SQLITE_OK)
+            checking::raise(status{rc}, "can't get old column value");
+        return arg_value(value);
+    }
+
+    arg_value preupdate_change::new_value(int column) const {
+        sqlite3_value* value = nullptr;
+        if (int rc = sqlite3_preupdate_new(db_, column, &value); rc != SQLITE_OK)
+            checking::raise(status{rc}, "can't get new column value");
+        return arg_value(value);
+    }
+
+
+    preupdate_hook::preupdate_hook(database& db, handler h)
+    :db_(db)
+    ,handler_(std::move(h))
+    {
+        sqlite3_preupdate_hook(db_.check_handle(), callback, this);
+    }
+
+    preupdate_hook::~preupdate_hook() {
+        if (auto handle = db_.handle())
+            sqlite3_preupdate_hook(handle, nullptr, nullptr);
+    }
+
+    void preupdate_hook::callback(void* ctx, sqlite3* db, int op, const char* dbname,
+                                  const char* table, long long old_rowid,
+                                  long long new_rowid) noexcept
+    {
+        auto self = static_cast<preupdate_hook*>(ctx);
+        try {
+            self->handler_(preupdate_change(db, op, dbname, table, old_rowid, new_rowid));
+        } catch (std::exception const& x) {
+            checking::log_warning("exception in preupdate hook: %s", x.what());
+        }
+    }
+
+
+#pragma mark - AUDIT RECORDER:
+
+
+    // Tags of encoded values. (The first five are equal to SQLite's fundamental datatypes.)
+    static constexpr uint8_t kUnchangedTag = 0;
+
+
+    static void put_byte(vector<byte>& out, uint8_t b) {
+        out.push_back(byte{b});
+    }
+
+    static void put_varint(vector<byte>& out, uint64_t n) {
+        while (n >= 0x80) {
+            put_byte(out, uint8_t(n) | 0x80);
+            n >>= 7;
+        }
+        put_byte(out, uint8_t(n));
+    }
+
+    static void put_bytes(vector<byte>& out, const void* _Nullable data, size_t size) {
+        put_varint(out, size);
+        auto bytes = static_cast<const byte*>(data);
+        if (size > 0)
+            out.insert(out.end(), bytes, bytes + size);
+    }
+
+    static uint64_t zigzag(int64_t n)   {return (uint64_t(n) << 1) ^ uint64_t(n >> 63);}
+    static int64_t unzigzag(uint64_t n) {return int64_t(n >> 1) ^ -int64_t(n & 1);}
+
+    static void put_value(vector<byte>& out, sqlite3_value* value) {
+        int type = sqlite3_value_type(value);
+        put_byte(out, uint8_t(type));
+        switch (type) {
+            case SQLITE_INTEGER:
+                put_varint(out, zigzag(sqlite3_value_int64(value)));
+                break;
+            case SQLITE_FLOAT: {
+                double d = sqlite3_value_double(value);
+                auto bytes = reinterpret_cast<const byte*>(&d);
+                out.insert(out.end(), bytes, bytes + sizeof(d));
+                break;
+            }
+            case SQLITE_TEXT: {
+                auto text = sqlite3_value_text(value);
+                put_bytes(out, text, size_t(sqlite3_value_bytes(value)));
+                break;
+            }
+            case SQLITE_BLOB: {
+                auto data = sqlite3_value_blob(value);
+                put_bytes(out, data, size_t(sqlite3_value_bytes(value)));
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // True if two values are identical, so a new value needn't be recorded.
+    static bool same_value(sqlite3_value* a, sqlite3_value* b) {
+        int type = sqlite3_value_type(a);
+        if (type != sqlite3_value_type(b))
+            return false;
+        switch (type) {
+            case SQLITE_INTEGER:
+                return sqlite3_value_int64(a) == sqlite3_value_int64(b);
+            case SQLITE_FLOAT: {
+                double da = sqlite3_value_double(a), db = sqlite3_value_double(b);
+                return memcmp(&da, &db, sizeof(da)) == 0;
+            }
+            case SQLITE_TEXT:
+            case SQLITE_BLOB: {
+                const void* pa = (type == SQLITE_TEXT) ? (const void*)sqlite3_value_text(a)
+                                                       : sqlite3_value_blob(a);
+                const void* pb = (type == SQLITE_TEXT) ? (const void*)sqlite3_value_text(b)
+                                                       : sqlite3_value_blob(b);
+                int size = sqlite3_value_bytes(a);
+                return size == sqlite3_value_bytes(b) && (size == 0 || memcmp(pa, pb, size) == 0);
+            }
+            default:
+                return true;
+        }
+    }
+
+
+    audit_recorder::audit_recorder(database& db, flush_handler flush)
+    :db_(db)
+    ,flush_(std::move(flush))
+    {
+        hook_.emplace(db_, [this](preupdate_change const& change) {
+            record(change);
+        });
+        db_.set_commit_handler([this] {
+            return committed();
+        });
+        db_.set_rollback_handler([this] {
+            rolled_back();
+        });
+    }
+
+
+    audit_recorder::~audit_recorder() {
+        db_.set_commit_handler(nullptr);
+        db_.set_rollback_handler(nullptr);
+    }
+
+
+    void audit_recorder::record(preupdate_change const& change) {
+        sqlite3* db = db_.handle();
+        size_t start = arena_.size();
+        try {
+            auto op = change.op();
+            put_byte(arena_, uint8_t(op));
+            if (change.database_name() != "main") {
+                string name(change.database_name());
+                name += '.';
+                name += change.table();
+                put_bytes(arena_, name.data(), name.size());
+            } else {
+                put_bytes(arena_, change.table().data(), change.table().size());
+            }
+            if (op != change_op::insert)
+                put_varint(arena_, zigzag(change.old_rowid()));
+            if (op != change_op::remove)
+                put_varint(arena_, zigzag(change.new_rowid()));
+            int ncols = change.column_count();
+            put_varint(arena_, uint64_t(ncols));
+            for (int i = 0; i < ncols; ++i) {
+                sqlite3_value *old_value = nullptr, *new_value = nullptr;
+                if (op != change_op::insert)
+                    sqlite3_preupdate_old(db, i, &old_value);
+                if (op != change_op::remove)
+                    sqlite3_preupdate_new(db, i, &new_value);
+                if (old_value)
+                    put_value(arena_, old_value);
+                if (new_value) {
+                    if (old_value && same_value(old_value, new_value))
+                        put_byte(arena_, kUnchangedTag);
+                    else
+                        put_value(arena_, new_value);
+                }
+            }
+            ++count_;
+        } catch (...) {
+            // Out of memory: drop the partial record, and make the commit fail
+            arena_.resize(start);
+            failed_ = true;
+        }
+    }
+
+
+    // Commit hook. Returning true turns the commit into a rollback.
+    bool audit_recorder::committed() {
+        if (failed_) {
+            checking::log_warning("audit_recorder failed to record a change; rolling back");
+            rolled_back();
+            return true;
+        }
+        if (count_ > 0) {
+            try {
+                flush_(span<const byte>(arena_), count_);
+                flushed_ += count_;
+            } catch (std::exception const& x) {
+                checking::log_warning("exception flushing audit records: %s", x.what());
+            }
+        }
+        rolled_back();
+        return false;
+    }
+
+
+    void audit_recorder::rolled_back() noexcept {
+        arena_.clear();     // keeps its capacity, so the next transaction doesn't reallocate
+        count_ = 0;
+        failed_ = false;
+    }
+
+
+#pragma mark - DECODING:
+
+
+    namespace {
+        // Reads values from an encoded audit record.
+        struct decoder {
+            span<const byte> in;
+
+            [[noreturn]] static void corrupt() {
+                checking::raise(status::corrupt, "invalid audit record data");
+            }
+
+            uint8_t get_byte() {
+                if (in.empty())
+                    corrupt();
+                auto b = uint8_t(in[0]);
+                in = in.subspan(1);
+                return b;
+            }
+
+            uint64_t get_varint() {
+                uint64_t n = 0;
+                for (int shift = 0; shift < 64; shift += 7) {
+                    uint8_t b = get_byte();
+                    n |= uint64_t(b & 0x7F) << shift;
+                    if (!(b & 0x80))
+                        return n;
+                }
+                corrupt();
+            }
+
+            span<const byte> get_bytes() {
+                uint64_t size = get_varint();
+                if (size > in.size())
+                    corrupt();
+                auto result = in.first(size_t(size));
+                in = in.subspan(size_t(size));
+                return result;
+            }
+
+            string_view get_string() {
+                auto bytes = get_bytes();
+                return {reinterpret_cast<const char*>(bytes.data()), bytes.size()};
+            }
+
+            optional<audit_value> get_value() {
+                switch (get_byte()) {
+                    case kUnchangedTag:  return nullopt;
+                    case SQLITE_INTEGER: return int64_t(unzigzag(get_varint()));
+                    case SQLITE_FLOAT: {
+                        if (in.size() < sizeof(double))
+                            corrupt();
+                        double d;
+                        memcpy(&d, in.data(), sizeof(d));
+                        in = in.subspan(sizeof(d));
+                        return d;
+                    }
+                    case SQLITE_TEXT:    return get_string();
+                    case SQLITE_BLOB:    return blob(get_bytes());
+                    case SQLITE_NULL:    return nullptr;
+                    default:             corrupt();
+                }
+            }
+        };
+    }
+
+
+    void decode_audit_records(span<const byte> records,
+                              function<void(audit_record const&)> const& fn)
+    {
+        decoder in{records};
+        audit_record rec;
+        while (!in.in.empty()) {
+            rec.op = change_op(in.get_byte());
+            rec.table = in.get_string();
+            rec.old_rowid = (rec.op != change_op::insert) ? unzigzag(in.get_varint()) : 0;
+            rec.new_rowid = (rec.op != change_op::remove) ? unzigzag(in.get_varint()) : 0;
+            auto ncols = in.get_varint();
+            if (ncols > in.in.size())
+                decoder::corrupt();
+            rec.old_values.clear();
+            rec.new_values.clear();
+            for (uint64_t i = 0; i < ncols; ++i) {
+                if (rec.op != change_op::insert) {
+                    auto value = in.get_value();
+                    if (!value)
+                        decoder::corrupt();
+                    rec.old_values.push_back(*value);
+                }
+                if (rec.op != change_op::remove)
+                    rec.new_values.push_back(in.get_value());
+            }
+            fn(rec);
+        }
+    }
+
+#else // SQLITE_ENABLE_PREUPDATE_HOOK
+
+    static constexpr const char* kNoPreupdate = "SQLite was built without the preupdate hook";
+
+    preupdate_hook::preupdate_hook(database& db, handler)
+    :db_(db)
+    {
+        throw database_error(kNoPreupdate);
+    }
+
+    preupdate_hook::~preupdate_hook() = default;
+
+    audit_recorder::audit_recorder(database& db, flush_handler)
+    :db_(db)
+    {
+        throw database_error(kNoPreupdate);
+    }
+
+    audit_recorder::~audit_recorder() = default;
+
+    void decode_audit_records(span<const byte>, function<void(audit_record const&)> const&) {
+        throw database_error(kNoPreupdate);
+    }
+
+#endif // SQLITE_ENABLE_PREUPDATE_HOOK
+}
@@ -0,0 +1,127 @@
+// sqnice/ring_buffer.hh
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+#ifndef SQNICE_RING_BUFFER_H
+#define SQNICE_RING_BUFFER_H
+
+#include "sqnice/base.hh"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+
+ASSUME_NONNULL_BEGIN
+
+namespace sqnice {
+
+    /** A bounded lock-free queue, usable by any number of producer and consumer threads.
+        This is Dmitry Vyukov's bounded MPMC queue: each slot has a sequence number that tells
+        producers and consumers whether it's free or full, so they only contend on the head or
+        tail index, never on a lock.
+
+        `push` fails instead of blocking when the queue is full; `pop` fails when it's empty. */
+    template <class T>
+    class ring_buffer {
+    public:
+        /// Constructs a queue. The capacity is rounded up to a power of two.
+        explicit ring_buffer(size_t capacity)
+        :mask_(std::bit_ceil(std::max(capacity, size_t(2))) - 1)
+        ,slots_(new slot[mask_ + 1])
+        {
+            for (size_t i = 0; i <= mask_; ++i)
+                slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+
+        size_t capacity() const noexcept        {return mask_ + 1;}
+
+        /// Adds an item to the tail of the queue. Returns false if the queue is full.
+        bool push(T&& item) {
+            size_t pos = tail_.load(std::memory_order_relaxed);
+            while (true) {
+                slot& s = slots_[pos & mask_];
+                size_t seq = s.seq.load(std::memory_order_acquire);
+                auto diff = intptr_t(seq) - intptr_t(pos);
+                if (diff == 0) {
+                    // Slot is free; claim it by advancing the tail:
+                    if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        s.value = std::move(item);
+                        s.seq.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;   // Slot hasn't been consumed yet: full
+                } else {
+                    pos = tail_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /// Removes the item at the head of the queue. Returns `nullopt` if the queue is empty.
+        std::optional<T> pop() {
+            size_t pos = head_.load(std::memory_order_relaxed);
+            while (true) {
+                slot& s = slots_[pos & mask_];
+                size_t seq = s.seq.load(std::memory_order_acquire);
+                auto diff = intptr_t(seq) - intptr_t(pos + 1);
+                if (diff == 0) {
+                    // Slot is full; claim it by advancing the head:
+                    if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        std::optional<T> result(std::move(s.value));
+                        s.value = T{};
+                        s.seq.store(pos + mask_ + 1, std::memory_order_release);
+                        return result;
+                    }
+                } else if (diff < 0) {
+                    return std::nullopt;    // Slot hasn't been filled yet: empty
+                } else {
+                    pos = head_.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+    private:
+        // Keep the indexes on separate cache lines so producers and consumers don't false-share.
+        static constexpr size_t kLineSize = 64;
+
+        struct slot {
+            std::atomic<size_t> seq;
+            T                   value {};
+        };
+
+        size_t const                        mask_;
+        std::unique_ptr<slot[]> const       slots_;
+        alignas(kLineSize) std::atomic<size_t> tail_ {0};
+        alignas(kLineSize) std::atomic<size_t> head_ {0};
+    };
+
+}
+
+ASSUME_NONNULL_END
+
+#endif
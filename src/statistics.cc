@@ -0,0 +1,383 @@
+// sqnice/statistics.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/statistics.hh"
+#include "sqnice/functions.hh"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace sqnice {
+    using namespace std;
+
+    namespace {
+
+#pragma mark - SUM & MEAN:
+
+
+        // Kahan-Babuška (Neumaier) compensated summation.
+        struct kahan_sum_agg {
+            double  sum_ = 0, compensation_ = 0;
+            int64_t count_ = 0;
+
+            void add(double x) {
+                double t = sum_ + x;
+                if (std::abs(sum_) >= std::abs(x))
+                    compensation_ += (sum_ - t) + x;
+                else
+                    compensation_ += (x - t) + sum_;
+                sum_ = t;
+            }
+
+            void step(arg_value const& arg) {
+                if (arg.not_null()) {
+                    add(arg.get<double>());
+                    ++count_;
+                }
+            }
+
+            void inverse(arg_value const& arg) {
+                if (arg.not_null()) {
+                    add(-arg.get<double>());
+                    --count_;
+                }
+            }
+
+            optional<double> value() const {
+                if (count_ == 0)
+                    return nullopt;
+                return sum_ + compensation_;
+            }
+            optional<double> finish() const     {return value();}
+        };
+
+
+        struct mean_agg : kahan_sum_agg {
+            optional<double> value() const {
+                if (count_ == 0)
+                    return nullopt;
+                return (sum_ + compensation_) / double(count_);
+            }
+            optional<double> finish() const     {return value();}
+        };
+
+
+#pragma mark - VARIANCE:
+
+
+        // Welford's online algorithm, extended to support removing values for window functions.
+        template <bool Sample, bool Root>
+        struct variance_agg {
+            int64_t n_ = 0;
+            double  mean_ = 0, m2_ = 0;
+
+            void step(arg_value const& arg) {
+                if (arg.not_null()) {
+                    double x = arg.get<double>(), delta = x - mean_;
+                    ++n_;
+                    mean_ += delta / double(n_);
+                    m2_ += delta * (x - mean_);
+                }
+            }
+
+            void inverse(arg_value const& arg) {
+                if (arg.not_null()) {
+                    if (n_ <= 1) {
+                        *this = {};
+                        return;
+                    }
+                    double x = arg.get<double>(), delta = x - mean_;
+                    --n_;
+                    mean_ -= delta / double(n_);
+                    m2_ = std::max(0.0, m2_ - delta * (x - mean_));
+                }
+            }
+
+            optional<double> value() const {
+                int64_t divisor = Sample ? n_ - 1 : n_;
+                if (divisor <= 0)
+                    return nullopt;
+                double v = m2_ / double(divisor);
+                return Root ? std::sqrt(v) : v;
+            }
+            optional<double> finish() const     {return value();}
+        };
+
+
+#pragma mark - MEDIAN:
+
+
+        // Exact median. Keeps all the values, then uses a selection algorithm instead of sorting.
+        struct median_agg {
+            vector<double> values_;
+
+            void step(arg_value const& arg) {
+                if (arg.not_null())
+                    values_.push_back(arg.get<double>());
+            }
+
+            optional<double> finish() {
+                if (values_.empty())
+                    return nullopt;
+                auto mid = values_.begin() + values_.size() / 2;
+                std::nth_element(values_.begin(), mid, values_.end());
+                double hi = *mid;
+                if (values_.size() % 2)
+                    return hi;
+                double lo = *std::max_element(values_.begin(), mid);
+                return lo + (hi - lo) / 2;
+            }
+        };
+
+
+#pragma mark - APPROXIMATE QUANTILE:
+
+
+        // A KLL quantile sketch (Karnin, Lang & Liberty, 2016). Level `h` holds items of weight
+        // 2^h; when a level fills up it's sorted and every other item is promoted to the next
+        // level. Lower levels get geometrically smaller capacities, so the total size is bounded
+        // by about 3k items no matter how many values are added.
+        class kll_sketch {
+        public:
+            void add(double x) {
+                if (levels_.empty())
+                    levels_.emplace_back();
+                levels_[0].push_back(x);
+                if (levels_[0].size() >= capacity(0))
+                    compress();
+            }
+
+            bool empty() const                  {return levels_.empty();}
+
+            double quantile(double q) const {
+                vector<pair<double,uint64_t>> items;
+                uint64_t total = 0;
+                for (size_t h = 0; h < levels_.size(); ++h) {
+                    for (double x : levels_[h])
+                        items.emplace_back(x, uint64_t(1) << h);
+                    total += levels_[h].size() << h;
+                }
+                std::sort(items.begin(), items.end());
+                double target = std::clamp(q, 0.0, 1.0) * double(total);
+                uint64_t cumulative = 0;
+                for (auto [x, weight] : items) {
+                    cumulative += weight;
+                    if (double(cumulative) >= target)
+                        return x;
+                }
+                return items.back().first;
+            }
+
+        private:
+            static constexpr size_t kK = 200;           // Capacity of the top level
+
+            size_t capacity(size_t level) const {
+                static constexpr auto kCapacities = [] {
+                    array<uint16_t, 64> caps {};
+                    double c = kK;
+                    for (auto& cap : caps) {
+                        cap = uint16_t(std::max(c, 8.0));
+                        c *= 2.0 / 3.0;
+                    }
+                    return caps;
+                }();
+                return kCapacities[std::min(levels_.size() - level - 1, kCapacities.size() - 1)];
+            }
+
+            void compress() {
+                // Only the level just added to can overflow, so stop at the first one that fits.
+                for (size_t h = 0; h < levels_.size(); ++h) {
+                    if (levels_[h].size() < capacity(h))
+                        break;
+                    if (h + 1 == levels_.size())
+                        levels_.emplace_back();
+                    auto& level = levels_[h];
+                    auto& above = levels_[h + 1];
+                    std::sort(level.begin(), level.end());
+                    optional<double> odd_one;
+                    if (level.size() % 2) {
+                        odd_one = level.back();
+                        level.pop_back();
+                    }
+                    for (size_t i = coin_flip(); i < level.size(); i += 2)
+                        above.push_back(level[i]);
+                    level.clear();
+                    if (odd_one)
+                        level.push_back(*odd_one);
+                }
+            }
+
+            // A xorshift PRNG; deterministic, so query results are repeatable.
+            unsigned coin_flip() {
+                rng_ ^= rng_ << 13;
+                rng_ ^= rng_ >> 17;
+                rng_ ^= rng_ << 5;
+                return rng_ & 1;
+            }
+
+            vector<vector<double>>  levels_;
+            uint32_t                rng_ = 0x9E3779B9;
+        };
+
+
+        struct approx_quantile_agg {
+            kll_sketch sketch_;
+            double     q_ = 0.5;
+
+            void step(arg_value const& arg, double q) {
+                if (arg.not_null()) {
+                    sketch_.add(arg.get<double>());
+                    q_ = q;
+                }
+            }
+
+            optional<double> finish() const {
+                if (sketch_.empty())
+                    return nullopt;
+                return sketch_.quantile(q_);
+            }
+        };
+
+
+#pragma mark - APPROXIMATE COUNT DISTINCT:
+
+
+        // MurmurHash3's 64-bit finalizer; scrambles the bits of `h`.
+        inline uint64_t fmix64(uint64_t h) {
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        // FNV-1a, followed by `fmix64` since FNV's high bits are weak.
+        inline uint64_t hash_bytes(const void* data, size_t size, uint64_t seed) {
+            uint64_t h = 0xcbf29ce484222325ull ^ seed;
+            for (auto p = static_cast<const uint8_t*>(data), end = p + size; p != end; ++p)
+                h = (h ^ *p) * 0x100000001b3ull;
+            return fmix64(h);
+        }
+
+        // Hashes a value so that values SQL considers equal (like 1 and 1.0) hash equal.
+        uint64_t hash_value(arg_value const& arg) {
+            switch (arg.type()) {
+                case data_type::integer:
+                    return fmix64(uint64_t(arg.get<int64_t>()));
+                case data_type::floating_point: {
+                    double d = arg.get<double>();
+                    if (d == std::trunc(d) && std::abs(d) < 9.2e18)
+                        return fmix64(uint64_t(int64_t(d)));
+                    uint64_t bits;
+                    memcpy(&bits, &d, sizeof(bits));
+                    return fmix64(bits ^ 0x5555555555555555ull);
+                }
+                case data_type::text: {
+                    auto str = arg.get<string_view>();
+                    return hash_bytes(str.data(), str.size(), 1);
+                }
+                default: {
+                    auto b = arg.get<blob>();
+                    return hash_bytes(b.data, b.size, 2);
+                }
+            }
+        }
+
+
+        // HyperLogLog (Flajolet et al, 2007) with 2^12 one-byte registers.
+        struct approx_count_distinct_agg {
+            static constexpr unsigned kPrecision = 12;
+            static constexpr size_t   kRegisters = size_t(1) << kPrecision;
+
+            array<uint8_t, kRegisters> registers_ {};
+
+            void step(arg_value const& arg) {
+                if (arg.not_null()) {
+                    uint64_t h = hash_value(arg);
+                    size_t index = h >> (64 - kPrecision);
+                    // Rank is the position of the first 1 bit after the index bits. The OR'd-in
+                    // sentinel bit caps it, in case the remaining bits are all zero.
+                    uint64_t rest = (h << kPrecision) | (uint64_t(1) << (kPrecision - 1));
+                    auto rank = uint8_t(std::countl_zero(rest) + 1);
+                    registers_[index] = std::max(registers_[index], rank);
+                }
+            }
+
+            int64_t finish() const {
+                constexpr double m = kRegisters;
+                constexpr double alpha = 0.7213 / (1.0 + 1.079 / m);
+                double sum = 0;
+                unsigned zeros = 0;
+                for (uint8_t r : registers_) {
+                    sum += std::ldexp(1.0, -int(r));
+                    zeros += (r == 0);
+                }
+                if (zeros == kRegisters)
+                    return 0;
+                double estimate = alpha * m * m / sum;
+                if (estimate <= 2.5 * m && zeros > 0)
+                    estimate = m * std::log(m / zeros);     // small-range correction
+                return std::llround(estimate);
+            }
+        };
+
+    } // namespace
+
+
+#pragma mark - REGISTRATION:
+
+
+    status register_statistics(database& db) {
+        constexpr auto flags = function_flags::deterministic | function_flags::innocuous;
+        using P = arg_value const&;
+        status rc = db.create_window_function<kahan_sum_agg, P>("kahan_sum", flags);
+        if (ok(rc))
+            rc = db.create_window_function<mean_agg, P>("mean", flags);
+        if (ok(rc))
+            rc = db.create_window_function<variance_agg<true,false>, P>("var_samp", flags);
+        if (ok(rc))
+            rc = db.create_window_function<variance_agg<true,false>, P>("variance", flags);
+        if (ok(rc))
+            rc = db.create_window_function<variance_agg<false,false>, P>("var_pop", flags);
+        if (ok(rc))
+            rc = db.create_window_function<variance_agg<true,true>, P>("stddev_samp", flags);
+        if (ok(rc))
+            rc = db.create_window_function<variance_agg<true,true>, P>("stddev", flags);
+        if (ok(rc))
+            rc = db.create_window_function<variance_agg<false,true>, P>("stddev_pop", flags);
+        if (ok(rc))
+            rc = db.create_aggregate<median_agg, P>("median", flags);
+        if (ok(rc))
+            rc = db.create_aggregate<approx_quantile_agg, P, double>("approx_quantile", flags);
+        if (ok(rc))
+            rc = db.create_aggregate<approx_count_distinct_agg, P>("approx_count_distinct", flags);
+        return rc;
+    }
+
+}
@@ -0,0 +1,101 @@
+// sqnice/template_cache.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "sqnice/template_cache.hh"
+#include <stdexcept>
+
+namespace sqnice {
+    using namespace std;
+
+
+    template_cache::image_ref template_cache::make_image(initializer const& init) {
+        database db;
+        db.open_temporary();
+        init(db);
+        return make_shared<const database_image>(db.serialize());
+    }
+
+
+    void template_cache::add(string_view name, initializer const& init) {
+        auto image = make_image(init);
+        unique_lock lock(mutex_);
+        images_.insert_or_assign(string(name), std::move(image));
+    }
+
+
+    void template_cache::add(string_view name, database const& source) {
+        auto image = make_shared<const database_image>(source.serialize());
+        unique_lock lock(mutex_);
+        images_.insert_or_assign(string(name), std::move(image));
+    }
+
+
+    bool template_cache::contains(string_view name) const {
+        return find(name) != nullptr;
+    }
+
+
+    void template_cache::remove(string_view name) {
+        unique_lock lock(mutex_);
+        if (auto i = images_.find(name); i != images_.end())
+            images_.erase(i);
+    }
+
+
+    template_cache::image_ref template_cache::find(string_view name) const {
+        unique_lock lock(mutex_);
+        auto i = images_.find(name);
+        return (i != images_.end()) ? i->second : nullptr;
+    }
+
+
+    database template_cache::clone(database_image const& image) {
+        database db;
+        db.deserialize(image.bytes());
+        return db;
+    }
+
+
+    database template_cache::clone(string_view name) const {
+        auto image = find(name);
+        if (!image)
+            throw invalid_argument("no such database template");
+        return clone(*image);
+    }
+
+
+    database template_cache::clone(string_view name, initializer const& init) {
+        auto image = find(name);
+        if (!image) {
+            // Build the image without holding the lock; if another thread beat us to it, use
+            // its image instead.
+            auto new_image = make_image(init);
+            unique_lock lock(mutex_);
+            image = images_.try_emplace(string(name), std::move(new_image)).first->second;
+        }
+        return clone(*image);
+    }
+
+}
@@ -0,0 +1,252 @@
+// sqnice/virtual_table.cc
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+// Copyright (c) 2024 Jens Alfke (Github: snej)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "sqnice/virtual_table.hh"
+
+#ifdef SQNICE_LOADABLE_EXTENSION
+#  include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#else
+#  include <sqlite3.h>
+#endif
+
+namespace sqnice {
+    using namespace std;
+
+
+    int64_t virtual_table_base::insert(function_args const&) {
+        throw database_error("virtual table is read-only", status::readonly);
+    }
+
+    void virtual_table_base::update(int64_t, function_args const&) {
+        throw database_error("virtual table is read-only", status::readonly);
+    }
+
+    void virtual_table_base::remove(int64_t) {
+        throw database_error("virtual table is read-only", status::readonly);
+    }
+
+
+#pragma mark - MODULE:
+
+
+    /// Implements the `sqlite3_module` callbacks by calling a `virtual_table_base`.
+    class virtual_table_module {
+    public:
+        static sqlite3_module const* module() {
+            static const sqlite3_module kModule = [] {
+                sqlite3_module m = {};
+                m.iVersion    = 1;
+                m.xCreate     = nullptr;      // NULL makes the module eponymous-only
+                m.xConnect    = xConnect;
+                m.xBestIndex  = xBestIndex;
+                m.xDisconnect = xDisconnect;
+                m.xDestroy    = xDisconnect;
+                m.xOpen       = xOpen;
+                m.xClose      = xClose;
+                m.xFilter     = xFilter;
+                m.xNext       = xNext;
+                m.xEof        = xEof;
+                m.xColumn     = xColumn;
+                m.xRowid      = xRowid;
+                m.xUpdate     = xUpdate;
+                m.xBegin      = xNoop;
+                m.xSync       = xNoop;
+                m.xCommit     = xCommit;
+                m.xRollback   = xCommit;    // changes can't be rolled back, so same as commit
+                return m;
+            }();
+            return &kModule;
+        }
+
+    private:
+        using table_ref = shared_ptr<virtual_table_base>;
+
+        struct vtab : sqlite3_vtab {
+            table_ref table;
+        };
+
+        struct vcursor : sqlite3_vtab_cursor {
+            unique_ptr<virtual_table_base::cursor> impl;
+        };
+
+        static virtual_table_base& table(sqlite3_vtab* v)   {return *static_cast<vtab*>(v)->table;}
+        static virtual_table_base::cursor& cursor(sqlite3_vtab_cursor* c) {
+            return *static_cast<vcursor*>(c)->impl;
+        }
+
+        // Calls `fn`, converting any exception it throws to a SQLite error code and message.
+        template <class FN>
+        static int guard(sqlite3_vtab* v, FN fn) noexcept {
+            try {
+                fn();
+                return SQLITE_OK;
+            } catch (database_error const& x) {
+                set_message(v, x.what());
+                return int(x.error_code);
+            } catch (bad_alloc const&) {
+                return SQLITE_NOMEM;
+            } catch (exception const& x) {
+                set_message(v, x.what());
+                return SQLITE_ERROR;
+            } catch (...) {
+                return SQLITE_ERROR;
+            }
+        }
+
+        static void set_message(sqlite3_vtab* v, const char* msg) noexcept {
+            sqlite3_free(v->zErrMsg);
+            v->zErrMsg = sqlite3_mprintf("%s", msg);
+        }
+
+        static int xConnect(sqlite3* db, void* aux, int, const char* const*,
+                            sqlite3_vtab** outVTab, char** outErr) noexcept {
+            try {
+                auto& tableRef = *static_cast<table_ref*>(aux);
+                if (int rc = sqlite3_declare_vtab(db, tableRef->declaration().c_str()); rc != 0)
+                    return rc;
+                auto v = new vtab{};
+                v->table = tableRef;
+                *outVTab = v;
+                return SQLITE_OK;
+            } catch (exception const& x) {
+                *outErr = sqlite3_mprintf("%s", x.what());
+                return SQLITE_ERROR;
+            }
+        }
+
+        static int xDisconnect(sqlite3_vtab* v) noexcept {
+            delete static_cast<vtab*>(v);
+            return SQLITE_OK;
+        }
+
+        static int xBestIndex(sqlite3_vtab* v, sqlite3_index_info* info) noexcept {
+            return guard(v, [&] {
+                virtual_table_base::index_info ii;
+                ii.constraints.reserve(info->nConstraint);
+                for (int i = 0; i < info->nConstraint; ++i) {
+                    auto& c = info->aConstraint[i];
+                    ii.constraints.push_back({c.iColumn,
+                                              virtual_table_base::constraint_op(c.op),
+                                              c.usable != 0,
+                                              sqlite3_vtab_collation(info, i)});
+                }
+                ii.order_by.reserve(info->nOrderBy);
+                for (int i = 0; i < info->nOrderBy; ++i)
+                    ii.order_by.push_back({info->aOrderBy[i].iColumn, info->aOrderBy[i].desc != 0});
+
+                table(v).best_index(ii);
+
+                for (int i = 0; i < info->nConstraint; ++i) {
+                    info->aConstraintUsage[i].argvIndex = ii.constraints[i].argv_index;
+                    info->aConstraintUsage[i].omit = 0;
+                }
+                info->idxNum = ii.idx_num;
+                info->estimatedCost = ii.estimated_cost;
+                info->estimatedRows = ii.estimated_rows;
+                info->orderByConsumed = ii.order_by_consumed;
+            });
+        }
+
+        static int xOpen(sqlite3_vtab* v, sqlite3_vtab_cursor** outCursor) noexcept {
+            return guard(v, [&] {
+                auto c = make_unique<vcursor>();
+                c->impl = table(v).open();
+                *outCursor = c.release();
+            });
+        }
+
+        static int xClose(sqlite3_vtab_cursor* c) noexcept {
+            delete static_cast<vcursor*>(c);
+            return SQLITE_OK;
+        }
+
+        static int xFilter(sqlite3_vtab_cursor* c, int idxNum, const char*,
+                           int argc, sqlite3_value** argv) noexcept {
+            return guard(c->pVtab, [&] {
+                cursor(c).filter(idxNum, function_args(argc, argv));
+            });
+        }
+
+        static int xNext(sqlite3_vtab_cursor* c) noexcept {
+            return guard(c->pVtab, [&] {cursor(c).next();});
+        }
+
+        static int xEof(sqlite3_vtab_cursor* c) noexcept {
+            return cursor(c).eof();
+        }
+
+        static int xColumn(sqlite3_vtab_cursor* c, sqlite3_context* ctx, int col) noexcept {
+            return guard(c->pVtab, [&] {
+                context cx(ctx);
+                cursor(c).column(cx.result, col);
+            });
+        }
+
+        static int xRowid(sqlite3_vtab_cursor* c, sqlite3_int64* outRowid) noexcept {
+            return guard(c->pVtab, [&] {*outRowid = cursor(c).rowid();});
+        }
+
+        static int xUpdate(sqlite3_vtab* v, int argc, sqlite3_value** argv,
+                           sqlite3_int64* outRowid) noexcept {
+            return guard(v, [&] {
+                auto& t = table(v);
+                if (argc == 1) {
+                    t.remove(sqlite3_value_int64(argv[0]));
+                } else if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+                    if (sqlite3_value_type(argv[1]) != SQLITE_NULL)
+                        throw database_error("virtual table rowids can't be assigned",
+                                             status::constraint);
+                    *outRowid = t.insert(function_args(argc - 2, argv + 2));
+                } else {
+                    int64_t rowid = sqlite3_value_int64(argv[0]);
+                    if (sqlite3_value_int64(argv[1]) != rowid)
+                        throw database_error("virtual table rowids can't be changed",
+                                             status::constraint);
+                    t.update(rowid, function_args(argc - 2, argv + 2));
+                }
+            });
+        }
+
+        static int xNoop(sqlite3_vtab*) noexcept  {return SQLITE_OK;}
+
+        static int xCommit(sqlite3_vtab* v) noexcept {
+            return guard(v, [&] {table(v).commit();});
+        }
+    };
+
+
+    status database::create_virtual_table(string_view name, shared_ptr<virtual_table_base> table) {
+        return check( sqlite3_create_module_v2(check_handle(),
+                                               string(name).c_str(),
+                                               virtual_table_module::module(),
+                                               new shared_ptr<virtual_table_base>(std::move(table)),
+                                               [](void* aux) {
+            delete static_cast<shared_ptr<virtual_table_base>*>(aux);
+        }) );
+    }
+
+}
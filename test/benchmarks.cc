@@ -0,0 +1,142 @@
+// Benchmarks. These are hidden test cases; run them with `sqnice_tests [.bench]`,
+// preferably from a Release build.
+
+#include "sqnice_test.hh"
+#include "sqnice/blob_stream.hh"
+#include "sqnice/collations.hh"
+#include "sqnice/functions.hh"
+#include "sqnice/statistics.hh"
+#include <sqlite3.h>
+#include <chrono>
+#include <cstdio>
+
+using namespace std;
+
+namespace {
+
+    // Runs a single-value query and prints how long it took.
+    template <typename T>
+    T time_query(sqnice::database& db, const char* label, string_view sql) {
+        sqnice::query qry(db, sql);
+        auto start = chrono::steady_clock::now();
+        T result = qry.single_value_or<T>(T{});
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        printf("    %-36s %9.2f ms\n", label, elapsed.count());
+        return result;
+    }
+
+    // A recursive CTE producing the integers 1...N, to call functions on.
+    constexpr const char* kSeries = "WITH RECURSIVE s(x) AS "
+                                    "(SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 1000000) ";
+
+    int64_t add_fn(int64_t a, int64_t b) noexcept {return a + b;}
+
+    void raw_add(sqlite3_context* ctx, int, sqlite3_value** argv) {
+        sqlite3_result_int64(ctx, sqlite3_value_int64(argv[0]) + sqlite3_value_int64(argv[1]));
+    }
+}
+
+
+TEST_CASE("SQNice function call overhead", "[.bench]") {
+    sqnice::database db;
+    db.open_temporary();
+    db.create_function<int64_t (int64_t,int64_t)>("add_std", [](int64_t a, int64_t b) {
+        return a + b;
+    });
+    db.create_function<&add_fn>("add_nttp");
+    REQUIRE(sqlite3_create_function_v2(db.handle(), "add_raw", 2, SQLITE_UTF8, nullptr,
+                                       raw_add, nullptr, nullptr, nullptr) == SQLITE_OK);
+
+    printf("Calling a 2-arg function on 1,000,000 rows:\n");
+    string q = kSeries;
+    auto base = time_query<int64_t>(db, "baseline (x + x)", q + "SELECT sum(x + x) FROM s");
+    auto r1 = time_query<int64_t>(db, "raw sqlite3_create_function_v2",
+                                  q + "SELECT sum(add_raw(x, x)) FROM s");
+    auto r2 = time_query<int64_t>(db, "create_function<&fn>",
+                                  q + "SELECT sum(add_nttp(x, x)) FROM s");
+    auto r3 = time_query<int64_t>(db, "create_function<F>(std::function)",
+                                  q + "SELECT sum(add_std(x, x)) FROM s");
+    CHECK(r1 == base);
+    CHECK(r2 == base);
+    CHECK(r3 == base);
+}
+
+
+TEST_CASE("SQNice statistics vs. SQL", "[.bench]") {
+    sqnice::database db;
+    db.open_temporary();
+    sqnice::register_statistics(db);
+    db.execute("CREATE TABLE data (x REAL)");
+    db.execute(string("INSERT INTO data ") + kSeries
+               + "SELECT (random() % 1000000) / 100.0 FROM s");
+
+    printf("Aggregates over 1,000,000 random values:\n");
+    auto v1 = time_query<double>(db, "var_samp(x)", "SELECT var_samp(x) FROM data");
+    auto v2 = time_query<double>(db, "variance in SQL",
+                                 "SELECT (sum(x*x) - sum(x)*sum(x)/count(x)) / (count(x) - 1)"
+                                 " FROM data");
+    CHECK(v1 == Approx(v2));
+
+    auto m1 = time_query<double>(db, "median(x)", "SELECT median(x) FROM data");
+    auto m2 = time_query<double>(db, "median in SQL (ORDER BY/OFFSET)",
+                                 "SELECT x FROM data ORDER BY x LIMIT 1"
+                                 " OFFSET (SELECT count(*) FROM data) / 2");
+    CHECK(m1 == Approx(m2).margin(0.01));
+
+    auto q1 = time_query<double>(db, "approx_quantile(x, 0.9)",
+                                 "SELECT approx_quantile(x, 0.9) FROM data");
+    auto q2 = time_query<double>(db, "0.9 quantile in SQL",
+                                 "SELECT x FROM data ORDER BY x LIMIT 1"
+                                 " OFFSET (SELECT count(*) FROM data) * 9 / 10");
+    CHECK(q1 == Approx(q2).epsilon(0.02));
+
+    auto d1 = time_query<int64_t>(db, "approx_count_distinct(x)",
+                                  "SELECT approx_count_distinct(x) FROM data");
+    auto d2 = time_query<int64_t>(db, "COUNT(DISTINCT x)", "SELECT count(DISTINCT x) FROM data");
+    CHECK(double(d1) == Approx(double(d2)).epsilon(0.05));
+}
+
+
+TEST_CASE("SQNice collation sorting", "[.bench]") {
+    sqnice::database db;
+    db.open_temporary();
+    sqnice::register_collations(db);
+    db.execute("CREATE TABLE names (name TEXT)");
+    db.execute(string("INSERT INTO names ") + kSeries
+               + "SELECT printf('Customer Account Number %d', random() % 1000000) FROM s"
+                 " LIMIT 200000");
+
+    printf("Sorting 200,000 strings:\n");
+    const char* sql = "SELECT count(*) FROM (SELECT name FROM names ORDER BY name COLLATE %s)";
+    for (auto collation : {"BINARY", "NOCASE", "unicode_nocase", "natural_sort", "numeric"}) {
+        char buf[200];
+        snprintf(buf, sizeof(buf), sql, collation);
+        CHECK(time_query<int64_t>(db, collation, buf) == 200000);
+    }
+}
+
+
+TEST_CASE("SQNice blob scanning", "[.bench]") {
+    sqnice::database db;
+    db.open_temporary();
+    db.execute("CREATE TABLE files (data BLOB)");
+    db.execute(string("INSERT INTO files ") + kSeries
+               + "SELECT randomblob(100) FROM s LIMIT 100000");
+
+    printf("Reading 100,000 blobs:\n");
+    char buf[100];
+    auto start = chrono::steady_clock::now();
+    for (int64_t rowid = 1; rowid <= 100000; ++rowid) {
+        sqnice::blob_stream blob(db, "files", "data", rowid, false);
+        (void)blob.pread(buf, sizeof(buf), 0);
+    }
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    printf("    %-36s %9.2f ms\n", "new blob_stream per row", elapsed.count());
+
+    start = chrono::steady_clock::now();
+    sqnice::blob_scanner scanner(db, "files", "data");
+    for (int64_t rowid = 1; rowid <= 100000; ++rowid)
+        (void)scanner.open(rowid).pread(buf, sizeof(buf), 0);
+    elapsed = chrono::steady_clock::now() - start;
+    printf("    %-36s %9.2f ms\n", "blob_scanner", elapsed.count());
+}
@@ -1,6 +1,24 @@
 #include "sqnice_test.hh"
+#include "sqnice/backup.hh"
+#include "sqnice/blob_stream.hh"
+#include "sqnice/change_feed.hh"
+#include "sqnice/checkpoint.hh"
+#include "sqnice/compaction.hh"
 #include "sqnice/functions.hh"
+#include "sqnice/large_object.hh"
+#include "sqnice/maintenance.hh"
+#include "sqnice/memory.hh"
 #include "sqnice/pool.hh"
+#include "sqnice/preupdate.hh"
+#include "sqnice/template_cache.hh"
+#include <sqlite3.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 using namespace std::placeholders;
@@ -82,6 +100,314 @@ TEST_CASE_METHOD(sqnice_test, "SQNice backup", "[sqnice]") {
     });
 }
 
+TEST_CASE("SQNice backup job", "[sqnice]") {
+    static constexpr string_view kDBPath = "sqnice_backup_src.sqlite3";
+    static constexpr const char* kBackupPath = "sqnice_backup_dst.sqlite3";
+    sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite
+                                                                | sqnice::open_flags::create);
+    {
+        auto db = pool.borrow_writeable();
+        db->execute("PRAGMA journal_mode=WAL");
+        db->execute("CREATE TABLE data (x BLOB)");
+        db->execute("WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 500)"
+                    " INSERT INTO data SELECT randomblob(4000) FROM s");
+    }
+
+    SECTION("Complete") {
+        sqnice::backup_options options;
+        options.pages_per_step = 16;
+        options.sleep_interval = 0ms;
+        int steps = 0;
+        options.on_progress = [&](sqnice::backup_progress const& p) {
+            CHECK(p.page_count > 500);
+            ++steps;
+        };
+        sqnice::backup_job job(pool, kBackupPath, options);
+        // Writes during the backup don't affect it, since it copies a snapshot:
+        pool.borrow_writeable()->execute("INSERT INTO data VALUES (randomblob(4000))");
+        CHECK(job.wait() == sqnice::status::ok);
+        CHECK(job.finished());
+        CHECK(steps > 1);
+        CHECK(job.progress().remaining == 0);
+        CHECK(job.progress().step_pages > 16);     // grew after clean steps
+
+        sqnice::database copy(kBackupPath, sqnice::open_flags::readwrite);
+        auto count = copy.query("SELECT count(*) FROM data").single_value<int>();
+        CHECK((count == 500 || count == 501));
+    }
+    SECTION("Canceled") {
+        sqnice::backup_options options;
+        options.pages_per_step = 4;
+        options.max_bytes_per_second = 100000;
+        sqnice::backup_job job(pool, kBackupPath, options);
+        this_thread::sleep_for(50ms);
+        job.cancel();
+        CHECK(job.wait() == sqnice::status::abort);
+        CHECK(job.error_message() == "backup canceled");
+        CHECK(job.progress().remaining > 0);
+    }
+
+    pool.close_all();
+    sqnice::database::delete_file(kDBPath);
+    sqnice::database::delete_file(kBackupPath);
+}
+
+TEST_CASE("SQNice compaction", "[sqnice]") {
+    static constexpr string_view kDBPath = "sqnice_compact.sqlite3";
+    sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite
+                                                                | sqnice::open_flags::create);
+    {
+        auto db = pool.borrow_writeable();
+        db->execute("PRAGMA journal_mode=WAL");
+        db->execute("CREATE TABLE data (id INTEGER PRIMARY KEY, x BLOB)");
+        db->execute("WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 500)"
+                    " INSERT INTO data SELECT x, randomblob(4000) FROM s");
+        db->execute("DELETE FROM data WHERE id % 10 != 0");
+        db->execute("PRAGMA wal_checkpoint(TRUNCATE)");
+    }
+
+    SECTION("Unblocked") {
+        auto result = sqnice::compact_database(pool);
+        CHECK(result.result == sqnice::status::ok);
+        CHECK(result.attempts == 1);
+        CHECK(result.new_size < result.old_size / 4);
+    }
+    SECTION("Blocking last attempt") {
+        sqnice::compaction_options options;
+        options.max_attempts = 1;
+        // The copy's connection is opened like the pool's own:
+        int opened = 0;
+        pool.on_open([&](sqnice::database&) {++opened;});
+        auto result = sqnice::compact_database(pool, options);
+        CHECK(result.result == sqnice::status::ok);
+        CHECK(result.new_size < result.old_size / 4);
+        CHECK(opened == 1);
+        pool.on_open(nullptr);
+    }
+    SECTION("Busy") {
+        // A writer that commits after every copy keeps making it stale:
+        sqnice::compaction_options options;
+        options.max_attempts = 2;
+        options.block_on_last_attempt = false;
+        atomic<bool> stop = false;
+        thread writer([&] {
+            while (!stop) {
+                pool.borrow_writeable()->execute(
+                                    "UPDATE data SET x = randomblob(4000) WHERE id=10");
+                this_thread::sleep_for(1ms);
+            }
+        });
+        auto result = sqnice::compact_database(pool, options);
+        stop = true;
+        writer.join();
+        CHECK(result.result == sqnice::status::busy);
+        CHECK(result.attempts == 2);
+        CHECK(result.new_size == result.old_size);
+        CHECK(!filesystem::exists(string(kDBPath) + "-compact"));
+    }
+    SECTION("Reader borrowing the writer") {
+        // A thread holding a reader while it borrows the writer can't return the reader until
+        // compaction gives up waiting for it:
+        sqnice::compaction_options options;
+        options.max_attempts = 1;
+        options.drain_timeout = 200ms;
+        auto reader = pool.borrow();
+        sqnice::compaction_result result;
+        thread compactor([&] {result = sqnice::compact_database(pool, options);});
+        while (pool.open_count() > 1)
+            this_thread::sleep_for(1ms);    // wait for compaction to close the idle writer
+        pool.borrow_writeable()->execute("UPDATE data SET x = randomblob(4000) WHERE id=10");
+        reader.reset();
+        compactor.join();
+        CHECK(result.result == sqnice::status::busy);
+        CHECK(result.new_size == result.old_size);
+        CHECK(!filesystem::exists(string(kDBPath) + "-compact"));
+    }
+
+    // The pool's connections reopen on the new file:
+    {
+        auto db = pool.borrow();
+        CHECK(db->query("SELECT count(*) FROM data").single_value<int>() == 50);
+        CHECK(db->query("PRAGMA integrity_check").single_value<string>() == "ok");
+    }
+    pool.close_all();
+    sqnice::database::delete_file(kDBPath);
+}
+
+#ifdef SQLITE_ENABLE_SESSION
+TEST_CASE_METHOD(sqnice_test, "SQNice change recorder", "[sqnice]") {
+    static constexpr const char* kLogPath = "sqnice_changes.log";
+    filesystem::remove(kLogPath);
+    sqnice::database replica("", sqnice::open_flags::memory);
+    replica.execute("CREATE TABLE contacts (id INTEGER PRIMARY KEY, name TEXT NOT NULL,"
+                    " phone TEXT NOT NULL, address TEXT, UNIQUE(name, phone))");
+    auto names = [](sqnice::database& d) {
+        string result;
+        for (auto& row : d.query("SELECT name FROM contacts ORDER BY id"))
+            result += row.get<string>(0) + " ";
+        return result;
+    };
+
+    sqnice::change_recorder recorder(db, kLogPath);
+    {
+        sqnice::transaction txn(db);
+        db.execute("INSERT INTO contacts (name, phone) VALUES ('Alice', '1'), ('Bob', '2')");
+        txn.commit();
+    }
+    CHECK(recorder.changesets_written() == 1);
+    {
+        sqnice::transaction txn(db);
+        db.execute("INSERT INTO contacts (name, phone) VALUES ('Mallory', '3')");
+        // rolled back
+    }
+    db.execute("UPDATE contacts SET phone = '555' WHERE name = 'Bob'");    // autocommit
+    CHECK(recorder.capture() == sqnice::status::ok);
+    CHECK(recorder.changesets_written() == 2);
+
+    uint64_t offset = sqnice::apply_log(replica, kLogPath);
+    CHECK(offset == filesystem::file_size(kLogPath));
+    CHECK(names(replica) == "Alice Bob ");
+    CHECK(replica.query("SELECT phone FROM contacts WHERE name = 'Bob'").single_value<string>()
+          == "555");
+
+    // Incremental update, with a conflicting row in the replica:
+    replica.execute("INSERT INTO contacts (id, name, phone) VALUES (3, 'Eve', '4')");
+    {
+        sqnice::transaction txn(db);
+        db.execute("INSERT INTO contacts (id, name, phone) VALUES (3, 'Carol', '4')");
+        db.execute("DELETE FROM contacts WHERE name = 'Alice'");
+        txn.commit();
+    }
+    auto abort = [](sqnice::conflict_type type, const char* table) {
+        CHECK(type == sqnice::conflict_type::conflict);
+        CHECK(string_view(table) == "contacts");
+        return sqnice::conflict_action::abort;
+    };
+    CHECK_THROWS_AS(sqnice::apply_log(replica, kLogPath, offset, abort), sqnice::database_error);
+    CHECK(names(replica) == "Alice Bob Eve ");
+
+    offset = sqnice::apply_log(replica, kLogPath, offset);     // default: incoming change wins
+    CHECK(offset == filesystem::file_size(kLogPath));
+    CHECK(names(replica) == "Bob Carol ");
+    filesystem::remove(kLogPath);
+}
+
+TEST_CASE_METHOD(sqnice_test, "SQNice change recorder after crash", "[sqnice]") {
+    static constexpr const char* kLogPath = "sqnice_changes_crash.log";
+    filesystem::remove(kLogPath);
+    {
+        sqnice::change_recorder recorder(db, kLogPath);
+        db.execute("INSERT INTO contacts (name, phone) VALUES ('Alice', '1')");
+    }
+    auto good_size = filesystem::file_size(kLogPath);
+
+    // Simulate a crash partway through appending a record:
+    if (FILE* f = fopen(kLogPath, "ab")) {
+        fwrite("\x40\0\0\0partial", 11, 1, f);
+        fclose(f);
+    }
+    {
+        sqnice::change_recorder recorder(db, kLogPath);
+        CHECK(filesystem::file_size(kLogPath) == good_size);
+
+        // The recorder follows its database when it's moved:
+        sqnice::database moved(std::move(db));
+        moved.execute("INSERT INTO contacts (name, phone) VALUES ('Bob', '2')");
+        CHECK(recorder.capture() == sqnice::status::ok);
+        db = std::move(moved);
+        db.execute("INSERT INTO contacts (name, phone) VALUES ('Carol', '3')");
+    }
+
+    sqnice::database replica("", sqnice::open_flags::memory);
+    replica.execute("CREATE TABLE contacts (id INTEGER PRIMARY KEY, name TEXT NOT NULL,"
+                    " phone TEXT NOT NULL, address TEXT, UNIQUE(name, phone))");
+    CHECK(sqnice::apply_log(replica, kLogPath) == filesystem::file_size(kLogPath));
+    CHECK(replica.query("SELECT group_concat(name, ' ') FROM contacts").single_value<string>()
+          == "Alice Bob Carol");
+    filesystem::remove(kLogPath);
+}
+
+TEST_CASE_METHOD(sqnice_test, "SQNice change recorder when database closes", "[sqnice]") {
+    static constexpr const char* kLogPath = "sqnice_changes_close.log";
+    filesystem::remove(kLogPath);
+    {
+        sqnice::change_recorder recorder(db, kLogPath);
+        db.execute("INSERT INTO contacts (name, phone) VALUES ('Alice', '1')");
+        // Closing captures the changes not yet written, then stops recording:
+        db.close();
+        CHECK(recorder.changesets_written() == 1);
+        CHECK(filesystem::file_size(kLogPath) > 0);
+        CHECK(recorder.capture() == sqnice::status::misuse);
+    }
+
+    sqnice::database replica("", sqnice::open_flags::memory);
+    replica.execute("CREATE TABLE contacts (id INTEGER PRIMARY KEY, name TEXT NOT NULL,"
+                    " phone TEXT NOT NULL, address TEXT, UNIQUE(name, phone))");
+    CHECK(sqnice::apply_log(replica, kLogPath) == filesystem::file_size(kLogPath));
+    CHECK(replica.query("SELECT name FROM contacts").single_value<string>() == "Alice");
+    filesystem::remove(kLogPath);
+}
+#endif
+
+TEST_CASE_METHOD(sqnice_test, "SQNice serialize", "[sqnice]") {
+    db.execute("INSERT INTO contacts (name, phone) VALUES ('Alice', '1'), ('Bob', '2')");
+    auto image = db.serialize();
+    CHECK(!image.is_view());
+    REQUIRE(image.size() > 0);
+    CHECK(image.size() % 512 == 0);
+
+    sqnice::database copy;
+    copy.deserialize(image.bytes());
+    CHECK(copy.query("SELECT count(*) FROM contacts").single_value<int>() == 2);
+    copy.execute("INSERT INTO contacts (name, phone) VALUES ('Carol', '3')");
+    CHECK(db.query("SELECT count(*) FROM contacts").single_value<int>() == 2);
+
+    // A deserialized database can be viewed without copying:
+    auto view = copy.serialize(true);
+    CHECK(view.is_view());
+    sqnice::database copy2;
+    copy2.deserialize(view.bytes(), sqnice::deserialize_flags::readonly);
+    CHECK(copy2.query("SELECT count(*) FROM contacts").single_value<int>() == 3);
+    CHECK_THROWS_AS(copy2.execute("DELETE FROM contacts"), sqnice::database_error);
+
+    CHECK_THROWS_AS(db.serialize(false, "nonexistent"), sqnice::database_error);
+}
+
+
+TEST_CASE("SQNice template cache", "[sqnice]") {
+    sqnice::template_cache cache;
+    int builds = 0;
+    auto init = [&](sqnice::database& db) {
+        ++builds;
+        db.execute("CREATE TABLE tenants (id INTEGER PRIMARY KEY, name TEXT)");
+        db.execute("INSERT INTO tenants (name) VALUES ('default')");
+    };
+    auto db1 = cache.clone("tenant", init);
+    auto db2 = cache.clone("tenant", init);
+    CHECK(builds == 1);
+    db1.execute("INSERT INTO tenants (name) VALUES ('acme')");
+    CHECK(db1.query("SELECT count(*) FROM tenants").single_value<int>() == 2);
+    CHECK(db2.query("SELECT count(*) FROM tenants").single_value<int>() == 1);
+    CHECK(cache.contains("tenant"));
+    CHECK_THROWS_AS(cache.clone("other"), invalid_argument);
+
+    // A template from a WAL-mode database file:
+    static constexpr string_view kDBPath = "sqnice_template.sqlite3";
+    {
+        sqnice::database file(kDBPath, sqnice::open_flags::delete_first
+                                       | sqnice::open_flags::defaults);
+        file.execute("PRAGMA journal_mode=WAL");
+        file.execute("CREATE TABLE t (x); INSERT INTO t VALUES (42)");
+        cache.add("wal", file);
+    }
+    sqnice::database::delete_file(kDBPath);
+    auto db3 = cache.clone("wal");
+    CHECK(db3.query("SELECT x FROM t").single_value<int>() == 42);
+    db3.execute("INSERT INTO t VALUES (43)");
+    cache.remove("wal");
+    CHECK(!cache.contains("wal"));
+}
+
 namespace {
     struct handler
     {
@@ -150,6 +476,242 @@ TEST_CASE_METHOD(sqnice_test, "SQNice callbacks", "[sqnice]") {
 
 }
 
+TEST_CASE("SQNice async log handler", "[sqnice]") {
+    mutex log_mutex;
+    vector<string> messages;
+    auto wait_for_messages = [&](size_t n) {
+        for (int i = 0; i < 200; ++i) {
+            {
+                unique_lock lock(log_mutex);
+                if (messages.size() >= n)
+                    break;
+            }
+            this_thread::sleep_for(10ms);
+        }
+        unique_lock lock(log_mutex);
+        return messages;
+    };
+
+    sqnice::async_log_options options;
+    options.max_per_second = 0;
+    auto rc = sqnice::database::set_async_log_handler([&](sqnice::status, const char* msg) {
+        unique_lock lock(log_mutex);
+        messages.push_back(msg);
+    }, options);
+    if (rc == sqnice::status::misuse) {
+        WARN("This SQLite version can't change the log callback after initialization");
+        return;
+    }
+    auto start = sqnice::database::async_log_stats();
+
+    // Concurrent loggers:
+    vector<thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([t] {
+            for (int i = 0; i < 20; ++i)
+                sqlite3_log(SQLITE_WARNING, "thread %d message %d", t, i);
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    auto stats = sqnice::database::async_log_stats();
+    CHECK(wait_for_messages(80 - (stats.dropped - start.dropped)).size()
+          == 80 - (stats.dropped - start.dropped));
+
+    // Repeated messages are collapsed:
+    messages.clear();
+    for (int i = 0; i < 10; ++i)
+        sqlite3_log(SQLITE_WARNING, "same old thing");
+    sqlite3_log(SQLITE_WARNING, "something new");
+    CHECK(wait_for_messages(3) == vector<string>{"same old thing",
+                                                 "(last message repeated 9 times)",
+                                                 "something new"});
+
+    // Rate limiting:
+    options.max_per_second = 5;
+    options.dedup = false;
+    CHECK(sqnice::database::set_async_log_handler([&](sqnice::status, const char* msg) {
+        unique_lock lock(log_mutex);
+        messages.push_back(msg);
+    }, options) == sqnice::status::ok);
+    this_thread::sleep_for(150ms);  // let the handler go idle
+    { unique_lock lock(log_mutex); messages.clear(); }
+    start = sqnice::database::async_log_stats();
+    for (int i = 0; i < 50; ++i)
+        sqlite3_log(SQLITE_WARNING, "message %d", i);
+    this_thread::sleep_for(150ms);
+    stats = sqnice::database::async_log_stats();
+    CHECK(stats.rate_limited - start.rate_limited >= 40);
+    {
+        unique_lock lock(log_mutex);
+        CHECK(messages.size() <= 10);
+    }
+
+    // A rate-limited message wasn't delivered, so it isn't deduplicated against:
+    options.max_per_second = 1;
+    options.dedup = true;
+    CHECK(sqnice::database::set_async_log_handler([&](sqnice::status, const char* msg) {
+        unique_lock lock(log_mutex);
+        messages.push_back(msg);
+    }, options) == sqnice::status::ok);
+    this_thread::sleep_for(1100ms);  // report the earlier suppressions, then refill the bucket
+    { unique_lock lock(log_mutex); messages.clear(); }
+    start = sqnice::database::async_log_stats();
+    sqlite3_log(SQLITE_WARNING, "first");
+    sqlite3_log(SQLITE_WARNING, "second");
+    sqlite3_log(SQLITE_WARNING, "second");
+    CHECK(wait_for_messages(1) == vector<string>{"first"});
+    this_thread::sleep_for(50ms);
+    stats = sqnice::database::async_log_stats();
+    CHECK(stats.rate_limited - start.rate_limited == 2);
+    CHECK(stats.duplicates - start.duplicates == 0);
+
+    sqnice::database::set_async_log_handler(nullptr);
+}
+
+TEST_CASE_METHOD(sqnice_test, "SQNice change feed", "[sqnice]") {
+    db.execute("CREATE TABLE items (name TEXT)");
+    db.execute("INSERT INTO items VALUES ('a'), ('b'), ('c')");
+    sqnice::change_feed feed(db);
+    auto sub = feed.subscribe();
+    CHECK(sub->try_pop() == nullptr);
+
+    {
+        sqnice::transaction txn(db);
+        db.execute("UPDATE items SET name = 'A' WHERE rowid = 1");
+        db.execute("UPDATE items SET name = 'AA' WHERE rowid = 1");
+        db.execute("INSERT INTO items VALUES ('d')");
+        db.execute("UPDATE items SET name = 'D' WHERE rowid = 4");
+        db.execute("INSERT INTO items VALUES ('e')");
+        db.execute("DELETE FROM items WHERE rowid = 5");
+        db.execute("DELETE FROM items WHERE rowid = 2");
+        txn.commit();
+    }
+    {
+        sqnice::transaction txn(db);
+        db.execute("DELETE FROM items");
+        txn.rollback();
+    }
+    db.execute("DELETE FROM items WHERE rowid = 3");     // autocommit
+
+    // Consume on another thread:
+    vector<sqnice::change_batch_ref> batches;
+    thread consumer([&] {
+        while (auto batch = sub->pop())
+            batches.push_back(batch);
+    });
+    db.execute("INSERT INTO items VALUES ('f')");
+    this_thread::sleep_for(10ms);
+    feed.unsubscribe(*sub);
+    consumer.join();
+    CHECK(sub->closed());
+    CHECK(!sub->take_overflow());
+
+    using enum sqnice::change_op;
+    REQUIRE(batches.size() == 3);
+    CHECK(batches[0]->sequence == 1);
+    REQUIRE(batches[0]->changes.size() == 3);
+    CHECK(batches[0]->changes[0].op == update);
+    CHECK(batches[0]->changes[0].table == "items");
+    CHECK(batches[0]->changes[0].rowid == 1);
+    CHECK(batches[0]->changes[1].op == insert);
+    CHECK(batches[0]->changes[1].rowid == 4);
+    CHECK(batches[0]->changes[2].op == remove);
+    CHECK(batches[0]->changes[2].rowid == 2);
+
+    CHECK(batches[1]->sequence == 2);
+    REQUIRE(batches[1]->changes.size() == 1);
+    CHECK(batches[1]->changes[0].op == remove);
+    CHECK(batches[1]->changes[0].rowid == 3);
+    CHECK(batches[2]->sequence == 3);
+    CHECK(feed.last_sequence() == 3);
+
+    // A full queue drops batches and reports overflow:
+    auto small = feed.subscribe(2);
+    for (int i = 0; i < 5; ++i)
+        db.execute("INSERT INTO items VALUES ('x')");
+    CHECK(small->take_overflow());
+    CHECK(small->try_pop()->sequence == 4);
+    CHECK(small->try_pop()->sequence == 5);
+    CHECK(small->try_pop() == nullptr);
+}
+
+#ifdef SQLITE_ENABLE_PREUPDATE_HOOK
+TEST_CASE_METHOD(sqnice_test, "SQNice preupdate hook", "[sqnice]") {
+    db.execute("CREATE TABLE items (name TEXT, price REAL, data BLOB)");
+    db.execute("INSERT INTO items VALUES ('apple', 1.5, x'0102')");
+
+    SECTION("Hook") {
+        vector<string> log;
+        sqnice::preupdate_hook hook(db, [&](sqnice::preupdate_change const& change) {
+            string entry = string(change.table()) + ":" + to_string(int(change.op()));
+            if (change.op() != sqnice::change_op::insert)
+                entry += " old=" + change.old_value(0).get<string>();
+            if (change.op() != sqnice::change_op::remove)
+                entry += " new=" + change.new_value(0).get<string>();
+            CHECK(change.column_count() == 3);
+            log.push_back(entry);
+        });
+        db.execute("UPDATE items SET name = 'pear' WHERE rowid = 1");
+        db.execute("INSERT INTO items VALUES ('fig', 2, NULL)");
+        db.execute("DELETE FROM items WHERE name = 'fig'");
+        CHECK(log == vector<string>{"items:23 old=apple new=pear",
+                                    "items:18 new=fig",
+                                    "items:9 old=fig"});
+    }
+    SECTION("Audit recorder") {
+        vector<byte> flushed;
+        size_t flushed_count = 0;
+        sqnice::audit_recorder recorder(db, [&](span<const byte> records, size_t count) {
+            flushed.assign(records.begin(), records.end());
+            flushed_count = count;
+        });
+        {
+            sqnice::transaction txn(db);
+            db.execute("UPDATE items SET price = 2.5 WHERE rowid = 1");
+            db.execute("INSERT INTO items VALUES ('fig', 2, NULL)");
+            db.execute("DELETE FROM items WHERE rowid = 1");
+            txn.commit();
+        }
+        {
+            sqnice::transaction txn(db);
+            db.execute("DELETE FROM items");
+            txn.rollback();
+        }
+        CHECK(flushed_count == 3);
+        CHECK(recorder.records_flushed() == 3);
+
+        vector<sqnice::audit_record> records;
+        sqnice::decode_audit_records(flushed, [&](sqnice::audit_record const& rec) {
+            records.push_back(rec);
+        });
+        REQUIRE(records.size() == 3);
+        using enum sqnice::change_op;
+        CHECK(records[0].op == update);
+        CHECK(records[0].table == "items");
+        CHECK(records[0].old_rowid == 1);
+        CHECK(records[0].new_rowid == 1);
+        REQUIRE(records[0].old_values.size() == 3);
+        CHECK(get<string_view>(records[0].old_values[0]) == "apple");
+        CHECK(get<double>(records[0].old_values[1]) == 1.5);
+        CHECK(get<sqnice::blob>(records[0].old_values[2]).size == 2);
+        CHECK(!records[0].new_values[0]);                       // unchanged
+        CHECK(get<double>(*records[0].new_values[1]) == 2.5);
+
+        CHECK(records[1].op == insert);
+        CHECK(records[1].new_rowid == 2);
+        CHECK(records[1].old_values.empty());
+        CHECK(get<int64_t>(*records[1].new_values[1]) == 2);
+        CHECK(holds_alternative<nullptr_t>(*records[1].new_values[2]));
+
+        CHECK(records[2].op == remove);
+        CHECK(records[2].old_rowid == 1);
+        CHECK(get<double>(records[2].old_values[1]) == 2.5);
+        CHECK(records[2].new_values.empty());
+    }
+}
+#endif
+
 TEST_CASE("SQNice pool", "[sqnice]") {
     static constexpr string_view kDBPath = "sqnice_test.sqlite3";
     sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite);
@@ -223,6 +785,343 @@ TEST_CASE("SQNice pool", "[sqnice]") {
     sqnice::database::delete_file(kDBPath);
 }
 
+TEST_CASE("SQNice in-memory pool", "[sqnice]") {
+    CHECK_THROWS_AS(sqnice::pool("", sqnice::open_flags::temporary), invalid_argument);
+
+    auto flags = sqnice::open_flags::memory;
+    {
+        sqnice::pool pool("sqnice_pool_test", flags);
+        CHECK(pool.filename() == "file:/sqnice_pool_test?vfs=memdb");
+        pool.borrow_writeable()->execute(
+            "CREATE TABLE data (x INTEGER);"
+            "WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 1000)"
+            " INSERT INTO data SELECT x FROM s");
+
+        // Readers on several threads see the writer's data, and can't change it:
+        vector<thread> threads;
+        atomic<int> found = 0, rejected = 0;
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&] {
+                auto db = pool.borrow();
+                if (db->query("SELECT sum(x) FROM data").single_value<int>() == 500500)
+                    ++found;
+                try {
+                    const_cast<sqnice::database&>(*db).execute("DELETE FROM data");
+                } catch (sqnice::database_error const&) {
+                    ++rejected;
+                }
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+        CHECK(found == 4);
+        CHECK(rejected == 4);
+
+        // Other connections can open it by its URI:
+        sqnice::database other(pool.filename(), sqnice::open_flags::uri);
+        CHECK(other.query("SELECT count(*) FROM data").single_value<int>() == 1000);
+
+        // The data survives closing all the pool's connections:
+        pool.close_all();
+        CHECK(pool.open_count() == 0);
+        CHECK(pool.borrow()->query("SELECT count(*) FROM data").single_value<int>() == 1000);
+
+        // An unnamed in-memory pool is private:
+        sqnice::pool priv("", flags);
+        CHECK(priv.filename() != pool.filename());
+        CHECK(priv.borrow()->query("SELECT count(*) FROM sqlite_schema").single_value<int>() == 0);
+    }
+
+    // The database went away with the pool:
+    sqnice::pool pool("sqnice_pool_test", flags);
+    CHECK(pool.borrow()->query("SELECT count(*) FROM sqlite_schema").single_value<int>() == 0);
+}
+
+
+TEST_CASE("SQNice pool long readers", "[sqnice]") {
+    static constexpr string_view kDBPath = "sqnice_readers.sqlite3";
+    sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite
+                                                                | sqnice::open_flags::create);
+    pool.borrow_writeable()->execute(
+        "PRAGMA journal_mode=WAL; CREATE TABLE data (x INTEGER);"
+        "WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 100)"
+        " INSERT INTO data SELECT x FROM s");
+
+    auto idle = pool.borrow();
+    auto reader = pool.borrow();
+    CHECK(pool.check_readers(0ms).empty());
+
+    {
+        sqnice::query q(*reader, "SELECT x FROM data WHERE x > ?");
+        q.bind(1, 10);
+        auto row = q.begin();
+        CHECK(row->get<int>(0) == 11);
+
+        auto found = pool.check_readers(0ms);
+        REQUIRE(found.size() == 1);
+        CHECK(found[0].db == reader.get());
+        CHECK(found[0].sql == "SELECT x FROM data WHERE x > 10");
+
+        CHECK(pool.check_readers(50ms).empty());
+        this_thread::sleep_for(60ms);
+        found = pool.check_readers(50ms, sqnice::long_reader_action::recycle);
+        REQUIRE(found.size() == 1);
+        CHECK(found[0].age >= 50ms);
+
+        // The interrupted query fails:
+        CHECK_THROWS_AS(++row, sqnice::database_error);
+    }
+    CHECK(pool.check_readers(0ms).empty());
+
+    // The recycled database is closed when returned:
+    CHECK(pool.open_count() == 3);
+    reader.reset();
+    CHECK(pool.open_count() == 2);
+
+    idle.reset();
+    pool.close_all();
+    sqnice::database::delete_file(kDBPath);
+}
+
+TEST_CASE("SQNice metrics", "[sqnice]") {
+    static constexpr string_view kDBPath = "sqnice_metrics.sqlite3";
+    sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite
+                                                                | sqnice::open_flags::create);
+    {
+        auto writer = pool.borrow_writeable();
+        writer->execute(
+            "CREATE TABLE data (x INTEGER);"
+            "WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 1000)"
+            " INSERT INTO data SELECT x FROM s");
+        auto m = writer->metrics();
+        CHECK(m.connections == 1);
+        CHECK(m.cache_writes > 0);
+        CHECK(m.cache_used > 0);
+        CHECK(m.schema_used > 0);
+        CHECK(m.memory_used > 0);
+        CHECK(m.memory_highwater >= m.memory_used);
+        CHECK(m.largest_malloc > 0);
+    }
+    {
+        auto r1 = pool.borrow(), r2 = pool.borrow();
+        CHECK(r1->query("SELECT sum(x) FROM data").single_value<int>() == 500500);
+        CHECK(r2->query("SELECT count(*) FROM data").single_value<int>() == 1000);
+    }
+
+    // Two idle readers and the idle writer:
+    auto m = pool.metrics();
+    CHECK(m.connections == 3);
+    CHECK(m.connections_busy == 0);
+    CHECK(m.cache_misses > 0);
+    CHECK(m.cache_writes > 0);
+    auto idle = m;
+
+    // A borrowed connection whose mutex is held by another thread is skipped:
+    auto reader = pool.borrow();
+    mutex m1;
+    condition_variable cond;
+    bool locked = false, done = false;
+    thread t([&] {
+        sqlite3_mutex_enter(sqlite3_db_mutex(reader->handle()));
+        unique_lock lock(m1);
+        locked = true;
+        cond.notify_all();
+        cond.wait(lock, [&] {return done;});
+        sqlite3_mutex_leave(sqlite3_db_mutex(reader->handle()));
+    });
+    {
+        unique_lock lock(m1);
+        cond.wait(lock, [&] {return locked;});
+    }
+    m = pool.metrics();
+    CHECK(m.connections == 2);
+    CHECK(m.connections_busy == 1);
+    // ...but its counters, as last sampled, are still included:
+    CHECK(m.cache_hits == idle.cache_hits);
+    CHECK(m.cache_misses == idle.cache_misses);
+    {
+        unique_lock lock(m1);
+        done = true;
+        cond.notify_all();
+    }
+    t.join();
+    CHECK(pool.metrics().connections == 3);
+
+    string text = m.prometheus("sqlite", "db=\"test\"");
+    CHECK(text.find("# TYPE sqlite_cache_hits_total counter\n") != string::npos);
+    CHECK(text.find("# TYPE sqlite_memory_used_bytes gauge\n") != string::npos);
+    CHECK(text.find("\nsqlite_connections{db=\"test\"} 2\n") != string::npos);
+    CHECK(text.find("\nsqlite_connections_busy{db=\"test\"} 1\n") != string::npos);
+
+    // Counters don't go backwards when the pool closes connections:
+    reader.reset();
+    pool.close_unused();
+    m = pool.metrics();
+    CHECK(m.connections == 0);
+    CHECK(m.cache_hits >= idle.cache_hits);
+    CHECK(m.cache_misses >= idle.cache_misses);
+    CHECK(m.cache_writes >= idle.cache_writes);
+
+    pool.close_all();
+    sqnice::database::delete_file(kDBPath);
+}
+
+
+TEST_CASE("SQNice maintenance scheduler", "[sqnice]") {
+    static constexpr string_view kDBPath = "sqnice_maintenance.sqlite3";
+    sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite
+                                                                | sqnice::open_flags::create);
+    {
+        auto db = pool.borrow_writeable();
+        db->setup();
+        db->execute("CREATE TABLE data (x BLOB)");
+        db->execute("WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 200)"
+                    " INSERT INTO data SELECT randomblob(4000) FROM s");
+        db->execute("DELETE FROM data");
+        CHECK(db->pragma("freelist_count") >= 200);
+    }
+
+    sqnice::maintenance_options options;
+    options.check_interval = 10ms;
+    options.vacuum_threshold_pages = 1;
+    options.vacuum_pages_per_slice = 16;
+    options.optimize_after_writes = 1;
+    {
+        sqnice::maintenance_scheduler scheduler(pool, options);
+
+        // Meanwhile the writeable database is still available to real clients:
+        pool.borrow_writeable()->execute("INSERT INTO data VALUES (1)");
+
+        sqnice::maintenance_stats stats;
+        for (int i = 0; i < 500; ++i) {
+            stats = scheduler.stats();
+            if (stats.pages_reclaimed >= 200 && stats.optimize_runs > 0)
+                break;
+            scheduler.run_now();
+            this_thread::sleep_for(10ms);
+        }
+        CHECK(stats.pages_reclaimed >= 200);
+        CHECK(stats.vacuum_slices > 10);
+        CHECK(stats.optimize_runs > 0);
+        CHECK(stats.errors == 0);
+        CHECK(stats.time_spent.count() > 0);
+        CHECK(pool.borrow()->query("PRAGMA freelist_count").single_value<int>() == 0);
+    }
+    pool.close_all();
+    sqnice::database::delete_file(kDBPath);
+}
+
+TEST_CASE("SQNice maintenance checkpoints after vacuum", "[sqnice]") {
+    static constexpr string_view kDBPath = "sqnice_maintenance_ckpt.sqlite3";
+    sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite
+                                                                | sqnice::open_flags::create);
+    pool.set_auto_checkpoint(0);
+    {
+        auto db = pool.borrow_writeable();
+        db->setup();
+        db->execute("CREATE TABLE data (x BLOB)");
+        db->execute("WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 100)"
+                    " INSERT INTO data SELECT randomblob(4000) FROM s");
+        db->execute("DELETE FROM data");
+    }
+
+    // Reads the WAL-index header's `mxFrame` and the checkpoint info's `nBackfill`:
+    auto wal_frames = [] {
+        uint32_t fields[25] = {};
+        if (FILE* f = fopen((string(kDBPath) + "-shm").c_str(), "rb")) {
+            (void)fread(fields, sizeof(fields), 1, f);
+            fclose(f);
+        }
+        return pair<uint32_t,uint32_t>(fields[4], fields[24]);
+    };
+    auto [frames, backfilled] = wal_frames();
+    CHECK(frames > 0);
+    CHECK(backfilled < frames);
+
+    sqnice::maintenance_options options;
+    options.check_interval = 10ms;
+    options.vacuum_threshold_pages = 1;
+    options.optimize_interval = 0s;
+    options.optimize_after_writes = 0;
+    {
+        sqnice::maintenance_scheduler scheduler(pool, options);
+        for (int i = 0; i < 500; ++i) {
+            if (scheduler.stats().pages_reclaimed >= 100) {
+                tie(frames, backfilled) = wal_frames();
+                if (backfilled == frames)
+                    break;
+            }
+            scheduler.run_now();
+            this_thread::sleep_for(10ms);
+        }
+        CHECK(scheduler.stats().pages_reclaimed >= 100);
+        CHECK(scheduler.stats().errors == 0);
+    }
+    CHECK(frames > 0);
+    CHECK(backfilled == frames);
+
+    pool.close_all();
+    sqnice::database::delete_file(kDBPath);
+}
+
+TEST_CASE("SQNice checkpoint controller", "[sqnice]") {
+    static constexpr string_view kDBPath = "sqnice_checkpoint.sqlite3";
+    sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite
+                                                                | sqnice::open_flags::create);
+    pool.borrow_writeable()->execute("PRAGMA journal_mode=WAL; CREATE TABLE data (x BLOB)");
+
+    auto wait_for = [](auto fn) {
+        for (int i = 0; i < 500 && !fn(); ++i)
+            this_thread::sleep_for(10ms);
+        return fn();
+    };
+    {
+        // Checkpoints only run when asked to, so they can't race the writes below:
+        sqnice::checkpoint_options options;
+        options.interval = 1h;
+        options.restart_wal_size = 100'000;
+        options.truncate_wal_size = 1'000'000;
+        sqnice::checkpoint_controller controller(pool, options);
+        {
+            auto db = pool.borrow_writeable();
+            CHECK(db->pragma("wal_autocheckpoint") == 0);
+            CHECK(db->pragma("busy_timeout") >= 100);
+            for (int i = 0; i < 30; ++i)
+                db->execute("INSERT INTO data VALUES (randomblob(4000))");
+        }
+        controller.run_now();
+        CHECK(wait_for([&] {return controller.stats().restart_count > 0;}));
+        auto stats = controller.stats();
+        CHECK(stats.passive_count > 0);
+        CHECK(stats.max_duration.count() > 0);
+
+        // A huge transaction makes the controller truncate the WAL:
+        pool.borrow_writeable()->execute("WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1"
+                                         " FROM s WHERE x < 500)"
+                                         " INSERT INTO data SELECT randomblob(4000) FROM s");
+        controller.run_now();
+        CHECK(wait_for([&] {return controller.stats().truncate_count > 0;}));
+        stats = controller.stats();
+        CHECK(stats.wal_size == 0);
+        CHECK(stats.frames_behind == 0);
+        CHECK(stats.busy_count == 0);
+    }
+    CHECK(pool.borrow_writeable()->pragma("wal_autocheckpoint") == 1000);
+    CHECK(pool.borrow_writeable()->pragma("busy_timeout") == 0);
+
+    // The pool's own setting is restored afterwards:
+    pool.set_auto_checkpoint(500);
+    {
+        sqnice::checkpoint_controller controller(pool);
+        CHECK(pool.borrow_writeable()->pragma("wal_autocheckpoint") == 0);
+    }
+    CHECK(pool.auto_checkpoint() == 500);
+    CHECK(pool.borrow_writeable()->pragma("wal_autocheckpoint") == 500);
+
+    pool.close_all();
+    sqnice::database::delete_file(kDBPath);
+}
+
 
 TEST_CASE("SQNice schema migration", "[sqnice]") {
     static constexpr string_view kDBPath = "sqnice_test.sqlite3";
@@ -280,3 +1179,215 @@ TEST_CASE("SQNice schema migration", "[sqnice]") {
 
     open_v2(0);
 }
+
+
+TEST_CASE_METHOD(sqnice_test, "SQNice blob scanner", "[sqnice]") {
+    db.execute("CREATE TABLE files (name TEXT, data BLOB)");
+    auto ins = db.command("INSERT INTO files (name, data) VALUES (?, ?)");
+    for (int i = 0; i < 100; ++i) {
+        string data(i, char('a' + i % 26));
+        ins.execute(to_string(i), sqnice::blob(data.data(), data.size()));
+    }
+    ins.execute("null", nullptr);
+
+    sqnice::blob_scanner scanner(db, "files", "data");
+    auto q = db.query("SELECT rowid FROM files WHERE data NOT NULL ORDER BY rowid DESC");
+    size_t total = 0;
+    int rows = 0;
+    scanner.scan(q, [&](int64_t rowid, sqnice::blob_stream& blob) {
+        CHECK(blob.size() == size_t(rowid - 1));
+        char buf[100];
+        CHECK(blob.pread(buf, sizeof(buf), 0) == int(blob.size()));
+        CHECK(std::all_of(&buf[0], &buf[blob.size()], [&](char c) {
+            return c == char('a' + (rowid - 1) % 26);
+        }));
+        total += blob.size();
+        ++rows;
+    });
+    CHECK(rows == 100);
+    CHECK(total == 4950);
+
+    // A failed reopen doesn't spoil the scanner:
+    CHECK_THROWS_AS(scanner.open(101), sqnice::database_error);      // NULL value
+    CHECK_THROWS_AS(scanner.open(9999), sqnice::database_error);     // no such row
+    CHECK(scanner.open(11).size() == 10);
+}
+
+
+TEST_CASE_METHOD(sqnice_test, "SQNice blob streambuf", "[sqnice]") {
+    db.execute("CREATE TABLE files (data BLOB)");
+    db.execute("INSERT INTO files (data) VALUES (zeroblob(100000))");
+    sqnice::blob_stream blob(db, "files", "data", db.last_insert_rowid(), true);
+    {
+        sqnice::blob_iostream out(blob, 1000);
+        for (int i = 0; i < 10000; ++i)
+            out << char('0' + i % 10) << "abcdefghi";
+        CHECK(out.good());
+        out.put('x');                           // can't write past the end
+        CHECK(out.bad());
+    }
+
+    sqnice::blob_iostream in(blob, 1000);
+    char buf[10] = {};
+    CHECK(in.read(buf, 10));
+    CHECK(string_view(buf, 10) == "0abcdefghi");
+    in.seekg(50015);
+    CHECK(in.read(buf, 5));
+    CHECK(string_view(buf, 5) == "efghi");
+    in.seekg(-3, ios::cur);                     // within the buffer
+    CHECK(in.get() == 'g');
+    CHECK(in.buf().position() == 50018);
+
+    // Large reads bypass the buffer:
+    in.seekg(0);
+    string big(30000, 0);
+    CHECK(in.read(big.data(), big.size()));
+    CHECK(big.substr(29990) == "9abcdefghi");
+
+    auto span = in.buf().read_span(4);
+    REQUIRE(span.size() == 4);
+    CHECK(char(span[0]) == '0');
+    CHECK(in.get() == 'd');
+
+    in.seekg(-5, ios::end);
+    string tail;
+    in >> tail;
+    CHECK(tail == "efghi");
+    CHECK(in.eof());
+}
+
+
+TEST_CASE_METHOD(sqnice_test, "SQNice blob writer", "[sqnice]") {
+    db.execute("CREATE TABLE files (name TEXT DEFAULT 'untitled', data BLOB)");
+    string expected;
+    int64_t rowid;
+    {
+        sqnice::blob_writer writer(db, "files", "data", 0, 1000);
+        for (int i = 0; i < 1000; ++i) {
+            string line = to_string(i) + " bottles of beer on the wall\n";
+            writer.write(line);
+            expected += line;
+        }
+        string big(5000, '*');                  // larger than a chunk
+        writer.write(big);
+        expected += big;
+        writer.write("end");
+        expected += "end";
+        CHECK(writer.size() == expected.size());
+        rowid = writer.finish();
+        CHECK_THROWS_AS(writer.write("more"), invalid_argument);
+    }
+    auto q = db.query("SELECT name, data FROM files WHERE rowid = ?");
+    {
+        auto row = q(rowid).begin();
+        CHECK(string_view(row->get<const char*>(0)) == "untitled");
+        auto data = row->get<sqnice::blob>(1);
+        CHECK(string_view((const char*)data.data, data.size) == expected);
+    }
+
+    // With an exact size hint, and finished by the destructor:
+    {
+        sqnice::blob_writer writer(db, "files", "data", 10);
+        writer.write("0123456789");
+        rowid = writer.rowid();
+    }
+    CHECK(q(rowid).begin()->get<string>(1) == "0123456789");
+
+    // Nothing written:
+    rowid = sqnice::blob_writer(db, "files", "data").finish();
+    CHECK(db.query("SELECT length(data) FROM files WHERE rowid = ?")(rowid)
+            .single_value<int>() == 0);
+}
+
+
+TEST_CASE("SQNice large object", "[sqnice]") {
+    static constexpr string_view kDBPath = "sqnice_lob_test.sqlite3";
+    sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite
+                                                                | sqnice::open_flags::create);
+    auto db = pool.borrow_writeable();
+    sqnice::large_object_store store(*db, "media", 1000);   // tiny chunks, to test boundaries
+    int64_t id = store.create();
+    CHECK(store.exists(id));
+
+    // Some data with a recognizable pattern:
+    auto pattern = [](uint64_t pos) {return uint8_t((pos * 7919) >> 3);};
+    vector<uint8_t> data(10500);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = pattern(i);
+
+    sqnice::large_object obj(*db, "media", id);
+    CHECK(obj.size() == 0);
+    obj.append(data.data(), 2500);      // ends mid-chunk
+    obj.append(data.data() + 2500, 8000);
+    REQUIRE(obj.size() == 10500);
+
+    vector<uint8_t> buf(12000);
+    CHECK(obj.pread(buf.data(), 12000, 0) == 10500);
+    CHECK(memcmp(buf.data(), data.data(), 10500) == 0);
+    CHECK(obj.pread(buf.data(), 100, 1950) == 100);
+    CHECK(memcmp(buf.data(), &data[1950], 100) == 0);
+    CHECK(obj.pread(buf.data(), 100, 10500) == 0);
+    CHECK_THROWS(obj.pread(buf.data(), 100, 10501));
+
+    // Overwrite across chunk boundaries and past the end:
+    vector<uint8_t> ones(2000, 1);
+    obj.pwrite(ones.data(), ones.size(), 9900);
+    CHECK(obj.size() == 11900);
+    CHECK(obj.pread(buf.data(), 12000, 0) == 11900);
+    CHECK(memcmp(buf.data(), data.data(), 9900) == 0);
+    CHECK(std::all_of(&buf[9900], &buf[11900], [](uint8_t b) {return b == 1;}));
+
+    // Writing past the end zero-fills the gap:
+    obj.pwrite(ones.data(), 10, 13000);
+    CHECK(obj.size() == 13010);
+    CHECK(obj.pread(buf.data(), 1200, 11800) == 1200);
+    CHECK(buf[99] == 1);
+    CHECK(std::all_of(&buf[100], &buf[1200], [](uint8_t b) {return b == 0;}));
+
+    // Truncating, then growing again:
+    obj.truncate(4321);
+    CHECK(obj.size() == 4321);
+    CHECK(obj.pread(buf.data(), 12000, 0) == 4321);
+    CHECK(memcmp(buf.data(), data.data(), 4321) == 0);
+    obj.truncate(6000);
+    CHECK(obj.pread(buf.data(), 12000, 0) == 6000);
+    CHECK(memcmp(buf.data(), data.data(), 4321) == 0);
+    CHECK(std::all_of(&buf[4321], &buf[6000], [](uint8_t b) {return b == 0;}));
+    CHECK(db->query("SELECT count(*) FROM media_chunks").single_value<int>() == 6);
+
+    // Small appends write in place; a chunk's blob is only regrown a few times:
+    {
+        int64_t id2 = store.create();
+        sqnice::large_object obj2(*db, "media", id2);
+        int64_t changes = db->total_changes();
+        for (size_t pos = 0; pos < 3000; pos += 10)
+            obj2.append(&data[pos], 10);
+        // (Each append also saves the size)
+        CHECK(db->total_changes() - changes < 300 + 3 * 10);
+        REQUIRE(obj2.size() == 3000);
+        CHECK(obj2.pread(buf.data(), 12000, 0) == 3000);
+        CHECK(memcmp(buf.data(), data.data(), 3000) == 0);
+        store.remove(id2);
+    }
+
+    // A read-only object on another connection, and parallel reads:
+    obj.pwrite(data.data(), data.size(), 0);
+    {
+        auto rdb = pool.borrow();
+        sqnice::large_object robj(*rdb, "media", id);
+        CHECK(robj.size() == 10500);
+        std::fill(buf.begin(), buf.end(), 0);
+        CHECK(robj.pread_parallel(pool, buf.data(), 10000, 250, 3) == 10000);
+        CHECK(memcmp(buf.data(), &data[250], 10000) == 0);
+        CHECK_THROWS_AS(robj.truncate(0), std::logic_error);
+    }
+
+    store.remove(id);
+    CHECK(!store.exists(id));
+    CHECK(db->query("SELECT count(*) FROM media_chunks").single_value<int>() == 0);
+    CHECK_THROWS_AS(sqnice::large_object(*db, "media", id), sqnice::database_error);
+
+    db.reset();
+    pool.close_all();
+    sqnice::database::delete_file(kDBPath);
+}
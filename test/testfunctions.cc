@@ -1,5 +1,9 @@
 #include "sqnice_test.hh"
+#include "sqnice/collations.hh"
+#include "sqnice/compression.hh"
 #include "sqnice/functions.hh"
+#include "sqnice/statistics.hh"
+#include <regex>
 
 using namespace std;
 
@@ -29,6 +33,18 @@ namespace {
     {
         return s1 + s2 + s3;
     }
+
+    int64_t times(int64_t a, double b) noexcept {
+        return int64_t(a * b);
+    }
+
+    void nothing(int) { }
+
+    int fails(int n) {
+        if (n < 0)
+            throw std::domain_error("negative!");
+        return n;
+    }
 }
 
 TEST_CASE_METHOD(sqnice_test, "SQNice function", "[sqnice]") {
@@ -55,6 +71,51 @@ TEST_CASE_METHOD(sqnice_test, "SQNice function args", "[sqnice]") {
     CHECK(hello_name == "Hello Mike");
 }
 
+TEST_CASE_METHOD(sqnice_test, "SQNice function pointer", "[sqnice]") {
+    db.create_function<&times>("times", sqnice::function_flags::deterministic);
+    db.create_function<&test6>("concat3");
+    db.create_function<&nothing>("noop");
+    db.create_function<&fails>("fails");
+
+    sqnice::query qry(db, "SELECT times(6, 7.5), concat3('a', 'b', 'c'), noop(1), fails(3)");
+    auto iter = qry.begin();
+    CHECK(iter[0].get<int64_t>() == 45);
+    CHECK(iter[1].get<string>() == "abc");
+    CHECK(iter[2].type() == sqnice::data_type::null);
+    CHECK(iter[3].get<int>() == 3);
+
+    CHECK_THROWS_AS(db.query("SELECT fails(-1)").single_value<int>(), sqnice::database_error);
+    // Wrong number of args is caught by SQLite when compiling:
+    CHECK_THROWS_AS(db.query("SELECT times(1)"), std::invalid_argument);
+}
+
+TEST_CASE_METHOD(sqnice_test, "SQNice cached function arg", "[sqnice]") {
+    int compiled = 0;
+    db.create_function("regexp", [&](sqnice::function_args args, sqnice::function_result result) {
+        auto& re = args.cached_arg<std::regex>(0, [&](sqnice::arg_value const& pattern) {
+            ++compiled;
+            return std::regex(pattern.get<string>());
+        });
+        result = std::regex_search(args[1].get<string>(), re);
+    }, 2, sqnice::function_flags::deterministic);
+
+    auto ins = db.command("INSERT INTO contacts (name, phone) VALUES (?, '555-1212')");
+    for (const char* name : {"Alice", "Bob", "Carol", "Anna", "Dave", "Alfred"})
+        ins.execute(name);
+
+    auto qry = db.query("SELECT count(*) FROM contacts WHERE name REGEXP '^A.*[ae]$'");
+    CHECK(qry.single_value<int>() == 2);
+    CHECK(compiled == 1);     // pattern is constant, so it's compiled once per execution
+    CHECK(qry.single_value<int>() == 2);
+    CHECK(compiled == 2);
+
+    // If the pattern isn't constant, the factory is called on every row:
+    compiled = 0;
+    qry = db.query("SELECT count(*) FROM contacts WHERE regexp(substr(name, 1, 1), 'AB')");
+    CHECK(qry.single_value<int>() == 4);
+    CHECK(compiled == 6);
+}
+
 TEST_CASE("SQNice functions", "[sqnice]") {
     sqnice::database db;
     db.open_temporary();
@@ -158,6 +219,41 @@ TEST_CASE_METHOD(sqnice_test, "SQNice aggregate", "[sqnice]") {
     expect_eq(16, (*iter).get<int>(1));
 }
 
+namespace {
+    struct moving_sum {
+        void step(int64_t n)        {sum_ += n; ++steps;}
+        void inverse(int64_t n)     {sum_ -= n; ++inverses;}
+        int64_t value() const       {return sum_;}
+        int64_t finish() const      {return sum_;}
+        int64_t sum_ = 0;
+
+        static inline int steps = 0, inverses = 0;
+    };
+}
+
+TEST_CASE_METHOD(sqnice_test, "SQNice window function", "[sqnice]") {
+    db.create_window_function<moving_sum, int64_t>("moving_sum");
+    db.execute("CREATE TABLE series (x INTEGER)");
+    auto ins = db.command("INSERT INTO series (x) VALUES (?)");
+    for (int i = 1; i <= 100; ++i)
+        ins.execute(i * i);
+
+    // As a window function, compared with the built-in sum():
+    sqnice::query qry(db, "SELECT moving_sum(x) OVER w, sum(x) OVER w FROM series"
+                          " WINDOW w AS (ORDER BY x ROWS BETWEEN 4 PRECEDING AND CURRENT ROW)");
+    int rows = 0;
+    for (auto& row : qry) {
+        CHECK(row.get<int64_t>(0) == row.get<int64_t>(1));
+        ++rows;
+    }
+    CHECK(rows == 100);
+    CHECK(moving_sum::steps == 100);
+    CHECK(moving_sum::inverses == 95);   // each row after the 5th slides one row out
+
+    // It also works as a regular aggregate:
+    CHECK(db.query("SELECT moving_sum(x) FROM series").single_value<int64_t>() == 338350);
+}
+
 TEST_CASE("SQNice aggregate functions", "[.sqnice]") {
     //FIXME: Needs a pre-populated database
     sqnice::database db;
@@ -189,3 +285,168 @@ TEST_CASE("SQNice aggregate functions", "[.sqnice]") {
     }
     cout << endl;
 }
+
+
+TEST_CASE_METHOD(sqnice_test, "SQNice statistics", "[sqnice]") {
+    sqnice::register_statistics(db);
+    db.execute("CREATE TABLE nums (x)");
+    {
+        sqnice::transaction txn(db);
+        auto ins = db.command("INSERT INTO nums (x) VALUES (?)");
+        for (int i = 1; i <= 10000; ++i)
+            ins.execute(i);
+        ins.execute(nullptr);           // NULLs are ignored
+        txn.commit();
+    }
+    auto value = [&](const char* sql) {return db.query(sql).single_value<double>().value();};
+
+    CHECK(value("SELECT kahan_sum(x) FROM nums") == 50005000.0);
+    CHECK(value("SELECT mean(x) FROM nums") == 5000.5);
+    CHECK(value("SELECT var_pop(x) FROM nums") == Approx(8333333.25));
+    CHECK(value("SELECT var_samp(x) FROM nums") == Approx(8334166.6667));
+    CHECK(value("SELECT stddev(x) FROM nums") == Approx(2886.8952));
+    CHECK(value("SELECT median(x) FROM nums") == 5000.5);
+    CHECK(value("SELECT median(x) FROM nums WHERE x <= 9") == 5.0);
+    CHECK(value("SELECT approx_quantile(x, 0.9) FROM nums") == Approx(9000).epsilon(0.02));
+    CHECK(value("SELECT approx_quantile(x, 0.5) FROM nums") == Approx(5000).epsilon(0.02));
+    CHECK(value("SELECT approx_count_distinct(x) FROM nums") == Approx(10000).epsilon(0.05));
+    CHECK(value("SELECT approx_count_distinct(x % 100) FROM nums") == Approx(100).epsilon(0.02));
+    CHECK(value("SELECT approx_count_distinct(x % 2 = 0) FROM nums") == 2);
+
+    // Empty input produces NULL:
+    CHECK(db.query("SELECT mean(x) IS NULL FROM nums WHERE x < 0").single_value<bool>() == true);
+    CHECK(db.query("SELECT var_samp(x) IS NULL FROM nums WHERE x = 1").single_value<bool>() == true);
+    // ...except for approx_count_distinct, which is like COUNT:
+    CHECK(db.query("SELECT approx_count_distinct(x) FROM nums WHERE x < 0").single_value<int>()
+          == 0);
+    CHECK(db.query("SELECT typeof(approx_count_distinct(x)) FROM nums WHERE x IS NULL")
+            .single_value<string>() == "integer");
+
+    // Compensated summation doesn't lose the small values:
+    CHECK(value("SELECT kahan_sum(column1) FROM (VALUES (1e100), (1.0), (-1e100))") == 1.0);
+
+    // Sliding-window variance matches the whole-window computation:
+    sqnice::query win(db, "SELECT var_samp(x) OVER (ORDER BY x ROWS 9 PRECEDING) FROM nums"
+                          " WHERE x IS NOT NULL LIMIT 100 OFFSET 20");
+    for (auto& row : win)
+        CHECK(row.get<double>(0) == Approx(9.1666667));
+}
+
+
+TEST_CASE_METHOD(sqnice_test, "SQNice collations", "[sqnice]") {
+    using sqnice::compare_unicode_nocase, sqnice::compare_natural, sqnice::compare_numeric;
+    auto sgn = [](int c) {return (c > 0) - (c < 0);};
+
+    CHECK(compare_unicode_nocase("", "") == 0);
+    CHECK(compare_unicode_nocase("The quick brown fox JUMPS", "the QUICK brown fox jumps") == 0);
+    CHECK(sgn(compare_unicode_nocase("The quick brown fox jumps", "the quick brown fox")) == 1);
+    CHECK(sgn(compare_unicode_nocase("abcdefgh_ijk", "ABCDEFGH_IJL")) == -1);
+    CHECK(compare_unicode_nocase("Crème Brûlée à la façon de Zoë",
+                                 "CRÈME BRÛLÉE À LA FAÇON DE ZOË") == 0);
+    CHECK(compare_unicode_nocase("ΣΟΦΊΑ", "σοφία") == 0);
+    CHECK(compare_unicode_nocase("Достоевский", "ДОСТОЕВСКИЙ") == 0);
+    CHECK(sgn(compare_unicode_nocase("Zoë", "zoe")) == 1);
+
+    CHECK(sgn(compare_natural("file2", "file10")) == -1);
+    CHECK(sgn(compare_natural("File 2 of 10", "file 10 of 10")) == -1);
+    CHECK(sgn(compare_natural("version-1.10.3-release", "VERSION-1.9.12-release")) == 1);
+    CHECK(sgn(compare_natural("a0000000000000000000000099z", "a100z")) == -1);
+    CHECK(sgn(compare_natural("x007", "x7")) == 1);        // same value; more zeroes sorts later
+    CHECK(compare_natural("Photo 12.jpg", "photo 12.JPG") == 0);
+
+    CHECK(sgn(compare_numeric("9", "10")) == -1);
+    CHECK(sgn(compare_numeric("-10", "-9")) == -1);
+    CHECK(sgn(compare_numeric("2.5", "2.45")) == 1);
+    CHECK(sgn(compare_numeric("123456789012345678901234567890", "123456789012345678901234567891"))
+          == -1);
+    CHECK(sgn(compare_numeric(" 1.50 kg", "1.5 lb")) == -1);
+    CHECK(sgn(compare_numeric("-0", "0")) == -1);          // equal value; binary tie-break
+    CHECK(sgn(compare_numeric("1e5", "abc")) == -1);       // numbers before non-numbers
+    CHECK(sgn(compare_numeric("abc", "abd")) == -1);
+
+    sqnice::register_collations(db);
+    db.execute("CREATE TABLE files (name TEXT COLLATE natural_sort)");
+    db.execute("INSERT INTO files VALUES ('img12.png'), ('IMG3.png'), ('img100.png'),"
+               " ('img1.png')");
+    string names;
+    for (auto row : db.query("SELECT name FROM files ORDER BY name"))
+        names += row.get<string>(0) + " ";
+    CHECK(names == "img1.png IMG3.png img12.png img100.png ");
+    CHECK(db.query("SELECT count(*) FROM files WHERE name = 'IMG12.PNG'").single_value<int>() == 1);
+
+    // Custom collations:
+    db.create_collation("reverse", [](string_view a, string_view b) {return b.compare(a);});
+    CHECK(db.query("SELECT name FROM files ORDER BY name COLLATE reverse LIMIT 1")
+            .single_value<string>() == "img12.png");
+}
+
+
+TEST_CASE_METHOD(sqnice_test, "SQNice compression", "[sqnice]") {
+    using sqnice::compressed, sqnice::decompressed;
+    string json = "[";
+    for (int i = 0; i < 200; ++i)
+        json += "{\"id\": " + to_string(i) + ", \"name\": \"item\", \"tags\": [\"a\", \"b\"]},";
+    json.back() = ']';
+    string bytes(1000, '\0');
+    for (size_t i = 0; i < bytes.size(); ++i)
+        bytes[i] = char(i % 7);
+
+    db.execute("CREATE TABLE docs (id INTEGER PRIMARY KEY, body)");
+    auto ins = db.command("INSERT INTO docs (id, body) VALUES (?, ?)");
+    ins.execute(1, compressed(json));
+    ins.execute(2, compressed("short"));            // too small; stored as plain text
+    ins.execute(3, "plain");                         // never compressed
+    ins.execute(4, compressed(sqnice::blob(bytes.data(), bytes.size())));
+    ins.execute(5, nullptr);
+
+    auto types = db.query("SELECT typeof(body), length(body) FROM docs WHERE id = ?");
+    {
+        auto row = types(1).begin();
+        CHECK(row->get<string>(0) == "blob");
+        CHECK(row->get<size_t>(1) < json.size() / 4);
+    }
+    CHECK(types(2).single_value<string>() == "text");
+
+    auto body = db.query("SELECT body FROM docs WHERE id = ?");
+    CHECK(body(1).single_value<decompressed>() == json);
+    CHECK(body(2).single_value<decompressed>() == "short");
+    CHECK(body(3).single_value<decompressed>() == "plain");
+    CHECK(body(4).single_value<decompressed>() == bytes);
+    CHECK(body(5).begin()->get<decompressed>(0).empty());
+
+    // SQL functions:
+    sqnice::register_compression(db);
+    auto decomp = db.query("SELECT decompress(body), typeof(decompress(body)) FROM docs"
+                           " WHERE id = ?");
+    for (int id = 1; id <= 5; ++id) {
+        auto row = decomp(id).begin();
+        static constexpr const char* kTypes[] = {"text", "text", "text", "blob", "null"};
+        CHECK(row->get<string>(1) == kTypes[id - 1]);
+    }
+    CHECK(decomp(1).single_value<string>() == json);
+    db.execute("UPDATE docs SET body = compress(decompress(body), 19)");
+    CHECK(body(1).single_value<decompressed>() == json);
+    CHECK(body(4).single_value<decompressed>() == bytes);
+    CHECK(db.query("SELECT count(*) FROM docs WHERE decompress(body) LIKE '%\"id\": 199%'")
+            .single_value<int>() == 1);
+
+    // Plain blobs, including ones that look a bit like encoded values, pass through unchanged:
+    CHECK(db.query("SELECT hex(decompress(x'C1FFFF'))").single_value<string>() == "C1FFFF");
+    CHECK(db.query("SELECT hex(decompress(x'C05A510100000000FF'))").single_value<string>()
+          == "C05A510100000000FF");
+    string plain = bytes;
+    plain[0] = char(0xC0);
+    ins.execute(6, sqnice::blob(plain.data(), plain.size()));
+    CHECK(body(6).single_value<decompressed>() == plain);
+
+    // An encoded value whose payload was damaged fails the checksum, so it's returned as-is:
+    auto encoded = sqnice::compress_value(json, false).first;
+    encoded[encoded.size() / 2] ^= 0x55;
+    CHECK(sqnice::decompress_value(encoded, true) == make_pair(encoded, true));
+
+    // A blob that *is* an encoded value gets wrapped, so it round-trips:
+    encoded = sqnice::compress_value(bytes, true).first;
+    auto wrapped = sqnice::compress_value(encoded, true).first;
+    CHECK(wrapped.size() > encoded.size());
+    CHECK(sqnice::decompress_value(wrapped, true) == make_pair(encoded, true));
+}
@@ -0,0 +1,94 @@
+// Tests of sqnice/memory.hh. These configure SQLite's allocator and page cache, which has to
+// happen before SQLite is initialized, so they run in their own executable.
+
+#define CATCH_CONFIG_RUNNER
+
+#include "sqnice_test.hh"
+#include "sqnice/memory.hh"
+#include "sqnice/pool.hh"
+#include <sqlite3.h>
+#include <cstdio>
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    if (auto rc = sqnice::memory::configure({.page_cache_budget = 4 << 20});
+            rc != sqnice::status::ok) {
+        fprintf(stderr, "memory::configure failed with status %d\n", int(rc));
+        return 1;
+    }
+    return Catch::Session().run(argc, argv);
+}
+
+TEST_CASE("SQNice memory", "[sqnice]") {
+    sqnice::database db;
+    db.open_temporary();
+    // `main` has already configured the pooled allocator, and SQLite is now initialized, so
+    // it's too late to change it:
+    CHECK(sqnice::memory::configure() == sqnice::status::misuse);
+
+    CHECK(sqnice::memory::set_lookaside(db, 256, 64) == sqnice::status::ok);
+    db.execute("CREATE TABLE t (a TEXT, b INTEGER)");
+    db.execute("WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 1000)"
+               " INSERT INTO t SELECT printf('row %d', x), x FROM s");
+    CHECK(db.query("SELECT count(*) FROM t WHERE a LIKE '%5%'").single_value<int>() == 271);
+
+    if (!sqlite3_compileoption_used("OMIT_LOOKASIDE")) {
+        auto lookaside = sqnice::memory::lookaside_stats(db, true);
+        CHECK(lookaside.hits > 0);
+        CHECK(lookaside.highwater > 0);
+        CHECK(lookaside.highwater <= 64);
+        CHECK(sqnice::memory::lookaside_stats(db).hits == 0);      // was reset
+    }
+
+    auto stats = sqnice::memory::stats();
+    CHECK(stats.cache_hits > 0);
+    CHECK(stats.cache_misses > 0);
+
+    // Once warmed up, allocations mostly reuse blocks from the thread's cache:
+    auto before = stats;
+    for (int i = 0; i < 10; ++i)
+        CHECK(db.query("SELECT count(*) FROM t WHERE a LIKE '%5%'").single_value<int>() == 271);
+    stats = sqnice::memory::stats();
+    CHECK(stats.cache_hits - before.cache_hits > stats.cache_misses - before.cache_misses);
+}
+
+TEST_CASE("SQNice shared page cache", "[sqnice]") {
+    // `main` has configured a 4MB shared page cache.
+    REQUIRE(sqnice::memory::cache_stats().budget == 4 << 20);
+
+    static constexpr string_view kDBPath = "sqnice_page_cache.sqlite3";
+    sqnice::pool pool(kDBPath, sqnice::open_flags::delete_first | sqnice::open_flags::readwrite
+                                                                | sqnice::open_flags::create);
+    pool.on_open([](sqnice::database& db) {
+        if (db.is_writeable())
+            sqnice::memory::prioritize_cache(db);
+    });
+    auto writer = pool.borrow_writeable();
+    writer->execute(
+        "PRAGMA journal_mode=WAL; CREATE TABLE hot (x BLOB); CREATE TABLE big (x BLOB);"
+        "WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 50)"
+        " INSERT INTO hot SELECT randomblob(3000) FROM s;"
+        "WITH RECURSIVE s(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM s WHERE x < 2500)"
+        " INSERT INTO big SELECT randomblob(3000) FROM s");
+    const char* kScanHot = "SELECT sum(length(x)) FROM hot";
+    CHECK(writer->query(kScanHot).single_value<int64_t>() == 50 * 3000);
+
+    // A reader scanning a table twice the size of the budget evicts its own pages, not the
+    // writer's:
+    auto before = sqnice::memory::cache_stats();
+    CHECK(pool.borrow()->query("SELECT sum(length(x)) FROM big").single_value<int64_t>()
+          == 2500 * 3000);
+    auto after = sqnice::memory::cache_stats();
+    CHECK(after.evictions - before.evictions > 1000);
+    CHECK(after.used <= after.budget);
+
+    CHECK(writer->query(kScanHot).single_value<int64_t>() == 50 * 3000);
+    auto rescan = sqnice::memory::cache_stats();
+    CHECK(rescan.misses == after.misses);
+    CHECK(rescan.hits > after.hits);
+
+    writer.reset();
+    pool.close_all();
+    sqnice::database::delete_file(kDBPath);
+}
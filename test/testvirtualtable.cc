@@ -0,0 +1,121 @@
+#include "sqnice_test.hh"
+#include "sqnice/virtual_table.hh"
+#include <vector>
+
+using namespace std;
+
+namespace {
+    struct city {
+        int64_t id;
+        string  name;
+        double  population;
+    };
+
+    using city_table = sqnice::virtual_table<const vector<city>>;
+}
+
+
+TEST_CASE_METHOD(sqnice_test, "SQNice virtual table", "[sqnice]") {
+    const vector<city> cities = {       // sorted by id
+        {1, "Amsterdam", 0.9}, {3, "Berlin", 3.6}, {4, "Cairo", 10.0},
+        {7, "Denver", 0.7}, {8, "Edinburgh", 0.5}, {12, "Fukuoka", 1.6},
+    };
+    auto table = make_shared<city_table>(cities);
+    table->column("id", &city::id)
+          .column("name", &city::name)
+          .column("population", &city::population)
+          .column("big", [](city const& c) {return c.population >= 1.0;})
+          .sorted_by("id");
+    db.create_virtual_table("cities", table);
+
+    auto names = [&](string_view sql) {
+        string result;
+        for (auto row : sqnice::query(db, sql)) {
+            if (!result.empty()) result += ",";
+            result += row.get<string>(0);
+        }
+        return result;
+    };
+    auto plan = [&](string_view sql) {
+        return sqnice::query(db, "EXPLAIN QUERY PLAN " + string(sql)).begin()->get<string>(3);
+    };
+
+    CHECK(names("SELECT name FROM cities") == "Amsterdam,Berlin,Cairo,Denver,Edinburgh,Fukuoka");
+    CHECK(names("SELECT name FROM cities WHERE big") == "Berlin,Cairo,Fukuoka");
+    CHECK(sqnice::query(db, "SELECT sum(population) FROM cities").single_value<double>()
+          == Approx(17.3));
+
+    // Equality and range constraints on the sorted column use binary search:
+    CHECK(names("SELECT name FROM cities WHERE id = 7") == "Denver");
+    CHECK(names("SELECT name FROM cities WHERE id = 5") == "");
+    CHECK(names("SELECT name FROM cities WHERE id > 3 AND id <= 8") == "Cairo,Denver,Edinburgh");
+    CHECK(names("SELECT name FROM cities WHERE id >= 3 AND id < 8") == "Berlin,Cairo,Denver");
+    CHECK(names("SELECT name FROM cities WHERE id > 7.5") == "Edinburgh,Fukuoka");
+    CHECK(names("SELECT name FROM cities WHERE id < '4'") == "Amsterdam,Berlin"); // affinity
+    CHECK(plan("SELECT name FROM cities WHERE id = 7").find("INDEX 1:") != string::npos);
+    CHECK(plan("SELECT name FROM cities WHERE id > 3 AND id <= 8").find("INDEX 18:")
+          != string::npos);
+
+    // Rowids are positions:
+    CHECK(sqnice::query(db, "SELECT rowid FROM cities WHERE name = 'Denver'").single_value<int>()
+          == 3);
+
+    // Joining with a real table; the join is done by binary search on `id`:
+    db.execute("CREATE TABLE visits (city_id INTEGER, year INTEGER)");
+    db.execute("INSERT INTO visits VALUES (3, 2019), (12, 2023), (3, 2024), (99, 2024)");
+    CHECK(names("SELECT name FROM visits JOIN cities ON cities.id = visits.city_id"
+                " ORDER BY year") == "Berlin,Fukuoka,Berlin");
+
+    // Binary search isn't used for other collations, since the sort order differs:
+    vector<city> words = {{1, "Banana", 0}, {2, "apple", 0}, {3, "cherry", 0}};  // BINARY order
+    auto by_name = make_shared<city_table>(words);
+    by_name->column("name", &city::name).sorted_by("name");
+    db.create_virtual_table("words", by_name);
+    CHECK(names("SELECT name FROM words WHERE name = 'apple'") == "apple");
+    CHECK(names("SELECT name FROM words WHERE name >= 'b'") == "cherry");
+    CHECK(names("SELECT name FROM words WHERE name = 'BANANA' COLLATE NOCASE") == "Banana");
+    CHECK(names("SELECT name FROM words WHERE name >= 'b' COLLATE NOCASE") == "Banana,cherry");
+    CHECK(plan("SELECT name FROM words WHERE name = 'apple'").find("INDEX 1:") != string::npos);
+    CHECK(plan("SELECT name FROM words WHERE name = 'x' COLLATE NOCASE").find("INDEX 0:")
+          != string::npos);
+
+    // Writes fail because the table isn't writeable:
+    db.exceptions(false);
+    CHECK(db.execute("DELETE FROM cities WHERE id = 1") == sqnice::status::readonly);
+}
+
+
+TEST_CASE_METHOD(sqnice_test, "SQNice writeable virtual table", "[sqnice]") {
+    vector<city> cities = {{1, "Amsterdam", 0.9}, {3, "Berlin", 3.6}, {4, "Cairo", 10.0}};
+    auto table = make_shared<sqnice::virtual_table<vector<city>>>(cities);
+    table->column("id", &city::id)
+          .column("name", &city::name)
+          .column("population", &city::population)
+          .writeable([](sqnice::function_args const& values) {
+              return city{values[0], values[1], values[2]};
+          });
+    db.create_virtual_table("cities", table);
+
+    db.execute("INSERT INTO cities VALUES (7, 'Denver', 0.7)");
+    REQUIRE(cities.size() == 4);
+    CHECK(cities[3].name == "Denver");
+
+    db.execute("UPDATE cities SET population = 3.7 WHERE name = 'Berlin'");
+    CHECK(cities[1].population == 3.7);
+
+    db.execute("DELETE FROM cities WHERE population < 1.0");
+    REQUIRE(cities.size() == 2);
+    CHECK(cities[0].name == "Berlin");
+    CHECK(cities[1].name == "Cairo");
+
+    {
+        // Deleted rows vanish immediately, but aren't erased till the transaction ends:
+        sqnice::transaction txn(db);
+        db.execute("DELETE FROM cities WHERE id = 3");
+        CHECK(cities.size() == 2);
+        CHECK(sqnice::query(db, "SELECT count(*) FROM cities").single_value<int>() == 1);
+        txn.commit();
+    }
+    REQUIRE(cities.size() == 1);
+    CHECK(cities[0].name == "Cairo");
+}